@@ -0,0 +1,74 @@
+#!/bin/sh
+# Check that `whereami --rev REV PATH LINE` gives the same answer as running
+# `whereami` on the output of `git show REV:PATH`, for loose objects and, after
+# `git gc`, for packed objects including deltified blobs.
+#
+# Usage: tests/rev_objects.sh [WHEREAMI [SOURCEFILE]]
+# (defaults: ./whereami and whereami.cpp; the test repository is built from the
+# first lines of SOURCEFILE)
+
+WHEREAMI=${1:-./whereami}
+SOURCE=${2:-whereami.cpp}
+case $WHEREAMI in
+    /*) ;;
+    *) WHEREAMI=$(pwd)/$WHEREAMI ;;
+esac
+
+repo=$(mktemp -d)
+shown=$(mktemp -d) # keeps the file name, so the language is detected the same way
+expected=$(mktemp)
+actual=$(mktemp)
+trap 'rm -rf "$repo" "$shown" "$expected" "$actual"' EXIT
+head -n 3000 "$SOURCE" > "$repo/a.cpp"
+cd "$repo" || exit 1
+
+git init -q . || exit 1
+commit() {
+    git add a.cpp b.py && git -c user.name=test -c user.email=test@example.com commit -q -m "$1" || exit 1
+}
+
+# Each revision changes a little of a.cpp so that `git gc` stores most of them as deltas.
+printf 'def f(x):\n    if x:\n        return 1\n    return 2\n' > b.py
+commit first
+sed -i.bak '100,120d' a.cpp
+printf 'class C:\n    def g(self):\n        pass\n' >> b.py
+commit second
+sed -i.bak '500s/^/\/\/ moved\n/' a.cpp
+commit third
+sed -i.bak '1000,1004d' a.cpp
+commit fourth
+rm -f a.cpp.bak
+
+status=0
+check_revs() {
+    for rev in HEAD HEAD~1 HEAD~2 HEAD~3; do
+        for path in a.cpp b.py; do
+            git show "$rev:$path" > "$shown/$path" || exit 1
+            n_lines=$(wc -l < "$shown/$path")
+            for line in 1 3 5 50 99 100 101 499 500 501 999 1000 2000 2979; do
+                [ "$line" -le "$n_lines" ] || continue
+                "$WHEREAMI" "$shown/$path" "$line" > "$expected" 2>&1
+                "$WHEREAMI" --rev "$rev" "$path" "$line" > "$actual" 2>&1
+                if ! cmp -s "$expected" "$actual"; then
+                    echo "FAIL: --rev $rev $path $line ($1 objects) differs from git show:"
+                    diff "$expected" "$actual" | head -20
+                    status=1
+                fi
+            done
+        done
+    done
+}
+
+check_revs loose
+git gc -q --aggressive || exit 1
+if [ -n "$(find .git/objects -path '*/objects/??/*' -type f)" ]; then
+    echo "FAIL: git gc left loose objects"
+    status=1
+fi
+if ! git verify-pack -v .git/objects/pack/*.idx | grep -q '^[0-9a-f]* blob  *[0-9]* [0-9]* [0-9]* [0-9]* [0-9a-f]*$'; then
+    echo "FAIL: git gc did not deltify any blob"
+    status=1
+fi
+check_revs packed
+[ $status -eq 0 ] && echo "PASS: --rev for loose and packed objects"
+exit $status
@@ -0,0 +1,27 @@
+#!/bin/sh
+# Check that `whereami --sizes --top N` prints the N largest scopes of the full
+# `--sizes` output, largest first (ties broken by bytes, then by label).
+#
+# Usage: tests/sizes_top.sh [WHEREAMI [SOURCEFILE...]]
+# (defaults: ./whereami and whereami.cpp)
+
+WHEREAMI=${1:-./whereami}
+[ $# -gt 0 ] && shift
+[ $# -gt 0 ] || set -- whereami.cpp
+
+expected=$(mktemp)
+actual=$(mktemp)
+trap 'rm -f "$expected" "$actual"' EXIT
+
+status=0
+for n in 1 2 5 20 100 1000; do
+    "$WHEREAMI" --sizes "$@" | LC_ALL=C sort -t "$(printf '\t')" -k1,1nr -k3,3nr -k5 | head -n "$n" > "$expected"
+    "$WHEREAMI" --sizes --top "$n" "$@" > "$actual"
+    if ! cmp -s "$expected" "$actual"; then
+        echo "FAIL: --top $n differs from the sorted --sizes output:"
+        diff "$expected" "$actual" | head -20
+        status=1
+    fi
+done
+[ $status -eq 0 ] && echo "PASS: --sizes --top"
+exit $status
@@ -37,8 +37,40 @@ For more information, please refer to <https://unlicense.org>
 #include <cctype>
 #include <cerrno>
 
+#include <ctime>
+
+// Note: Without WIN32 and POSIX (e.g. built with a compiler for Windows without /DWIN32),
+//       only standard C++ is used: files are read instead of mapped, directories cannot
+//       be listed (so --rev only finds loose objects), and --watch and --pager are not
+//       available.
 #ifdef WIN32
 #include "windows.h"
+#include <conio.h>
+#include <fcntl.h>
+#include <io.h>
+#define HAVE_POSIX 0
+#elif defined(__unix__) || defined(__APPLE__)
+#define HAVE_POSIX 1
+#include <dirent.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <termios.h>
+#include <unistd.h>
+#else
+#define HAVE_POSIX 0
+#endif
+#ifdef __linux__
+#include <poll.h>
+#include <sys/inotify.h>
+#endif
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define HAVE_SSE2 1
+#include <emmintrin.h>
+#else
+#define HAVE_SSE2 0
 #endif
 
 
@@ -81,7 +113,8 @@ namespace {
         print_windows_system_error(stderr);
         exit(EXIT_FAILURE);
     }
-#else
+#endif
+
     void exit_clib_error(const char *fmt, ...)
     {
         va_list vl;
@@ -93,7 +126,6 @@ namespace {
         fprintf(stderr, ": (%d) %s\n", errno, strerror(errno));
         exit(EXIT_FAILURE);
     }
-#endif
 
     void exit_error(const char *fmt, ...)
     {
@@ -104,48 +136,270 @@ namespace {
         exit(EXIT_FAILURE);
     }
 
+    // Report a failed system call. If `fatal` is set, this exits like exit_windows_system_error
+    // or exit_clib_error, otherwise it prints a warning and the caller is expected to skip
+    // whatever it was working on (e.g. one file out of many).
+    void report_system_error(bool fatal, const char *fmt, ...)
+    {
+        va_list vl;
+        fputs(fatal ? "error: " : "warning: ", stderr);
+        va_start(vl, fmt);
+        vfprintf(stderr, fmt, vl);
+        va_end(vl);
+#ifdef WIN32
+        print_windows_system_error(stderr);
+#else
+        #pragma warning (suppress : 4996) // no need for strerror_s
+        fprintf(stderr, ": (%d) %s\n", errno, strerror(errno));
+#endif
+        if (fatal)
+            exit(EXIT_FAILURE);
+    }
+
+    // Like report_system_error but for errors that do not come from a system call.
+    void report_error(bool fatal, const char *fmt, ...)
+    {
+        va_list vl;
+        fputs(fatal ? "error: " : "warning: ", stderr);
+        va_start(vl, fmt);
+        vfprintf(stderr, fmt, vl);
+        va_end(vl);
+        if (fatal)
+            exit(EXIT_FAILURE);
+    }
+
+    // growable byte buffer
+
+    struct ByteBuffer {
+        char *data;
+        size_t size;
+        size_t capacity;
+    };
+
+    char *buffer_append(ByteBuffer *buffer, const void *data, size_t n_bytes)
+    {
+        if (buffer->size + n_bytes > buffer->capacity) {
+            size_t capacity = buffer->capacity ? buffer->capacity : 4096;
+            while (capacity < buffer->size + n_bytes)
+                capacity *= 2;
+            buffer->data = (char *)realloc(buffer->data, capacity);
+            if (!buffer->data)
+                exit_error("Out-of-memory growing buffer to %zu bytes.\n", capacity);
+            buffer->capacity = capacity;
+        }
+        char *dest = buffer->data + buffer->size;
+        if (data)
+            memcpy(dest, data, n_bytes);
+        else
+            memset(dest, 0, n_bytes);
+        buffer->size += n_bytes;
+        return dest;
+    }
+
     struct LineInfo {
         int32_t outer_index; //< index of the nearest preceeding line with strictly less indentation (or -1 if no such line)
         uint32_t indentation;
         uint32_t start_offset; //< offset of first non-indentation character from the beginning of the file
     };
 
-    bool line_is_boring(LineInfo *line_info, char *text)
+    // languages
+    //
+    // The heuristics that depend on the language of a file: which lines may become
+    // contexts (see parse_text), which lines are boring (see resolve_boring_lines), which
+    // keywords start control flow (abbreviated harder by render_context), which prefixes
+    // are not worth showing and how comments look. The language is chosen by the file
+    // name extension or by --lang (see language_of_filename).
+
+    enum Language {
+        // Note: The languages with C-like syntax come first (see has_c_syntax).
+        LANG_C, //< C and C++, and everything we do not recognize
+        LANG_GO,
+        LANG_RUST,
+        LANG_JAVASCRIPT, //< also TypeScript
+        LANG_PYTHON,
+        LANG_SHELL,
+        LANG_YAML,
+        N_LANGUAGES
+    };
+
+    const char *const language_names[N_LANGUAGES] = { "c", "go", "rust", "javascript", "python", "shell", "yaml" };
+
+    int language_option = -1; //< the language given by --lang (-1 to choose by file name extension)
+
+    // Does the language have "//" and "/* */" comments, and goto and case labels that
+    // should not become contexts?
+    bool has_c_syntax(Language language)
+    {
+        return language <= LANG_JAVASCRIPT;
+    }
+
+    // Return the language for the file name extension `ext` (without the '.'), or
+    // N_LANGUAGES if we do not know it.
+    Language language_of_extension(const char *ext)
+    {
+        static const struct { const char *ext; Language language; } extensions[] = {
+            { "go", LANG_GO },
+            { "rs", LANG_RUST },
+            { "js", LANG_JAVASCRIPT }, { "mjs", LANG_JAVASCRIPT }, { "cjs", LANG_JAVASCRIPT },
+            { "jsx", LANG_JAVASCRIPT }, { "ts", LANG_JAVASCRIPT }, { "tsx", LANG_JAVASCRIPT },
+            { "py", LANG_PYTHON }, { "pyi", LANG_PYTHON }, { "pyw", LANG_PYTHON },
+            { "sh", LANG_SHELL }, { "bash", LANG_SHELL }, { "zsh", LANG_SHELL }, { "ksh", LANG_SHELL },
+            { "yaml", LANG_YAML }, { "yml", LANG_YAML },
+            { "c", LANG_C }, { "h", LANG_C }, { "cc", LANG_C }, { "cpp", LANG_C }, { "cxx", LANG_C },
+            { "hh", LANG_C }, { "hpp", LANG_C }, { "hxx", LANG_C }, { "inl", LANG_C },
+        };
+        for (size_t i = 0; i < sizeof(extensions) / sizeof(extensions[0]); ++i)
+            if (strcmp(ext, extensions[i].ext) == 0)
+                return extensions[i].language;
+        return N_LANGUAGES;
+    }
+
+    // Return the language given by name or file name extension (as for --lang), or
+    // N_LANGUAGES if we do not know it.
+    Language language_of_name(const char *name)
+    {
+        for (int i = 0; i < N_LANGUAGES; ++i)
+            if (strcmp(name, language_names[i]) == 0)
+                return (Language)i;
+        return language_of_extension(name);
+    }
+
+    Language language_of_filename(const char *filename)
+    {
+        if (language_option >= 0)
+            return (Language)language_option;
+        const char *base = strrchr(filename, '/');
+        base = base ? base + 1 : filename;
+        const char *dot = strrchr(base, '.');
+        Language language = dot ? language_of_extension(dot + 1) : N_LANGUAGES;
+        return (language == N_LANGUAGES) ? LANG_C : language;
+    }
+
+    bool line_is_boring(LineInfo *line_info, char *text, Language language)
     {
         char *line_text = text + line_info->start_offset;
-        return line_text[0] == '{';
+        return has_c_syntax(language) && line_text[0] == '{';
     }
 
     struct Context {
         uint32_t index;
         char *text;
+        Language language;
     };
 
-    bool is_control_flow(Context *ctx)
+    // Is the word of length `len` at `word` a keyword that starts control flow?
+    bool is_control_keyword(Language language, const char *word, uint32_t len)
     {
-        if (strncmp(ctx->text, "if ", 3) == 0)
-            return true;
-        if (strncmp(ctx->text, "do ", 3) == 0)
-            return true;
-        if (strncmp(ctx->text, "for ", 4) == 0)
-            return true;
-        if (strncmp(ctx->text, "case ", 5) == 0)
-            return true;
-        if (strncmp(ctx->text, "while ", 6) == 0)
-            return true;
-        if (strncmp(ctx->text, "switch ", 7) == 0)
-            return true;
+        switch (language) {
+            case LANG_C:
+            case LANG_JAVASCRIPT:
+                switch (len) {
+                    case 2: return memcmp(word, "if", 2) == 0 || memcmp(word, "do", 2) == 0;
+                    case 3: return memcmp(word, "for", 3) == 0;
+                    case 4: return memcmp(word, "case", 4) == 0;
+                    case 5: return memcmp(word, "while", 5) == 0;
+                    case 6: return memcmp(word, "switch", 6) == 0;
+                }
+                return false;
+            case LANG_GO:
+                switch (len) {
+                    case 2: return memcmp(word, "if", 2) == 0;
+                    case 3: return memcmp(word, "for", 3) == 0;
+                    case 4: return memcmp(word, "case", 4) == 0;
+                    case 6: return memcmp(word, "switch", 6) == 0 || memcmp(word, "select", 6) == 0;
+                }
+                return false;
+            case LANG_RUST:
+                switch (len) {
+                    case 2: return memcmp(word, "if", 2) == 0;
+                    case 3: return memcmp(word, "for", 3) == 0;
+                    case 4: return memcmp(word, "loop", 4) == 0;
+                    case 5: return memcmp(word, "while", 5) == 0 || memcmp(word, "match", 5) == 0;
+                }
+                return false;
+            case LANG_PYTHON:
+                switch (len) {
+                    case 2: return memcmp(word, "if", 2) == 0;
+                    case 3: return memcmp(word, "for", 3) == 0 || memcmp(word, "try", 3) == 0;
+                    case 4: return memcmp(word, "elif", 4) == 0 || memcmp(word, "else", 4) == 0
+                                   || memcmp(word, "with", 4) == 0 || memcmp(word, "case", 4) == 0;
+                    case 5: return memcmp(word, "while", 5) == 0 || memcmp(word, "match", 5) == 0;
+                    case 6: return memcmp(word, "except", 6) == 0;
+                    case 7: return memcmp(word, "finally", 7) == 0;
+                }
+                return false;
+            case LANG_SHELL:
+                switch (len) {
+                    case 2: return memcmp(word, "if", 2) == 0;
+                    case 3: return memcmp(word, "for", 3) == 0;
+                    case 4: return memcmp(word, "case", 4) == 0 || memcmp(word, "elif", 4) == 0;
+                    case 5: return memcmp(word, "while", 5) == 0 || memcmp(word, "until", 5) == 0;
+                    case 6: return memcmp(word, "select", 6) == 0;
+                }
+                return false;
+            case LANG_YAML:
+            case N_LANGUAGES:
+                break;
+        }
         return false;
     }
 
-    char *maybe_skip_substr(char *text)
+    bool is_control_flow(Context *ctx)
+    {
+        const char *text = ctx->text;
+        uint32_t len = 0;
+        while (isalnum((unsigned char)text[len]) || text[len] == '_')
+            len++;
+        // Note: The keyword must be followed by a space, so "if(" does not count (or by
+        //       ':' in Python, as in "else:").
+        if (text[len] != ' ' && !(ctx->language == LANG_PYTHON && text[len] == ':'))
+            return false;
+        return is_control_keyword(ctx->language, text, len);
+    }
+
+    // Skip a prefix of the context line that is not worth showing, e.g. "namespace " in
+    // C++ or "pub " in Rust. Returns `text` if there is none.
+    char *maybe_skip_substr(char *text, Language language)
     {
-        if (strncmp(text, "namespace ", 10) == 0)
-            text += 10;
+        static const char *const prefixes[N_LANGUAGES][6] = {
+            { "namespace " }, // LANG_C
+            { "func " }, // LANG_GO
+            { "pub ", "pub(crate) ", "async ", "unsafe ", "mod ", "fn " }, // LANG_RUST
+            { "export ", "default ", "async ", "function " }, // LANG_JAVASCRIPT
+            { "async ", "def " }, // LANG_PYTHON
+            { "function " }, // LANG_SHELL
+            { nullptr }, // LANG_YAML
+        };
+        // "func (r *Receiver) Method(" becomes "Method("
+        if (language == LANG_GO && strncmp(text, "func (", 6) == 0) {
+            char *close = strchr(text + 6, ')');
+            if (close && close[1] == ' ')
+                return close + 2;
+        }
+        for (uint32_t i = 0; i < 6 && prefixes[language][i]; ++i) {
+            size_t len = strlen(prefixes[language][i]);
+            if (strncmp(text, prefixes[language][i], len) == 0)
+                return text + len;
+        }
         return text;
     }
 
-    void print_context(Context *ctx)
+    #define RENDER_SCAN_LIMIT 4096 //< bytes of a context line that render_context looks at
+
+    // Does a comment that extends to the end of the line start at `ptr`? `after_space`
+    // tells whether `ptr` is at the start of the text or follows whitespace.
+    bool is_line_comment(Language language, const char *ptr, bool after_space)
+    {
+        if (has_c_syntax(language))
+            return ptr[0] == '/' && ptr[1] == '/';
+        return ptr[0] == '#' && after_space;
+    }
+
+    // Append the abbreviated text of the context line to `out`. Returns the end of the part
+    // of the text that the abbreviation depends on.
+    // Note: Only the first RENDER_SCAN_LIMIT bytes are looked at, so a context line of a
+    //       minified file does not turn into megabytes of output.
+    char *render_context(Context *ctx, ByteBuffer *out)
     {
         bool is_control = is_control_flow(ctx);
         bool could_be_fn_name = !is_control;
@@ -153,35 +407,34 @@ namespace {
         constexpr uint32_t max_control_len = 20;
         char *text = ctx->text;
         char *next;
-        while ((next = maybe_skip_substr(text)) > text)
+        while ((next = maybe_skip_substr(text, ctx->language)) > text)
             text = next;
-        printf("..%u: ", 1 + ctx->index);
         char *ptr = text;
         uint32_t ident_or_num_len = 0;
         char before_space = 0;
         bool prev_was_space = false;
         uint32_t n_chars = 0;
-        while (*ptr) {
+        while (*ptr && ptr - text < RENDER_SCAN_LIMIT) {
             char ch = *ptr++;
             if (isspace(ch)) {
                 ident_or_num_len = 0;
                 prev_was_space = true;
                 continue;
             }
-            if (ch == '/' && *ptr == '/')
-                break;
+            if (is_line_comment(ctx->language, ptr - 1, n_chars == 0 || prev_was_space))
+                return ptr - 1;
             if (isalnum(ch) || ch == '_') {
                 if (prev_was_space && isalnum(before_space)) { // XXX isident
-                    putc(' ', stdout);
+                    buffer_append(out, " ", 1);
                     n_chars++;
                 }
                 if (!could_be_fn_name && ident_or_num_len == max_ident_or_num_len) {
-                    putc('$', stdout);
+                    buffer_append(out, "$", 1);
                     ch = '$';
                     n_chars++;
                 }
                 else if (could_be_fn_name || ident_or_num_len < max_ident_or_num_len) {
-                    putc(ch, stdout);
+                    buffer_append(out, &ch, 1);
                     n_chars++;
                 }
                 else
@@ -189,7 +442,7 @@ namespace {
                 ident_or_num_len++;
             }
             else {
-                putc(ch, stdout);
+                buffer_append(out, &ch, 1);
                 n_chars++;
                 if (ch == '(') {
                     if (could_be_fn_name)
@@ -203,7 +456,55 @@ namespace {
             if (is_control && n_chars >= max_control_len)
                 break;
         }
+        return ptr;
+    }
+
+    void print_context(Context *ctx)
+    {
+        static ByteBuffer buffer;
+        buffer.size = 0;
+        render_context(ctx, &buffer);
+        printf("..%u: ", 1 + ctx->index);
+        fwrite(buffer.data, 1, buffer.size, stdout);
+    }
+}
+
+static uint32_t count_trailing_zeros(uint32_t bits)
+{
+#ifdef _MSC_VER
+    unsigned long index;
+    _BitScanForward(&index, bits);
+    return (uint32_t)index;
+#else
+    return (uint32_t)__builtin_ctz(bits);
+#endif
+}
+
+// Count the '\n' characters in the given bytes.
+static uint32_t count_newlines(const char *text, size_t size)
+{
+    const char *ptr = text;
+    const char *end = text + size;
+    uint32_t count = 0;
+#if HAVE_SSE2
+    // Subtracting the comparison masks (-1 for a match) counts per byte lane; we sum
+    // the lanes before they can overflow.
+    const __m128i newline = _mm_set1_epi8('\n');
+    const __m128i zero = _mm_setzero_si128();
+    while (end - ptr >= 16) {
+        size_t n_blocks = (size_t)(end - ptr) / 16;
+        if (n_blocks > 255)
+            n_blocks = 255;
+        __m128i counts = zero;
+        for (size_t i = 0; i < n_blocks; ++i, ptr += 16)
+            counts = _mm_sub_epi8(counts, _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)ptr), newline));
+        __m128i sums = _mm_sad_epu8(counts, zero);
+        count += (uint32_t)_mm_cvtsi128_si32(sums) + (uint32_t)_mm_cvtsi128_si32(_mm_srli_si128(sums, 8));
     }
+#endif
+    for (; ptr < end; ++ptr)
+        count += (*ptr == '\n');
+    return count;
 }
 
 // parser state // XXX @Cleanup Maybe put this into a struct and pass that to parser functions
@@ -219,6 +520,9 @@ static LineInfo *line_info; //< points to the entry for the current line in line
 static uint32_t prev_indentation;
 static bool may_become_context;
 static int32_t prev_valid_index; //< index (line number - 1) of the latest line we could potentially use as a context line
+static bool c_syntax; //< the file has C comments and labels (see has_c_syntax)
+
+#define LINE_SCAN_LIMIT 256 //< bytes the parser looks ahead in a line beyond its first character
 
 static void process_indentation_of_current_line(bool may_close_context)
 {
@@ -243,34 +547,96 @@ static void process_indentation_of_current_line(bool may_close_context)
     }
 }
 
-#define USAGE  "Usage: %s <SOURCEFILENAME> <LINE>\n\nLINE...line number for which to print whereami information, 0 means print all"
+// Python triple-quoted strings
+//
+// Docstrings and embedded SQL often have lines dedented to column 0. The lines after
+// the one that opens such a string, up to the one that closes it, count as blank lines
+// for the indentation, just like the lines of C comments.
 
-int main(int argc, char **argv)
+// Find the end of a triple-quoted string with the given quote character in [ptr, end).
+// Returns the first character after the closing quotes or nullptr if there are none.
+static char *find_python_string_end(char *ptr, char *end, char quote)
 {
-    const char *progname = argv[0] ? argv[0] : "whereami";
+    while (ptr + 2 < end) {
+        if (*ptr == '\\')
+            ptr += 2;
+        else if (ptr[0] == quote && ptr[1] == quote && ptr[2] == quote)
+            return ptr + 3;
+        else
+            ptr++;
+    }
+    return nullptr;
+}
 
-    for (int i = 1; i < argc; ++i) {
-        char *arg = argv[i];
-        if (!arg)
-            exit_error("null argument passed on the command line\n");
-        if (strcmp(arg, "--help") == 0 || strcmp(arg, "/?") == 0 || strcmp(arg, "/help") == 0) {
-            printf(USAGE, progname);
+// If a triple-quoted string starts in the line [ptr, end) and does not end in it, return
+// its quote character, otherwise 0.
+static char python_open_string_quote(char *ptr, char *end)
+{
+    char quote = 0; //< inside a string with single quote characters
+    while (ptr < end) {
+        char ch = *ptr++;
+        if (quote) {
+            if (ch == '\\')
+                ptr++;
+            else if (ch == quote)
+                quote = 0;
+        }
+        else if (ch == '#')
             return 0;
+        else if (ch == '"' || ch == '\'') {
+            if (end - ptr >= 2 && ptr[0] == ch && ptr[1] == ch) {
+                ptr = find_python_string_end(ptr + 2, end, ch);
+                if (!ptr)
+                    return ch;
+            }
+            else
+                quote = ch;
         }
     }
+    return 0;
+}
 
-    if (argc != 3)
-        exit_error("expected two arguments on the command line (see usage)\n"
-                   USAGE, progname);
+// parser state at the start of a line (see parse_appended_text)
+struct ParserCheckpoint {
+    uint32_t text_offset; //< offset of the first character of the line
+    uint32_t line;
+    int32_t outer_index;
+    uint32_t prev_indentation;
+    int32_t prev_valid_index;
+};
 
-    char *filename = argv[1];
-    char *end = nullptr;
-    uint32_t query_line = strtoul(argv[2], &end, 10);
-    if (end && *end != 0)
-        exit_error("expected a line number as the second command-line argument but got: %s\n",
-                   argv[2]);
+struct LineRange {
+    uint32_t first_index;
+    uint32_t last_index; //< inclusive
+};
+
+struct ParsedFile {
+    char *text; //< file contents with line terminators replaced by NUL (see parse_text and compact_parsed_file)
+    uint32_t text_size; //< number of bytes read from the file
+    uint32_t n_lines;
+    LineInfo *line_info_array; //< array with one LineInfo struct for each line
+    LineRange *comment_ranges; //< C comments spanning several lines, in file order
+    uint32_t n_comment_ranges;
+    uint32_t *line_starts; //< offset of the beginning of each line (built on demand, see get_line_starts)
+    ParserCheckpoint checkpoint; //< state at the start of the last line that was complete in the file (text_offset is 0 if none)
+    Language language;
+    uint32_t line_base; //< number of lines in the file before the parsed text (0 unless only a window was parsed, see PLAN_WINDOW)
+    uint64_t offset_base; //< offset in the file of the parsed text (0 unless only a window was parsed)
+    bool brace_engine; //< the outer indices come from braces (see apply_brace_engine)
+    bool unreliable; //< the contexts may be meaningless (see text_looks_minified and PLAN_WINDOW); answers are marked
+};
 
+// Read the whole file into a newly allocated buffer that has room for two extra bytes
+// at the end (as required by parse_text). If the file cannot be read, exit if `fatal`
+// is set, otherwise print a warning and return nullptr.
+static char *read_file(const char *filename, uint32_t *size_out, bool fatal)
+{
+    char *text = nullptr;
+    uint64_t file_size = 0;
 #ifdef WIN32
+    BOOL result;
+    LARGE_INTEGER file_size_large_integer;
+    DWORD n_bytes_read = 0;
     HANDLE file = ::CreateFile(
             filename, // lpFileName
             GENERIC_READ, // dwDesiredAccess
@@ -280,50 +646,70 @@ int main(int argc, char **argv)
             FILE_FLAG_SEQUENTIAL_SCAN, // dwFlagsAndAttributes
             NULL); // hTemplateFile
 
-    if (file == INVALID_HANDLE_VALUE)
-        exit_windows_system_error("could not open file '%s'", filename);
+    if (file == INVALID_HANDLE_VALUE) {
+        report_system_error(fatal, "could not open file '%s'", filename);
+        return nullptr;
+    }
 
-    LARGE_INTEGER file_size_large_integer;
-    BOOL result = ::GetFileSizeEx(file, &file_size_large_integer);
-    if (!result)
-        exit_windows_system_error("could not get file size");
-    uint64_t file_size = file_size_large_integer.QuadPart;
+    result = ::GetFileSizeEx(file, &file_size_large_integer);
+    if (!result) {
+        report_system_error(fatal, "could not get file size");
+        goto fail;
+    }
+    file_size = file_size_large_integer.QuadPart;
 #else
+    int result;
+    int64_t signed_file_size;
+    uint32_t n_bytes_read = 0;
     #pragma warning (suppress : 4996) // gimme fopen
     FILE *file = fopen(filename, "rb");
-    if (!file)
-        exit_clib_error("could not open file '%s'", filename);
-    int result = fseek(file, 0, SEEK_END);
-    if (result != 0)
-        exit_clib_error("could not seek the end of file '%s'", filename);
-    int64_t file_size = (int64_t)ftell(file);
-    if (file_size < 0)
-        exit_clib_error("could not get the size of file '%s'", filename);
+    if (!file) {
+        report_system_error(fatal, "could not open file '%s'", filename);
+        return nullptr;
+    }
+    result = fseek(file, 0, SEEK_END);
+    if (result != 0) {
+        report_system_error(fatal, "could not seek the end of file '%s'", filename);
+        goto fail;
+    }
+    signed_file_size = (int64_t)ftell(file);
+    if (signed_file_size < 0) {
+        report_system_error(fatal, "could not get the size of file '%s'", filename);
+        goto fail;
+    }
+    file_size = (uint64_t)signed_file_size;
 #endif
 
-    if (file_size > UINT32_MAX)
-        exit_error("File size %" PRIu64 " > %u bytes is not supported.\n",
-                   file_size, UINT32_MAX);
+    if (file_size > UINT32_MAX) {
+        report_error(fatal, "File size %" PRIu64 " > %u bytes is not supported.\n",
+                     file_size, UINT32_MAX);
+        goto fail;
+    }
 
-    char *text = (char *)malloc(file_size + 2); // +1 for possible extra newline, +1 for terminating NUL
+    text = (char *)malloc(file_size + 2); // +1 for possible extra newline, +1 for terminating NUL
     if (!text)
         exit_error("Out-of-memory allocating buffer for file text (file_size = %" PRIu64 ")\n", file_size);
 
 #ifdef WIN32
-    DWORD n_bytes_read;
     result = ::ReadFile(file, text, (DWORD)file_size, &n_bytes_read, NULL);
-    if (!result)
-        exit_windows_system_error("Could not read file '%s'", filename);
+    if (!result) {
+        report_system_error(fatal, "Could not read file '%s'", filename);
+        goto fail;
+    }
 #else
     result = fseek(file, 0, SEEK_SET);
-    if (result != 0)
-        exit_clib_error("could not seek the beginning of file '%s'", filename);
-    uint32_t n_bytes_read = (uint32_t)fread(text, 1, file_size, file);
+    if (result != 0) {
+        report_system_error(fatal, "could not seek the beginning of file '%s'", filename);
+        goto fail;
+    }
+    n_bytes_read = (uint32_t)fread(text, 1, file_size, file);
 #endif
 
-    if (n_bytes_read != file_size)
-        exit_error("Reading file '%s' gave %u bytes instead of the expected %" PRIu64 ".\n",
-                   filename, n_bytes_read, file_size);
+    if (n_bytes_read != file_size) {
+        report_error(fatal, "Reading file '%s' gave %u bytes instead of the expected %" PRIu64 ".\n",
+                     filename, n_bytes_read, file_size);
+        goto fail;
+    }
 
     text[n_bytes_read] = 0;
 
@@ -338,30 +724,317 @@ int main(int argc, char **argv)
 #endif
     file = NULL;
 
+    *size_out = n_bytes_read;
+    return text;
+
+fail:
+#if WIN32
+    ::CloseHandle(file);
+#else
+    fclose(file);
+#endif
+    free(text);
+    return nullptr;
+}
+
+// brace engine
+//
+// An alternative to the indentation hierarchy for files in C-like languages (see
+// has_c_syntax): the context of a line is the line of the innermost '{' that is still
+// open at its start. Braces in comments, string and character literals and preprocessor
+// lines do not count, and of the branches of an #if only the first one does. This gives
+// useful contexts for code that is badly indented, not indented at all or generated.
+// The pass runs over the lines that parse_text has already found and only replaces their
+// outer indices, so indentation, boring lines and comment ranges stay as they are.
+// XXX @Incomplete JavaScript regular expression literals and C++ raw strings are not recognized.
+
+enum Engine {
+    ENGINE_AUTO, //< use braces where the indentation looks unreliable (see indentation_looks_unreliable)
+    ENGINE_INDENTATION,
+    ENGINE_BRACES,
+};
+
+static const char *engine_names[] = {"auto", "indent", "braces"};
+
+#define ENGINE_SAMPLE_LINES 4096 //< ENGINE_AUTO judges a file by this many lines at its beginning (so a long enough prefix gets the same engine, see choose_query_plan)
+
+static Engine engine_option = ENGINE_AUTO;
+
+// Return a pointer to the first '{', '}', '"', '\'', '`' or '/' in [ptr, end), or `end`.
+static const char *find_brace_structural(const char *ptr, const char *end)
+{
+#if HAVE_SSE2
+    const __m128i open_brace = _mm_set1_epi8('{');
+    const __m128i close_brace = _mm_set1_epi8('}');
+    const __m128i double_quote = _mm_set1_epi8('"');
+    const __m128i single_quote = _mm_set1_epi8('\'');
+    const __m128i backtick = _mm_set1_epi8('`');
+    const __m128i slash = _mm_set1_epi8('/');
+    for (; end - ptr >= 16; ptr += 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i *)ptr);
+        __m128i hits = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(chunk, open_brace), _mm_cmpeq_epi8(chunk, close_brace)),
+                                    _mm_or_si128(_mm_cmpeq_epi8(chunk, double_quote), _mm_cmpeq_epi8(chunk, single_quote)));
+        hits = _mm_or_si128(hits, _mm_or_si128(_mm_cmpeq_epi8(chunk, backtick), _mm_cmpeq_epi8(chunk, slash)));
+        uint32_t mask = (uint32_t)_mm_movemask_epi8(hits);
+        if (mask)
+            return ptr + count_trailing_zeros(mask);
+    }
+#endif
+    for (; ptr < end; ++ptr) {
+        char ch = *ptr;
+        if (ch == '{' || ch == '}' || ch == '"' || ch == '\'' || ch == '`' || ch == '/')
+            return ptr;
+    }
+    return end;
+}
+
+// `ptr` points to a '\'' in code. Return where scanning should continue: after the
+// character literal if it is one, otherwise after the quote (Rust lifetimes, C++14 digit
+// separators). In JavaScript, the quote starts a string instead (see apply_brace_engine).
+static const char *skip_char_literal(const char *text, const char *ptr)
+{
+    if (ptr > text && isdigit((uint8_t)ptr[-1]) && isxdigit((uint8_t)ptr[1]))
+        return ptr + 1;
+    uint32_t max_len = 1;
+    if (ptr[1] == '\\')
+        max_len = 11; // up to '\U0001f600'
+    else if ((uint8_t)ptr[1] >= 0x80)
+        max_len = 4; // UTF-8 sequence
+    for (uint32_t i = 2; i <= max_len + 1; ++i) {
+        if (ptr[i] == 0)
+            break;
+        if (ptr[i] == '\'' && (i > 2 || ptr[1] != '\\'))
+            return ptr + i + 1;
+    }
+    return ptr + 1;
+}
+
+// Does the indentation of the file look like it does not show its structure, as in
+// generated code? Then ENGINE_AUTO tries the brace engine.
+static bool indentation_looks_unreliable(ParsedFile *file)
+{
+    if (!has_c_syntax(file->language))
+        return false;
+    uint32_t n_nonblank = 0;
+    uint32_t n_indented = 0;
+    for (uint32_t i = 0; i < file->n_lines && i < ENGINE_SAMPLE_LINES; ++i) {
+        LineInfo *line_info = file->line_info_array + i;
+        if (file->text[line_info->start_offset] == 0)
+            continue;
+        n_nonblank++;
+        n_indented += (line_info->indentation > 0);
+    }
+    return n_nonblank >= 20 && n_indented * 10 < n_nonblank;
+}
+
+// Find the outer indices of the lines of the parsed file from its braces. Unless `force`
+// is set, keep the indentation hierarchy if the braces do not give more of the first
+// ENGINE_SAMPLE_LINES lines a context. Returns true if the outer indices were replaced.
+static bool apply_brace_engine(ParsedFile *file, bool force)
+{
+    enum { IN_CODE, IN_COMMENT, IN_STRING } state = IN_CODE;
+    const char *text = file->text;
+    LineInfo *line_info_array = file->line_info_array;
+    uint32_t n_lines = file->n_lines;
+    bool is_c = (file->language == LANG_C);
+    char quote = 0;
+    ByteBuffer stack = {}; //< int32_t line indices of the open braces
+    int32_t *outer = (int32_t *)malloc(n_lines * sizeof(int32_t) + 1);
+    if (!outer)
+        exit_error("Out-of-memory allocating brace structure.\n");
+    uint32_t pp_depth = 0; //< nesting of #if directives
+    uint32_t pp_skip_depth = 0; //< if not 0, ignore braces until the #endif at this depth
+    bool pp_continued = false; //< the previous line is a preprocessor line ending in '\'
+    uint32_t n_with_context = 0;
+    uint32_t n_braces_with_context = 0;
+
+    const char *ptr = text;
+    for (uint32_t i = 0; i < n_lines; ++i) {
+        const char *line_start = text + line_info_array[i].start_offset;
+        const char *segment_end = (i + 1 < n_lines) ? text + line_info_array[i + 1].start_offset
+                                                    : line_start + strlen(line_start);
+        if (ptr < line_start)
+            ptr = line_start;
+
+        // record the context of this line
+        uint32_t depth = (uint32_t)(stack.size / sizeof(int32_t));
+        if (depth && state == IN_CODE && *line_start == '}' && !pp_skip_depth)
+            depth--;
+        outer[i] = depth ? ((int32_t *)stack.data)[depth - 1] : -1;
+        // Within the block, indentation still gives the contexts of continuation lines.
+        int32_t indentation_outer = line_info_array[i].outer_index;
+        if (indentation_outer > outer[i] && outer[indentation_outer] == outer[i]
+            && text[line_info_array[indentation_outer].start_offset] != '}')
+            outer[i] = indentation_outer;
+        if (i < ENGINE_SAMPLE_LINES) {
+            n_with_context += (indentation_outer >= 0);
+            n_braces_with_context += (outer[i] >= 0);
+        }
+
+        // preprocessor lines (Note: The text at line_start ends at the first NUL.)
+        if (is_c && state == IN_CODE && (pp_continued || *line_start == '#')) {
+            if (!pp_continued) {
+                const char *word = line_start + 1;
+                while (*word == ' ' || *word == '\t')
+                    word++;
+                if (strncmp(word, "if", 2) == 0)
+                    pp_depth++;
+                else if (strncmp(word, "el", 2) == 0) {
+                    if (!pp_skip_depth && pp_depth)
+                        pp_skip_depth = pp_depth;
+                }
+                else if (strncmp(word, "endif", 5) == 0 && pp_depth) {
+                    if (pp_skip_depth == pp_depth)
+                        pp_skip_depth = 0;
+                    pp_depth--;
+                }
+            }
+            size_t len = strlen(line_start);
+            pp_continued = (len && line_start[len - 1] == '\\');
+            if (ptr < line_start + len)
+                ptr = line_start + len;
+        }
+        else
+            pp_continued = false;
+
+        while (ptr < segment_end) {
+            if (state == IN_CODE) {
+                ptr = find_brace_structural(ptr, segment_end);
+                if (ptr == segment_end)
+                    break;
+                char ch = *ptr++;
+                if (ch == '{') {
+                    // Note: An extern "C" block is not a context; it keeps the one outside it.
+                    int32_t index = (int32_t)i;
+                    const char *opener = (*line_start == '{' && i > 0) ? text + line_info_array[i - 1].start_offset : line_start;
+                    if (is_c && strncmp(opener, "extern", 6) == 0)
+                        index = stack.size ? ((int32_t *)stack.data)[stack.size / sizeof(int32_t) - 1] : -1;
+                    if (!pp_skip_depth)
+                        buffer_append(&stack, &index, sizeof(index));
+                }
+                else if (ch == '}') {
+                    if (!pp_skip_depth && stack.size)
+                        stack.size -= sizeof(int32_t);
+                }
+                else if (ch == '/') {
+                    if (*ptr == '*') {
+                        state = IN_COMMENT;
+                        ptr++;
+                    }
+                    else if (*ptr == '/')
+                        ptr += strlen(ptr); // to the end of the line
+                }
+                else if (ch == '\'' && file->language != LANG_JAVASCRIPT)
+                    ptr = skip_char_literal(text, ptr - 1);
+                else {
+                    state = IN_STRING;
+                    quote = ch;
+                }
+            }
+            else if (state == IN_COMMENT) {
+                const char *star = (const char *)memchr(ptr, '*', (size_t)(segment_end - ptr));
+                if (!star) {
+                    ptr = segment_end;
+                    break;
+                }
+                ptr = star + 1;
+                if (*ptr == '/') {
+                    state = IN_CODE;
+                    ptr++;
+                }
+            }
+            else {
+                // Note: Only backtick strings continue over line breaks.
+                while (ptr < segment_end && *ptr != quote && (*ptr || quote == '`'))
+                    ptr += (*ptr == '\\' && ptr[1]) ? 2 : 1;
+                if (ptr < segment_end) {
+                    if (*ptr == quote)
+                        ptr++;
+                    state = IN_CODE;
+                }
+            }
+        }
+    }
+    free(stack.data);
+
+    bool use_braces = force || n_braces_with_context > n_with_context;
+    if (use_braces) {
+        for (uint32_t i = 0; i < n_lines; ++i)
+            line_info_array[i].outer_index = outer[i];
+    }
+    free(outer);
+    return use_braces;
+}
+
+// minified and generated files
+//
+// With most of a file on a few huge lines (minified JavaScript, generated tables or
+// data), indentation says little about where a position is. The parser and the
+// renderer only look at a bounded part of each line (see LINE_SCAN_LIMIT and
+// RENDER_SCAN_LIMIT), so such files cost no more than others, and answers for them get
+// an "(unreliable)" marker.
+// A file is judged by its first MINIFIED_SAMPLE_SIZE bytes only, so that every query
+// plan comes to the same verdict (the prefix plan always reads them).
+
+#define MINIFIED_LINE_LENGTH 1000 //< files with longer lines on average look minified
+#define MINIFIED_SAMPLE_SIZE (64 * 1024) //< smaller files are never taken as minified
+
+// `text` is the beginning of the file (as read, with its newlines), `size` the number of
+// bytes of it at hand.
+static bool text_looks_minified(const char *text, uint64_t size)
+{
+    return size >= MINIFIED_SAMPLE_SIZE
+        && count_newlines(text, MINIFIED_SAMPLE_SIZE) < MINIFIED_SAMPLE_SIZE / MINIFIED_LINE_LENGTH;
+}
+
+// Parse the given text (as returned by read_file) and fill in `file`. The text buffer is
+// modified in place and owned by `file` afterwards (see free_parsed_file).
+// If `resume` is given, `text` must start with the same bytes that were parsed into
+// `resume` up to its checkpoint; parsing then continues from the checkpoint instead
+// of the beginning of the text (see parse_appended_text).
+static void parse_text(ParsedFile *file, char *text, uint32_t text_size, const char *filename,
+                       const ParsedFile *resume = nullptr)
+{
+    Language language = resume ? resume->language : language_of_filename(filename);
+    // Note: This must look at the text before the line terminators are replaced.
+    bool minified = text_looks_minified(text, text_size);
+    ParserCheckpoint start = {};
+    start.line = 1;
+    start.outer_index = -1;
+    start.prev_valid_index = -1;
+    if (resume) {
+        start = resume->checkpoint;
+        assert(start.text_offset <= text_size);
+        // take over the prefix with its line terminators already replaced
+        memcpy(text, resume->text, start.text_offset);
+    }
+
     // Note: We only consider '\n' characters when counting newlines, so an '\r' without
     //       a following '\n' is not considered an end-of-line. see :CountingLines
-    n_lines = 0;
+    n_lines = start.line - 1;
     bool file_contains_a_nul_byte;
+    char *parse_end; //< the first NUL byte (after we added a newline below, if needed)
     {
-        char *ptr;
-        for (ptr = text; *ptr; ++ptr)
-            if (*ptr == '\n')
-                n_lines++;
-        file_contains_a_nul_byte = (ptr < text + n_bytes_read);
+        char *scan_start = text + start.text_offset;
+        char *nul = (char *)memchr(scan_start, 0, text_size - start.text_offset);
+        n_lines += count_newlines(scan_start, (size_t)((nul ? nul : text + text_size) - scan_start));
+        file_contains_a_nul_byte = (nul != nullptr);
+        parse_end = nul ? nul : text + text_size;
     }
 
     // XXX DEBUG
     if (0) {
-        fprintf(stderr, "file_size = %" PRIu64 ", n_bytes_read = %u, n_lines = %u, file_contains_a_nul_byte = %u, last byte of file: 0x%02x\n",
-                file_size, n_bytes_read, n_lines, file_contains_a_nul_byte, file_size ? text[file_size - 1] : 0);
+        fprintf(stderr, "text_size = %u, n_lines = %u, file_contains_a_nul_byte = %u, last byte of file: 0x%02x\n",
+                text_size, n_lines, file_contains_a_nul_byte, text_size ? text[text_size - 1] : 0);
     }
 
     // Note: If the file contains a NUL byte, parsing will not reach the end of the file.
-    if (!file_contains_a_nul_byte && file_size && text[file_size - 1] != '\n') {
+    if (!file_contains_a_nul_byte && text_size > start.text_offset && text[text_size - 1] != '\n') {
         n_lines++; // extra line at the end, not terminated by a newline
         // add an extra newline so we do not have to treat this special case below
-        text[n_bytes_read] = '\n';
-        text[n_bytes_read + 1] = 0;
+        text[text_size] = '\n';
+        text[text_size + 1] = 0;
+        parse_end++;
     }
 
     if (n_lines > INT32_MAX)
@@ -370,19 +1043,33 @@ int main(int argc, char **argv)
     line_info_array = (LineInfo*) malloc(n_lines * sizeof(LineInfo));
     if (!line_info_array)
         exit_error("Out-of-memory allocating line info buffer.\n");
+    if (resume)
+        memcpy(line_info_array, resume->line_info_array, (start.line - 1) * sizeof(LineInfo));
+
+    ByteBuffer comment_ranges = {};
+    if (resume) {
+        // Note: A comment recorded after the checkpoint (unterminated at the end of the
+        //       old text) will be found again.
+        for (uint32_t i = 0; i < resume->n_comment_ranges; ++i)
+            if (resume->comment_ranges[i].last_index < start.line - 1)
+                buffer_append(&comment_ranges, resume->comment_ranges + i, sizeof(LineRange));
+    }
 
+    ParserCheckpoint checkpoint = {};
     {
-        char *ptr = text;
-        line = 1;
+        char *ptr = text + start.text_offset;
+        line = start.line;
         column = 0;
         tabsize = 8;
-        outer_index = -1;
-        line_info = line_info_array;
-        prev_indentation = 0;
+        outer_index = start.outer_index;
+        line_info = line_info_array + (start.line - 1);
+        prev_indentation = start.prev_indentation;
         may_become_context = true;
-        prev_valid_index = -1;
+        prev_valid_index = start.prev_valid_index;
+        c_syntax = has_c_syntax(language);
+        char open_quote = 0; //< a Python triple-quoted string continues after the current line
         while (*ptr) {
-            assert(ptr <= text + file_size);
+            assert(ptr <= text + text_size);
             char ch = *ptr++;
             switch (ch) {
                 case '\n':
@@ -397,7 +1084,7 @@ whitespace_only_line:
                     may_become_context = true;
                     ptr[-1] = 0; // replace '\n' with terminating NUL
                     column = 0;
-                    break;
+                    goto start_of_line;
                 case '\t':
                     column++;
                     column = tabsize * ((column + tabsize - 1) / tabsize);
@@ -410,7 +1097,7 @@ whitespace_only_line:
                     ptr[-1] = 0;
                     break;
                 case '/':
-                    if (ptr[0] == '*') {
+                    if (ptr[0] == '*' && c_syntax) {
                         // A C comment starts here. If it ends on the same line, we just
                         // skip it and consider the rest of the line normally.
                         // If it continues over a line break, skip the comment and the
@@ -418,6 +1105,7 @@ whitespace_only_line:
                         ptr++;
                         line_info->indentation = column;
                         bool comment_contains_newline = false;
+                        uint32_t comment_first_line = line;
                         while (*ptr && (ptr[0] != '*' || ptr[1] != '/')) {
                             // XXX @Clarify Do we want to increase `column` in this loop?
                             if (ptr[0] == '\n') {
@@ -435,6 +1123,12 @@ whitespace_only_line:
                             }
                             ptr++;
                         }
+                        if (comment_contains_newline) {
+                            LineRange range;
+                            range.first_index = comment_first_line - 1;
+                            range.last_index = (line - 1 < n_lines) ? line - 1 : n_lines - 1;
+                            buffer_append(&comment_ranges, &range, sizeof(range));
+                        }
                         if (ptr[0] == '*') {
                             // We found the terminating '*/'.
                             ptr += 2;
@@ -471,8 +1165,7 @@ first_nonwhitespace_character:
                     // we are at the first non-indentation character of a line
                     assert(line_info < line_info_array + n_lines);
                     line_info->indentation = column;
-                    char *line_text = ptr - 1;
-                    line_info->start_offset = (uint32_t)(line_text - text);
+                    line_info->start_offset = (uint32_t)(ptr - 1 - text);
 
                     assert(outer_index < 0 || prev_indentation >= line_info_array[outer_index].indentation);
 
@@ -480,7 +1173,7 @@ first_nonwhitespace_character:
 
                     // If the line is only a C++ comment, do not consider it as a context line.
                     // Note: C++ comments after non-comment text will be dropped by the context printing code.
-                    if (ch == '/' && ptr[0] == '/')
+                    if (c_syntax && ch == '/' && ptr[0] == '/')
                         may_become_context = false;
 
                     // XXX @Incomplete handle C comments starting in the middle of the line
@@ -488,12 +1181,19 @@ first_nonwhitespace_character:
                     // check whether the line is of the form "identifier:" (with optional whitespace)
                     // if so, we do not turn it into a context line
                     // Note: This is to avoid using goto labels or "public:", "private:", etc. as context lines.
-                    if (may_become_context) {
+                    //       Elsewhere, e.g. "else:" in Python or "key:" in YAML, such lines open blocks.
+                    if (may_become_context && c_syntax) {
                         bool only_one_identifier = true;
                         bool seen_space = false;
                         bool seen_colon = false;
+                        // Note: Labels are short; the limit keeps minified lines from being scanned twice.
                         char *lookahead = ptr;
+                        char *lookahead_end = (parse_end - ptr > LINE_SCAN_LIMIT) ? ptr + LINE_SCAN_LIMIT : parse_end;
                         while (*lookahead && *lookahead != '\n' && (*lookahead != '\r' || lookahead[1] != '\n')) {
+                            if (lookahead == lookahead_end) {
+                                only_one_identifier = false;
+                                break;
+                            }
                             char ch = *lookahead;
                             if (seen_space || seen_colon) {
                                 if ((!seen_colon || ch != ':') && !isspace(ch)) {
@@ -529,7 +1229,7 @@ first_nonwhitespace_character:
                     //     It seems we want some smart heuristics for goto/case labels.
                     //     For the time being, just ignore them.
                     // Note: 'default:' is handled by the goto label check above.
-                    if (may_become_context && memcmp(ptr - 1, "case", 4) == 0 && isspace(ptr[3])) {
+                    if (may_become_context && c_syntax && memcmp(ptr - 1, "case", 4) == 0 && isspace(ptr[3])) {
                         may_become_context = false;
                     }
 
@@ -540,19 +1240,60 @@ skip_rest_of_line:
                     // Note: A single '\r' without a following '\n' is not treated as an end-of-line.
                     //       (This is consistent with us not counting '\r' characters when determining n_lines.)
                     //       see :CountingLines
-                    while (*ptr && *ptr != '\n' && (*ptr != '\r' || ptr[1] != '\n'))
-                        ptr++;
-                    if (*ptr == '\r')
-                        *ptr++ = 0;
-                    if (*ptr == '\n')
-                        *ptr++ = 0;
+                    {
+                        char *newline = (ptr < parse_end) ? (char *)memchr(ptr, '\n', (size_t)(parse_end - ptr)) : nullptr;
+                        if (language == LANG_PYTHON)
+                            open_quote = python_open_string_quote(ptr - 1, newline ? newline : parse_end);
+                        if (newline) {
+                            if (newline > ptr && newline[-1] == '\r')
+                                newline[-1] = 0;
+                            *newline = 0;
+                            ptr = newline + 1;
+                        }
+                        else if (ptr < parse_end)
+                            ptr = parse_end;
+                    }
 
-                    assert(ptr <= text + file_size);
+                    assert(ptr <= text + text_size + 1);
 
                     line++;
                     line_info++;
                     may_become_context = true;
                     column = 0;
+                    if (open_quote) {
+                        // skip the lines of the string up to the closing quotes
+                        char *string_end = nullptr;
+                        while (!string_end) {
+                            char *newline = (ptr < parse_end) ? (char *)memchr(ptr, '\n', (size_t)(parse_end - ptr)) : nullptr;
+                            if (!newline) {
+                                ptr = parse_end;
+                                break;
+                            }
+                            string_end = find_python_string_end(ptr, newline, open_quote);
+                            line_info->indentation = prev_indentation;
+                            line_info->outer_index = outer_index;
+                            line_info->start_offset = (uint32_t)(newline - text);
+                            line_info++;
+                            line++;
+                            if (newline > ptr && newline[-1] == '\r')
+                                newline[-1] = 0;
+                            *newline = 0;
+                            ptr = newline + 1;
+                        }
+                        open_quote = 0;
+                        if (!string_end)
+                            break; // no checkpoint inside an unterminated string
+                    }
+start_of_line:
+                    // remember where we could resume parsing if the file grows
+                    // Note: A line ended by the newline we added ourselves is not complete.
+                    if ((uint32_t)(ptr - text) <= text_size) {
+                        checkpoint.text_offset = (uint32_t)(ptr - text);
+                        checkpoint.line = line;
+                        checkpoint.outer_index = outer_index;
+                        checkpoint.prev_indentation = prev_indentation;
+                        checkpoint.prev_valid_index = prev_valid_index;
+                    }
                     break;
             }
         }
@@ -560,80 +1301,7196 @@ skip_rest_of_line:
         assert((line_info - line_info_array) == n_lines);
     }
 
-    uint32_t begin_index;
-    uint32_t end_index;
-    if (query_line) {
-        begin_index = query_line - 1;
-        end_index = query_line;
-    }
-    else {
-        begin_index = 0;
-        end_index = n_lines;
+    file->text = text;
+    file->text_size = text_size;
+    file->n_lines = n_lines;
+    file->line_info_array = line_info_array;
+    file->comment_ranges = (LineRange *)comment_ranges.data;
+    file->n_comment_ranges = (uint32_t)(comment_ranges.size / sizeof(LineRange));
+    file->line_starts = nullptr;
+    file->language = language;
+    if (file_contains_a_nul_byte)
+        checkpoint = ParserCheckpoint(); // we did not parse everything
+    file->line_base = 0;
+    file->offset_base = 0;
+    // Note: The parser cannot resume from outer indices found by the brace engine.
+    file->brace_engine = has_c_syntax(language) && (engine_option == ENGINE_BRACES
+            || (engine_option == ENGINE_AUTO && indentation_looks_unreliable(file)))
+        && apply_brace_engine(file, engine_option == ENGINE_BRACES /* force */);
+    if (file->brace_engine)
+        checkpoint = ParserCheckpoint();
+    file->checkpoint = checkpoint;
+    file->unreliable = minified;
+    line_info_array = nullptr;
+    line_info = nullptr;
+}
+
+static void free_parsed_file(ParsedFile *file)
+{
+    free(file->line_info_array);
+    file->line_info_array = nullptr;
+    free(file->comment_ranges);
+    file->comment_ranges = nullptr;
+    file->n_comment_ranges = 0;
+    free(file->line_starts);
+    file->line_starts = nullptr;
+    free(file->text);
+    file->text = nullptr;
+}
+
+// Given the line `outer` that the indentation hierarchy gives as the context of some line,
+// skip over boring lines (see line_is_boring) to find the line we actually want to report.
+static LineInfo *resolve_boring_lines(ParsedFile *file, LineInfo *outer)
+{
+    LineInfo *line_info_array = file->line_info_array;
+    uint32_t indent = outer->indentation;
+    while (outer > line_info_array && line_is_boring(outer, file->text, file->language)) {
+        outer--;
+        while (outer > line_info_array && outer->indentation > indent)
+            outer--;
     }
+    return outer;
+}
 
-    for (uint32_t index = begin_index; index < end_index; ++index) {
-        LineInfo *line_info = line_info_array + index;
-        if (!query_line)
-            printf("%5u: %5u<- %2u: ", 1 + index, 1 + line_info->outer_index, line_info->indentation);
-
-        uint32_t n_contexts = 0;
-        Context *context_array = nullptr;
-        Context *context_ptr = nullptr;
-        // First pass: count contexts
-        // Second pass: allocate and fill in contexts
-        for (uint32_t i_pass = 0; i_pass < 2; ++i_pass) {
-            if (i_pass == 1) {
-                context_array = (Context *)malloc(n_contexts * sizeof(Context));
-                if (!context_array)
-                    exit_error("Out-of-memory allocating context array.\n");
-            }
-
-            context_ptr = context_array + n_contexts;
-            for (LineInfo *outer = line_info; outer->outer_index >= 0; ) {
-                outer = line_info_array + outer->outer_index;
-                uint32_t indent = outer->indentation;
-                while (outer > line_info_array && line_is_boring(outer, text)) {
-                    outer--;
-                    while (outer > line_info_array && outer->indentation > indent)
-                        outer--;
-                }
-                if (i_pass == 0) {
-                    n_contexts++;
-                }
-                else {
-                    assert(context_ptr > context_array);
-                    context_ptr--;
-                    context_ptr->index = (uint32_t)(outer - line_info_array);
-                    context_ptr->text = text + outer->start_offset;
-                }
-            }
-        }
-        assert(context_ptr >= context_array);
-        uint32_t start_i = (uint32_t)(context_ptr - context_array);
+#define CLOSE_CONTEXT_LINES 20 //< contexts this close to the line are not printed
 
-        bool skipped_previous = false;
-        for (uint32_t i = start_i; i < n_contexts; ++i) {
-            Context *ctx = context_array + i;
-            // XXX should only skip control flow?
-            if (index - ctx->index < 20) {
-                skipped_previous = true;
-                continue;
-            }
-            print_context(ctx);
-            skipped_previous = false;
+// Print the contexts context_array[start_i], ..., context_array[n_contexts - 1] (outermost first)
+// for the line with the given index.
+// Returns false if nothing was printed.
+static bool print_contexts(Context *context_array, uint32_t start_i, uint32_t n_contexts, uint32_t index)
+{
+    bool skipped_previous = false;
+    for (uint32_t i = start_i; i < n_contexts; ++i) {
+        Context *ctx = context_array + i;
+        // XXX should only skip control flow?
+        if (index - ctx->index < CLOSE_CONTEXT_LINES) {
+            skipped_previous = true;
+            continue;
         }
-        if (skipped_previous)
-            printf("...");
-        if (!query_line)
-            printf("\n");
-        free(context_array);
-        context_array = nullptr;
+        print_context(ctx);
+        skipped_previous = false;
     }
+    if (skipped_previous)
+        printf("...");
+    return start_i < n_contexts;
+}
 
-    free(line_info_array);
-    line_info_array = nullptr;
-    free(text);
-    text = nullptr;
+// Flag the answer for a file whose contexts may be meaningless (see ParsedFile::unreliable).
+static void print_unreliable_marker(bool unreliable, bool printed_contexts)
+{
+    if (unreliable)
+        fputs(printed_contexts ? " (unreliable)" : "(unreliable)", stdout);
+}
 
-    return 0;
+// structured output (see --format)
+//
+// For tools that would otherwise parse the "..<LINE>: <TEXT>" answers, the answer for a
+// line can be written as one JSON object per line
+//
+//     {"line":<LINE>,"contexts":[<CONTEXT>,...],"elided":<BOOL>,"unreliable":<BOOL>}
+//     <CONTEXT> = {"line":<LINE>,"kind":"<KIND>","header":"<RAW>","text":"<TEXT>"}
+//
+// or as a binary record (all numbers little-endian)
+//
+//     u32 size (of the rest of the record), u32 line, u16 n_contexts, u8 flags, u8 0
+//     for each context: u32 line, u8 kind, u8 0, u16 header size, header bytes,
+//                       u16 text size, text bytes
+//
+// with flags 1 (elided) and 2 (unreliable) and the kinds in the order of kind_names.
+// `contexts` are the ones the text answer shows, outermost first, and `elided` is set
+// where it ends in "..." (contexts too close to the line left out). `header` is the
+// part of the header line that `text`, its abbreviation, is made from. In the binary
+// format, each answer to a query ends with a record of size 0.
+
+enum OutputFormat {
+    FORMAT_TEXT,
+    FORMAT_JSON,
+    FORMAT_BINARY,
+};
+
+static const char *const format_names[] = {"text", "json", "binary"};
+
+static OutputFormat format_option = FORMAT_TEXT;
+
+enum ContextKind {
+    KIND_OTHER,
+    KIND_NAMESPACE, //< namespaces, modules, impl blocks, extern "C" blocks
+    KIND_TYPE, //< classes, structs, enums, traits, ...
+    KIND_FUNCTION,
+    KIND_CONTROL_FLOW, //< see is_control_flow
+};
+
+static const char *const kind_names[] = {"other", "namespace", "type", "function", "control-flow"};
+
+#define ANSWER_FLAG_ELIDED 1
+#define ANSWER_FLAG_UNRELIABLE 2
+
+// Does `text` start with the given word followed by a space?
+static bool starts_with_word(const char *text, const char *word)
+{
+    size_t len = strlen(word);
+    return strncmp(text, word, len) == 0 && text[len] == ' ';
+}
+
+// Classify a context line by its first words. `rendered` is its abbreviation (see
+// render_context), which ends in '(' for things that look like function headers.
+static ContextKind context_kind(Context *ctx, const char *rendered, size_t rendered_size)
+{
+    static const char *const modifiers[] = {
+        "pub", "pub(crate)", "export", "default", "async", "unsafe", "static", "inline",
+        "public", "private", "protected", "abstract", "final", "virtual", "constexpr",
+    };
+    static const char *const namespace_words[] = {"namespace", "mod", "impl", "module", "package"};
+    static const char *const type_words[] = {"class", "struct", "union", "enum", "trait", "interface", "type"};
+    static const char *const function_words[] = {"fn", "func", "def", "function"};
+
+    if (is_control_flow(ctx))
+        return KIND_CONTROL_FLOW;
+    const char *text = ctx->text;
+    for (size_t i = 0; i < sizeof(modifiers) / sizeof(modifiers[0]); ++i) {
+        if (starts_with_word(text, modifiers[i])) {
+            text += strlen(modifiers[i]) + 1;
+            i = (size_t)-1; // start over, modifiers come in any order
+        }
+    }
+    if (strncmp(text, "extern \"", 8) == 0)
+        return KIND_NAMESPACE;
+    for (size_t i = 0; i < sizeof(namespace_words) / sizeof(namespace_words[0]); ++i)
+        if (starts_with_word(text, namespace_words[i]))
+            return KIND_NAMESPACE;
+    for (size_t i = 0; i < sizeof(function_words) / sizeof(function_words[0]); ++i)
+        if (starts_with_word(text, function_words[i]))
+            return KIND_FUNCTION;
+    bool ends_in_paren = rendered_size && rendered[rendered_size - 1] == '(';
+    for (size_t i = 0; i < sizeof(type_words) / sizeof(type_words[0]); ++i) {
+        if (starts_with_word(text, type_words[i])) {
+            // "struct foo *make_foo(" in C is a function returning a struct
+            return (has_c_syntax(ctx->language) && ends_in_paren) ? KIND_FUNCTION : KIND_TYPE;
+        }
+    }
+    if (ends_in_paren && ctx->language != LANG_YAML)
+        return KIND_FUNCTION;
+    return KIND_OTHER;
+}
+
+// Print a JSON string literal for the given bytes.
+static void print_json_string(const char *ptr, size_t len)
+{
+    putc('"', stdout);
+    for (const char *end = ptr + len; ptr < end; ++ptr) {
+        unsigned char ch = (unsigned char)*ptr;
+        if (ch == '"' || ch == '\\') {
+            putc('\\', stdout);
+            putc(ch, stdout);
+        }
+        else if (ch < 0x20)
+            printf("\\u%04x", ch);
+        else
+            putc(ch, stdout);
+    }
+    putc('"', stdout);
+}
+
+static void buffer_append_le(ByteBuffer *buffer, uint32_t value, uint32_t n_bytes)
+{
+    unsigned char bytes[4];
+    for (uint32_t i = 0; i < n_bytes; ++i)
+        bytes[i] = (unsigned char)(value >> (8 * i));
+    buffer_append(buffer, bytes, n_bytes);
+}
+
+// Print the answer for the line with the given index in the structured format, from
+// the contexts context_array[start_i], ..., context_array[n_contexts - 1] (outermost
+// first) as print_contexts would print them.
+static void print_structured_contexts(Context *context_array, uint32_t start_i, uint32_t n_contexts, uint32_t index,
+                                      bool unreliable)
+{
+    static ByteBuffer rendered;
+    static ByteBuffer record;
+    // the contexts shown are a prefix, see print_contexts
+    uint32_t end_i = start_i;
+    while (end_i < n_contexts && index - context_array[end_i].index >= CLOSE_CONTEXT_LINES && end_i - start_i < UINT16_MAX)
+        end_i++;
+    uint32_t flags = (end_i < n_contexts ? ANSWER_FLAG_ELIDED : 0) | (unreliable ? ANSWER_FLAG_UNRELIABLE : 0);
+
+    record.size = 0;
+    if (format_option == FORMAT_JSON)
+        printf("{\"line\":%u,\"contexts\":[", index + 1);
+    else {
+        buffer_append(&record, nullptr, 4); // size, filled in below
+        buffer_append_le(&record, index + 1, 4);
+        buffer_append_le(&record, end_i - start_i, 2);
+        buffer_append_le(&record, flags, 1);
+        buffer_append_le(&record, 0, 1);
+    }
+    for (uint32_t i = start_i; i < end_i; ++i) {
+        Context *ctx = context_array + i;
+        rendered.size = 0;
+        const char *header_end = render_context(ctx, &rendered);
+        while (header_end > ctx->text && isspace((unsigned char)header_end[-1]))
+            header_end--;
+        // Note: Both are short (see RENDER_SCAN_LIMIT).
+        uint32_t header_size = (uint32_t)(header_end - ctx->text);
+        ContextKind kind = context_kind(ctx, rendered.data, rendered.size);
+        if (format_option == FORMAT_JSON) {
+            printf("%s{\"line\":%u,\"kind\":\"%s\",\"header\":", (i > start_i) ? "," : "", ctx->index + 1, kind_names[kind]);
+            print_json_string(ctx->text, header_size);
+            printf(",\"text\":");
+            print_json_string(rendered.data, rendered.size);
+            putc('}', stdout);
+        }
+        else {
+            buffer_append_le(&record, ctx->index + 1, 4);
+            buffer_append_le(&record, kind, 1);
+            buffer_append_le(&record, 0, 1);
+            buffer_append_le(&record, header_size, 2);
+            buffer_append(&record, ctx->text, header_size);
+            buffer_append_le(&record, (uint32_t)rendered.size, 2);
+            buffer_append(&record, rendered.data, rendered.size);
+        }
+    }
+    if (format_option == FORMAT_JSON) {
+        printf("],\"elided\":%s,\"unreliable\":%s}", (flags & ANSWER_FLAG_ELIDED) ? "true" : "false",
+               unreliable ? "true" : "false");
+    }
+    else {
+        uint32_t size = (uint32_t)record.size - 4;
+        for (uint32_t i = 0; i < 4; ++i)
+            record.data[i] = (char)(size >> (8 * i));
+        fwrite(record.data, 1, record.size, stdout);
+    }
+}
+
+// Print the answer for the line with the given index in the chosen format (see
+// print_contexts and print_structured_contexts).
+static void print_answer(Context *context_array, uint32_t start_i, uint32_t n_contexts, uint32_t index, bool unreliable)
+{
+    if (format_option != FORMAT_TEXT) {
+        print_structured_contexts(context_array, start_i, n_contexts, index, unreliable);
+        return;
+    }
+    bool printed = print_contexts(context_array, start_i, n_contexts, index);
+    print_unreliable_marker(unreliable, printed);
+}
+
+// End the answer to one query: with a newline in the text formats if `newline` is set,
+// with an empty record in the binary format.
+static void print_answer_end(bool newline)
+{
+    if (format_option == FORMAT_BINARY) {
+        static const char end_record[4] = {0, 0, 0, 0};
+        fwrite(end_record, 1, sizeof(end_record), stdout);
+    }
+    else if (newline)
+        putc('\n', stdout);
+}
+
+static void print_line_contexts(ParsedFile *file, uint32_t index)
+{
+    LineInfo *line_info_array = file->line_info_array;
+    LineInfo *line_info = line_info_array + index;
+
+    uint32_t n_contexts = 0;
+    Context *context_array = nullptr;
+    Context *context_ptr = nullptr;
+    // First pass: count contexts
+    // Second pass: allocate and fill in contexts
+    for (uint32_t i_pass = 0; i_pass < 2; ++i_pass) {
+        if (i_pass == 1) {
+            context_array = (Context *)malloc(n_contexts * sizeof(Context));
+            if (!context_array)
+                exit_error("Out-of-memory allocating context array.\n");
+        }
+
+        context_ptr = context_array + n_contexts;
+        for (LineInfo *outer = line_info; outer->outer_index >= 0; ) {
+            outer = resolve_boring_lines(file, line_info_array + outer->outer_index);
+            if (i_pass == 0) {
+                n_contexts++;
+            }
+            else {
+                assert(context_ptr > context_array);
+                context_ptr--;
+                context_ptr->index = file->line_base + (uint32_t)(outer - line_info_array);
+                context_ptr->text = file->text + outer->start_offset;
+                context_ptr->language = file->language;
+            }
+        }
+    }
+    assert(context_ptr >= context_array);
+    uint32_t start_i = (uint32_t)(context_ptr - context_array);
+
+    print_answer(context_array, start_i, n_contexts, file->line_base + index, file->unreliable);
+    free(context_array);
+}
+
+// positions
+//
+// Besides line numbers, queries may give a position as "<LINE>:<COLUMN>" (1-based, the
+// column counting bytes) or as "@<OFFSET>" (0-based byte offset), as reported by many
+// tools. Offsets are mapped to lines by binary search over the line starts.
+
+// Return the offsets of the beginnings of the lines, computing them on first use. An extra
+// entry at the end holds the size of the parsed part of the text (see parsed_text_size).
+// Each line ends with the first NUL at or after its start_offset (see parse_text); the
+// '\n' of a "\r\n" is a second NUL that still belongs to the line.
+// Note: The start of a line is ambiguous if it begins with a lone '\r' following a line
+//       ended by '\n' only. We count the '\r' to the previous line then.
+static const uint32_t *get_line_starts(ParsedFile *file)
+{
+    if (file->line_starts)
+        return file->line_starts;
+    uint32_t *line_starts = (uint32_t *)malloc((file->n_lines + 1) * sizeof(uint32_t));
+    if (!line_starts)
+        exit_error("Out-of-memory allocating line start index.\n");
+    LineInfo *line_info_array = file->line_info_array;
+    line_starts[0] = 0;
+    for (uint32_t index = 1; index < file->n_lines; ++index) {
+        const char *prev = file->text + line_info_array[index - 1].start_offset;
+        uint32_t start = (uint32_t)(prev + strlen(prev) + 1 - file->text);
+        if (!file->text[start])
+            start++; // "\r\n"
+        if (start > line_info_array[index].start_offset)
+            start = line_info_array[index].start_offset;
+        line_starts[index] = start;
+    }
+    if (file->n_lines) {
+        // parse_text stops at a NUL byte
+        const char *last = file->text + line_info_array[file->n_lines - 1].start_offset;
+        uint32_t end = (uint32_t)(last + strlen(last) - file->text);
+        line_starts[file->n_lines] = (end < file->text_size) ? end + 1 : file->text_size;
+    }
+    file->line_starts = line_starts;
+    return line_starts;
+}
+
+// Return the index of the line containing the given byte offset (which must be at most
+// the size of the parsed part of the file).
+static uint32_t line_index_of_offset(ParsedFile *file, uint32_t offset)
+{
+    const uint32_t *line_starts = get_line_starts(file);
+    uint32_t low = 0;
+    uint32_t high = file->n_lines; // the line is in [low, high)
+    while (high - low > 1) {
+        uint32_t mid = low + (high - low) / 2;
+        if (line_starts[mid] <= offset)
+            low = mid;
+        else
+            high = mid;
+    }
+    return low;
+}
+
+// Size of the part of the text that parse_text turned into lines (it stops at a NUL byte).
+static uint32_t parsed_text_size(ParsedFile *file)
+{
+    return get_line_starts(file)[file->n_lines];
+}
+
+// Convert a position "<LINE>", "<LINE>:<COLUMN>" or "@<OFFSET>" in the file into a
+// line number in the parsed text (1-based, see ParsedFile::line_base). Reports an error
+// and returns false if the position is malformed or out of range for the file.
+static bool resolve_position(ParsedFile *file, const char *arg, const char *filename, bool fatal, uint32_t *query_line)
+{
+    char *end = nullptr;
+    if (arg[0] == '@') {
+        unsigned long offset = strtoul(arg + 1, &end, 10);
+        if (end == arg + 1 || *end) {
+            report_error(fatal, "expected a byte offset after '@' but got: %s\n", arg);
+            return false;
+        }
+        uint32_t size = parsed_text_size(file);
+        if (offset < file->offset_base || offset - file->offset_base > size || !file->n_lines) {
+            report_error(fatal, "offset %lu is out of range for file '%s' (which has %u bytes)\n",
+                         offset, filename, size);
+            return false;
+        }
+        *query_line = line_index_of_offset(file, (uint32_t)(offset - file->offset_base)) + 1;
+        return true;
+    }
+
+    unsigned long line_number = strtoul(arg, &end, 10);
+    if (end == arg || (*end && *end != ':')) {
+        report_error(fatal, "expected a line number, <LINE>:<COLUMN> or @<OFFSET> but got: %s\n", arg);
+        return false;
+    }
+    if (line_number <= file->line_base || line_number - file->line_base > file->n_lines) {
+        report_error(fatal, "line %lu is out of range for file '%s' (which has %u lines)\n",
+                     line_number, filename, file->n_lines);
+        return false;
+    }
+    uint32_t local_line = (uint32_t)(line_number - file->line_base);
+    if (*end == ':') {
+        const char *column_arg = end + 1;
+        unsigned long column = strtoul(column_arg, &end, 10);
+        if (end == column_arg || *end) {
+            report_error(fatal, "expected a column number after ':' but got: %s\n", arg);
+            return false;
+        }
+        // the column may point at the line terminator, but not beyond
+        const uint32_t *line_starts = get_line_starts(file);
+        uint32_t line_end = line_starts[local_line] + (local_line == file->n_lines); // the end of the file counts, too
+        if (column == 0 || column > line_end - line_starts[local_line - 1]) {
+            report_error(fatal, "column %lu is out of range for line %lu of file '%s'\n", column, line_number, filename);
+            return false;
+        }
+    }
+    *query_line = local_line;
+    return true;
+}
+
+// scope hierarchy queries
+//
+// The scopes of a line are its context lines as reported by print_line_contexts (boring
+// lines resolved, nothing skipped for being close). The innermost one is the line's
+// parent in the scope tree; parents always come before their children in the file.
+
+// Return the index of the innermost context line of the line with the given index
+// (-1 for the top level of the file).
+static int32_t enclosing_scope(ParsedFile *file, int32_t index)
+{
+    LineInfo *line_info = file->line_info_array + index;
+    if (line_info->outer_index < 0)
+        return -1;
+    LineInfo *outer = resolve_boring_lines(file, file->line_info_array + line_info->outer_index);
+    return (int32_t)(outer - file->line_info_array);
+}
+
+// Ancestor table for O(log depth) queries on the scope tree (binary lifting), built in
+// one pass over the lines.
+struct ScopeIndex {
+    uint32_t n_lines;
+    uint32_t n_levels; //< number of jump tables
+    uint32_t *depth; //< number of scopes enclosing each line
+    int32_t *jump; //< jump[k * n_lines + i]: the (2^k)-th enclosing scope of line i (or -1)
+};
+
+static void build_scope_index(ScopeIndex *scope_index, ParsedFile *file)
+{
+    uint32_t n_lines = file->n_lines;
+    scope_index->n_lines = n_lines;
+    scope_index->depth = (uint32_t *)malloc(n_lines * sizeof(uint32_t) + 1);
+    int32_t *parent = (int32_t *)malloc(n_lines * sizeof(int32_t) + 1);
+    if (!scope_index->depth || !parent)
+        exit_error("Out-of-memory allocating scope index.\n");
+
+    uint32_t max_depth = 0;
+    for (uint32_t i = 0; i < n_lines; ++i) {
+        parent[i] = enclosing_scope(file, (int32_t)i);
+        assert(parent[i] < (int32_t)i);
+        uint32_t depth = (parent[i] >= 0) ? scope_index->depth[parent[i]] + 1 : 0;
+        scope_index->depth[i] = depth;
+        if (depth > max_depth)
+            max_depth = depth;
+    }
+
+    uint32_t n_levels = 1;
+    while (n_levels < 32 && (1u << n_levels) <= max_depth)
+        n_levels++;
+    scope_index->n_levels = n_levels;
+    scope_index->jump = (int32_t *)realloc(parent, (size_t)n_levels * n_lines * sizeof(int32_t) + 1);
+    if (!scope_index->jump)
+        exit_error("Out-of-memory allocating scope index.\n");
+    for (uint32_t k = 1; k < n_levels; ++k) {
+        int32_t *prev = scope_index->jump + (size_t)(k - 1) * n_lines;
+        int32_t *jump = scope_index->jump + (size_t)k * n_lines;
+        for (uint32_t i = 0; i < n_lines; ++i)
+            jump[i] = (prev[i] >= 0) ? prev[prev[i]] : -1;
+    }
+}
+
+static void free_scope_index(ScopeIndex *scope_index)
+{
+    free(scope_index->depth);
+    free(scope_index->jump);
+    *scope_index = ScopeIndex();
+}
+
+// Return the k-th enclosing scope of line `index` (k == 1 is the innermost one, k == 0
+// the line itself) or -1 if there are fewer than k.
+static int32_t scope_ancestor(ScopeIndex *scope_index, int32_t index, uint32_t k)
+{
+    if (index < 0 || k > scope_index->depth[index])
+        return -1;
+    for (uint32_t level = 0; k; ++level, k >>= 1)
+        if (k & 1)
+            index = scope_index->jump[(size_t)level * scope_index->n_lines + index];
+    return index;
+}
+
+// Return the innermost of the scopes that are (or enclose) `a` and (or enclose) `b`.
+// (-1 for the top level)
+static int32_t scope_lowest_common(ScopeIndex *scope_index, int32_t a, int32_t b)
+{
+    if (a < 0 || b < 0)
+        return -1;
+    uint32_t depth_a = scope_index->depth[a];
+    uint32_t depth_b = scope_index->depth[b];
+    if (depth_a > depth_b)
+        a = scope_ancestor(scope_index, a, depth_a - depth_b);
+    else if (depth_b > depth_a)
+        b = scope_ancestor(scope_index, b, depth_b - depth_a);
+    if (a == b)
+        return a;
+    for (uint32_t level = scope_index->n_levels; level-- > 0; ) {
+        int32_t *jump = scope_index->jump + (size_t)level * scope_index->n_lines;
+        if (jump[a] != jump[b]) {
+            a = jump[a];
+            b = jump[b];
+        }
+    }
+    return scope_index->jump[a];
+}
+
+// Return the innermost scope enclosing both lines (-1 for the top level). Note that a
+// scope header is not inside its own scope.
+static int32_t scope_common(ScopeIndex *scope_index, int32_t a, int32_t b)
+{
+    return scope_lowest_common(scope_index, scope_ancestor(scope_index, a, 1), scope_ancestor(scope_index, b, 1));
+}
+
+// Is line `index` inside the scope opened by line `scope`?
+static bool scope_contains(ScopeIndex *scope_index, int32_t scope, int32_t index)
+{
+    if (scope < 0)
+        return true; // the top level contains everything
+    if (index < 0 || scope_index->depth[index] <= scope_index->depth[scope])
+        return false;
+    return scope_ancestor(scope_index, index, scope_index->depth[index] - scope_index->depth[scope]) == scope;
+}
+
+// Print the given scope and all scopes enclosing it (outermost first).
+static void print_scope_chain(ParsedFile *file, int32_t scope)
+{
+    if (scope < 0)
+        return;
+    print_scope_chain(file, enclosing_scope(file, scope));
+    Context ctx;
+    ctx.index = (uint32_t)scope;
+    ctx.text = file->text + file->line_info_array[scope].start_offset;
+    ctx.language = file->language;
+    print_context(&ctx);
+}
+
+// Navigation index over the scopes of a file (lines that are the innermost context of
+// some other line), for editor motions like "next sibling function" or "select scope".
+// Built in O(lines) because parents always come before their children.
+struct NavIndex {
+    uint32_t n_lines;
+    uint32_t *end; //< index of the last line of each scope (including a closing '}' line)
+    int32_t *first_child; //< first scope directly inside each scope (or -1)
+    int32_t *next_sibling; //< next scope with the same enclosing scope (or -1)
+    uint32_t *n_children; //< number of scopes directly inside each scope (0 for non-scope lines)
+    bool *is_scope;
+    int32_t root_first_child; //< first scope at the top level of the file (or -1)
+    uint32_t root_n_children;
+};
+
+static void build_nav_index(NavIndex *nav, ParsedFile *file)
+{
+    uint32_t n_lines = file->n_lines;
+    *nav = NavIndex();
+    nav->n_lines = n_lines;
+    nav->end = (uint32_t *)malloc(n_lines * sizeof(uint32_t) + 1);
+    nav->first_child = (int32_t *)malloc(n_lines * sizeof(int32_t) + 1);
+    nav->next_sibling = (int32_t *)malloc(n_lines * sizeof(int32_t) + 1);
+    nav->n_children = (uint32_t *)calloc(n_lines + 1, sizeof(uint32_t));
+    nav->is_scope = (bool *)calloc(n_lines + 1, sizeof(bool));
+    int32_t *parent = (int32_t *)malloc(n_lines * sizeof(int32_t) + 1);
+    int32_t *last_child = (int32_t *)malloc(n_lines * sizeof(int32_t) + 1);
+    if (!nav->end || !nav->first_child || !nav->next_sibling || !nav->n_children || !nav->is_scope
+        || !parent || !last_child)
+        exit_error("Out-of-memory allocating navigation index.\n");
+
+    for (uint32_t i = 0; i < n_lines; ++i) {
+        parent[i] = enclosing_scope(file, (int32_t)i);
+        if (parent[i] >= 0)
+            nav->is_scope[parent[i]] = true;
+        nav->end[i] = i;
+        nav->first_child[i] = -1;
+        nav->next_sibling[i] = -1;
+    }
+
+    // a scope ends with its last descendant...
+    for (uint32_t i = n_lines; i-- > 0; )
+        if (parent[i] >= 0 && nav->end[i] > nav->end[parent[i]])
+            nav->end[parent[i]] = nav->end[i];
+
+    // ...or a closing brace right after that, at the indentation of the scope header
+    for (uint32_t i = 0; i < n_lines; ++i) {
+        uint32_t next = nav->end[i] + 1;
+        if (!nav->is_scope[i] || next >= n_lines || nav->is_scope[next])
+            continue;
+        LineInfo *closing = file->line_info_array + next;
+        if (file->text[closing->start_offset] == '}' && closing->indentation == file->line_info_array[i].indentation)
+            nav->end[i] = next;
+    }
+
+    // child lists (in line order)
+    int32_t root_last_child = -1;
+    nav->root_first_child = -1;
+    for (uint32_t i = 0; i < n_lines; ++i) {
+        if (!nav->is_scope[i])
+            continue;
+        int32_t p = parent[i];
+        int32_t *first = (p >= 0) ? &nav->first_child[p] : &nav->root_first_child;
+        int32_t *last = (p >= 0) ? &last_child[p] : &root_last_child;
+        uint32_t *count = (p >= 0) ? &nav->n_children[p] : &nav->root_n_children;
+        if (*count == 0)
+            *first = (int32_t)i;
+        else
+            nav->next_sibling[*last] = (int32_t)i;
+        *last = (int32_t)i;
+        (*count)++;
+    }
+    free(parent);
+    free(last_child);
+}
+
+static void free_nav_index(NavIndex *nav)
+{
+    free(nav->end);
+    free(nav->first_child);
+    free(nav->next_sibling);
+    free(nav->n_children);
+    free(nav->is_scope);
+    *nav = NavIndex();
+}
+
+// The scope that a line belongs to for navigation purposes: the line itself if it opens
+// a scope, otherwise its innermost context (-1 for the top level).
+static int32_t nav_scope_of_line(NavIndex *nav, ParsedFile *file, uint32_t index)
+{
+    return nav->is_scope[index] ? (int32_t)index : enclosing_scope(file, (int32_t)index);
+}
+
+// Print one line "scope=S end=E parent=P first_child=C next_sibling=N children=K" for the
+// scope of the given line. Line numbers are 1-based, 0 stands for the whole file or none.
+static void print_nav_info(NavIndex *nav, ParsedFile *file, uint32_t index)
+{
+    int32_t scope = nav_scope_of_line(nav, file, index);
+    if (scope < 0) {
+        printf("scope=0 end=%u parent=0 first_child=%d next_sibling=0 children=%u",
+               nav->n_lines, nav->root_first_child + 1, nav->root_n_children);
+        return;
+    }
+    printf("scope=%d end=%u parent=%d first_child=%d next_sibling=%d children=%u",
+           scope + 1, nav->end[scope] + 1, enclosing_scope(file, scope) + 1,
+           nav->first_child[scope] + 1, nav->next_sibling[scope] + 1, nav->n_children[scope]);
+}
+
+// Print the line numbers of the scopes directly inside the scope of the given line,
+// separated by spaces.
+static void print_nav_children(NavIndex *nav, ParsedFile *file, uint32_t index)
+{
+    int32_t scope = nav_scope_of_line(nav, file, index);
+    const char *separator = "";
+    for (int32_t child = (scope < 0) ? nav->root_first_child : nav->first_child[scope];
+         child >= 0; child = nav->next_sibling[child]) {
+        printf("%s%d", separator, child + 1);
+        separator = " ";
+    }
+}
+
+// viewport range queries (see "<LINE>..<LINE>" and --bench-scroll)
+//
+// A "sticky scroll" header needs the information for every visible line on each scroll
+// event. For a range of lines we keep the chain of contexts as a stack and only update
+// the part that differs from the previous line, and we print a line only where the
+// information changes. The information of a line is determined by its contexts and by
+// which of them are far enough away to be printed (see print_contexts); the printed ones
+// are always the outermost, so a prefix of the stack.
+
+struct ContextStack {
+    Context *contexts; //< the contexts of the current line, outermost first
+    uint32_t depth;
+    uint32_t capacity;
+    uint32_t n_printed; //< number of contexts far enough away to be printed
+    int32_t scope; //< innermost context of the current line (-1 for the top level)
+    bool valid; //< false before the first line
+};
+
+// Move the stack to the line with the given index. Return true if the information
+// printed for it differs from that of the previous line.
+static bool context_stack_move(ContextStack *stack, ParsedFile *file, uint32_t index)
+{
+    uint32_t prev_n_printed = stack->n_printed;
+    bool prev_ellipsis = stack->n_printed < stack->depth;
+    uint32_t first_changed = stack->depth;
+    int32_t scope = enclosing_scope(file, (int32_t)index);
+    if (!stack->valid || scope != stack->scope) {
+        // Walk up from the new innermost context until we reach one that is on the stack
+        // (contexts come before the lines inside them, so the stack is sorted by index).
+        uint32_t keep = 0;
+        uint32_t n_new = 0;
+        for (int32_t s = scope; s >= 0; s = enclosing_scope(file, s)) {
+            uint32_t low = 0;
+            uint32_t high = stack->depth;
+            while (low < high) {
+                uint32_t mid = low + (high - low) / 2;
+                if (stack->contexts[mid].index < (uint32_t)s)
+                    low = mid + 1;
+                else
+                    high = mid;
+            }
+            if (low < stack->depth && stack->contexts[low].index == (uint32_t)s) {
+                keep = low + 1;
+                break;
+            }
+            n_new++;
+        }
+        if (keep + n_new > stack->capacity) {
+            stack->capacity = 2 * (keep + n_new) + 16;
+            stack->contexts = (Context *)realloc(stack->contexts, stack->capacity * sizeof(Context));
+            if (!stack->contexts)
+                exit_error("Out-of-memory allocating context stack.\n");
+        }
+        int32_t s = scope;
+        for (uint32_t i = keep + n_new; i > keep; --i) {
+            stack->contexts[i - 1].index = (uint32_t)s;
+            stack->contexts[i - 1].text = file->text + file->line_info_array[s].start_offset;
+            stack->contexts[i - 1].language = file->language;
+            s = enclosing_scope(file, s);
+        }
+        stack->depth = keep + n_new;
+        stack->scope = scope;
+        first_changed = keep;
+    }
+    uint32_t n_printed = stack->n_printed;
+    if (n_printed > stack->depth)
+        n_printed = stack->depth;
+    while (n_printed > 0 && index - stack->contexts[n_printed - 1].index < CLOSE_CONTEXT_LINES)
+        n_printed--;
+    while (n_printed < stack->depth && index - stack->contexts[n_printed].index >= CLOSE_CONTEXT_LINES)
+        n_printed++;
+    stack->n_printed = n_printed;
+
+    bool changed = !stack->valid || n_printed != prev_n_printed || first_changed < n_printed ||
+                   prev_ellipsis != (n_printed < stack->depth);
+    stack->valid = true;
+    return changed;
+}
+
+// Print "<LINE>\t<INFO>" for the first line of the range [begin_index, end_index) and
+// for each following line whose information differs from that of the line before it
+// (or a structured answer, see print_answer).
+static void print_line_range(ParsedFile *file, uint32_t begin_index, uint32_t end_index)
+{
+    ContextStack stack = {};
+    for (uint32_t index = begin_index; index < end_index; ++index) {
+        if (!context_stack_move(&stack, file, index))
+            continue;
+        if (format_option == FORMAT_TEXT)
+            printf("%u\t", index + 1);
+        print_answer(stack.contexts, 0, stack.depth, index, file->unreliable);
+        if (format_option != FORMAT_BINARY)
+            printf("\n");
+    }
+    free(stack.contexts);
+}
+
+// Convert "<POSITION>..<POSITION>" (see resolve_position) into the 1-based numbers of
+// the first and last line. Reports an error and returns false if the range is malformed
+// or out of range for the file.
+static bool resolve_range(ParsedFile *file, char *arg, const char *filename, bool fatal,
+                          uint32_t *first_line, uint32_t *last_line)
+{
+    char *dots = strstr(arg, "..");
+    if (!dots) {
+        report_error(fatal, "expected a range <LINE>..<LINE> but got: %s\n", arg);
+        return false;
+    }
+    *dots = 0;
+    bool ok = resolve_position(file, arg, filename, fatal, first_line) &&
+              resolve_position(file, dots + 2, filename, fatal, last_line);
+    *dots = '.';
+    if (ok && *first_line > *last_line) {
+        report_error(fatal, "the range %s ends before it starts\n", arg);
+        ok = false;
+    }
+    return ok;
+}
+
+// Monotonic wall-clock time in seconds, for benchmarks.
+static double get_time_seconds()
+{
+#ifdef WIN32
+    LARGE_INTEGER frequency;
+    LARGE_INTEGER counter;
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&counter);
+    return (double)counter.QuadPart / (double)frequency.QuadPart;
+#elif HAVE_POSIX
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double)now.tv_sec + 1e-9 * (double)now.tv_nsec;
+#else
+    return (double)clock() / CLOCKS_PER_SEC; // processor time, but that is what we measure anyway
+#endif
+}
+
+static int compare_doubles(const void *a, const void *b)
+{
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x < y) ? -1 : (x > y);
+}
+
+// Simulate scrolling through the whole file, `step` lines per scroll event, answering a
+// range query for the `window` visible lines on each event (with the output rendered into
+// a buffer instead of printed), and report the latency per event.
+static void bench_scroll(const char *filename, uint32_t window, uint32_t step)
+{
+    uint32_t text_size;
+    char *text = read_file(filename, &text_size, true /* fatal */);
+    double start_time = get_time_seconds();
+    ParsedFile file;
+    parse_text(&file, text, text_size, filename);
+    double parse_time = get_time_seconds() - start_time;
+    printf("%s: %u lines, %u bytes, parsed in %.1f ms\n", filename, file.n_lines, text_size, 1e3 * parse_time);
+
+    uint32_t n_events = (file.n_lines > window) ? (file.n_lines - window) / step + 1 : 1;
+    double *latencies = (double *)malloc(n_events * sizeof(double));
+    if (!latencies)
+        exit_error("Out-of-memory allocating benchmark results.\n");
+    ByteBuffer output = {};
+    ContextStack stack = {};
+    uint64_t n_changes = 0;
+    for (uint32_t i_event = 0; i_event < n_events; ++i_event) {
+        uint32_t begin_index = i_event * step;
+        uint32_t end_index = (begin_index + window < file.n_lines) ? begin_index + window : file.n_lines;
+        double event_start = get_time_seconds();
+        // every event is a query of its own, so start from an empty stack
+        stack.valid = false;
+        stack.depth = 0;
+        output.size = 0;
+        for (uint32_t index = begin_index; index < end_index; ++index) {
+            if (!context_stack_move(&stack, &file, index))
+                continue;
+            n_changes++;
+            for (uint32_t i = 0; i < stack.n_printed; ++i)
+                render_context(stack.contexts + i, &output);
+        }
+        latencies[i_event] = get_time_seconds() - event_start;
+    }
+    qsort(latencies, n_events, sizeof(double), compare_doubles);
+    double total = 0;
+    for (uint32_t i = 0; i < n_events; ++i)
+        total += latencies[i];
+    printf("%u scroll events of %u lines (step %u), %.1f changes per event\n",
+           n_events, window, step, (double)n_changes / n_events);
+    printf("latency per event: mean %.2f us, median %.2f us, p99 %.2f us, max %.2f us\n",
+           1e6 * total / n_events, 1e6 * latencies[n_events / 2],
+           1e6 * latencies[(uint32_t)(0.99 * (n_events - 1))], 1e6 * latencies[n_events - 1]);
+
+    free(stack.contexts);
+    free(output.data);
+    free(latencies);
+    free_parsed_file(&file);
+}
+
+// outline (see --outline)
+
+// is_control_flow plus the continuations of if statements ("else" and "} else"), which
+// are never worth an outline entry of their own
+static bool outline_is_control_flow(Context *ctx)
+{
+    const char *text = ctx->text;
+    if (text[0] == '}')
+        return true;
+    if (strncmp(text, "else", 4) == 0 && !isalnum((unsigned char)text[4]) && text[4] != '_')
+        return true;
+    return is_control_flow(ctx);
+}
+
+// Print every scope-opening line once, in file order, indented by the number of printed
+// scopes enclosing it. Parents come before their children, so a single pass over the
+// lines finds the scopes and their depths; a second one prints them.
+static void print_outline(ParsedFile *file, bool control_flow)
+{
+    uint32_t n_lines = file->n_lines;
+    uint32_t *depth = (uint32_t *)malloc(n_lines * sizeof(uint32_t) + 1);
+    bool *is_scope = (bool *)calloc(n_lines + 1, sizeof(bool));
+    bool *shown = (bool *)malloc(n_lines * sizeof(bool) + 1);
+    if (!depth || !is_scope || !shown)
+        exit_error("Out-of-memory allocating outline.\n");
+
+    for (uint32_t i = 0; i < n_lines; ++i) {
+        Context ctx;
+        ctx.index = i;
+        ctx.text = file->text + file->line_info_array[i].start_offset;
+        ctx.language = file->language;
+        shown[i] = ctx.text[0] && (control_flow || !outline_is_control_flow(&ctx));
+        int32_t parent = enclosing_scope(file, (int32_t)i);
+        if (parent >= 0) {
+            is_scope[parent] = true;
+            depth[i] = depth[parent] + (shown[parent] ? 1 : 0);
+        }
+        else
+            depth[i] = 0;
+    }
+
+    int width = 1;
+    for (uint32_t n = n_lines; n >= 10; n /= 10)
+        width++;
+    ByteBuffer buffer = {};
+    for (uint32_t i = 0; i < n_lines; ++i) {
+        if (!is_scope[i] || !shown[i])
+            continue;
+        Context ctx;
+        ctx.index = i;
+        ctx.text = file->text + file->line_info_array[i].start_offset;
+        ctx.language = file->language;
+        buffer.size = 0;
+        render_context(&ctx, &buffer);
+        printf("%*u: %*s", width, i + 1, (int)(2 * depth[i]), "");
+        fwrite(buffer.data, 1, buffer.size, stdout);
+        putc('\n', stdout);
+    }
+    free(buffer.data);
+    free(depth);
+    free(is_scope);
+    free(shown);
+}
+
+// folding ranges (see --folds)
+//
+// One range per scope that spans more than its header line, from the header to the last
+// line before a closing brace (so the brace stays visible, as editors do it), and one per
+// C comment spanning several lines. Ranges are printed in the order of their first lines.
+
+static void print_fold(uint32_t first_index, uint32_t last_index, const char *kind, bool json, bool *first_fold)
+{
+    if (json) {
+        // the FoldingRange of the Language Server Protocol (zero-based lines)
+        // Note: The LSP kind "region" means a range between #region markers, so scope
+        //       folds have no kind.
+        printf("%s\n{\"startLine\":%u,\"endLine\":%u", *first_fold ? "" : ",", first_index, last_index);
+        if (strcmp(kind, "comment") == 0)
+            printf(",\"kind\":\"comment\"");
+        printf("}");
+    }
+    else
+        printf("%u %u %s\n", first_index + 1, last_index + 1, kind);
+    *first_fold = false;
+}
+
+static void print_folds(ParsedFile *file, bool json)
+{
+    NavIndex nav;
+    build_nav_index(&nav, file);
+    bool first_fold = true;
+    if (json)
+        printf("[");
+    uint32_t i_comment = 0;
+    for (uint32_t i = 0; i <= file->n_lines; ++i) {
+        for (; i_comment < file->n_comment_ranges && (i == file->n_lines || file->comment_ranges[i_comment].first_index <= i); ++i_comment) {
+            LineRange *range = file->comment_ranges + i_comment;
+            if (range->last_index > range->first_index)
+                print_fold(range->first_index, range->last_index, "comment", json, &first_fold);
+        }
+        if (i == file->n_lines || !nav.is_scope[i])
+            continue;
+        uint32_t last_index = nav.end[i];
+        LineInfo *last = file->line_info_array + last_index;
+        if (file->text[last->start_offset] == '}' && last->indentation == file->line_info_array[i].indentation)
+            last_index--;
+        if (last_index > i)
+            print_fold(i, last_index, "region", json, &first_fold);
+    }
+    if (json)
+        printf("%s]\n", first_fold ? "" : "\n");
+    free_nav_index(&nav);
+}
+
+// list of file names, either from the command line or one per line from stdin
+
+struct FileList {
+    char **names;
+    uint32_t n_names;
+    uint32_t capacity;
+};
+
+static void file_list_add(FileList *list, char *name)
+{
+    if (list->n_names == list->capacity) {
+        list->capacity = list->capacity ? 2 * list->capacity : 64;
+        list->names = (char **)realloc(list->names, list->capacity * sizeof(char *));
+        if (!list->names)
+            exit_error("Out-of-memory allocating file list.\n");
+    }
+    list->names[list->n_names++] = name;
+}
+
+// Collect the file names given as command-line arguments. If there are none, or if
+// the only argument is "-", read file names from stdin, one per line.
+static void collect_file_list(FileList *list, int argc, char **argv)
+{
+    if (argc > 0 && !(argc == 1 && strcmp(argv[0], "-") == 0)) {
+        for (int i = 0; i < argc; ++i)
+            file_list_add(list, argv[i]);
+        return;
+    }
+
+    char buffer[4096];
+    while (fgets(buffer, sizeof(buffer), stdin)) {
+        size_t len = strlen(buffer);
+        if (len == sizeof(buffer) - 1 && buffer[len - 1] != '\n')
+            exit_error("file name on stdin is too long: %s...\n", buffer);
+        while (len && (buffer[len - 1] == '\n' || buffer[len - 1] == '\r'))
+            buffer[--len] = 0;
+        if (!len)
+            continue;
+        char *name = (char *)malloc(len + 1);
+        if (!name)
+            exit_error("Out-of-memory allocating file list.\n");
+        memcpy(name, buffer, len + 1);
+        file_list_add(list, name);
+    }
+}
+
+// Make paths comparable between index builds and queries: use forward slashes
+// and drop leading "./" components.
+static const char *normalize_path(char *path)
+{
+#ifdef WIN32
+    for (char *ptr = path; *ptr; ++ptr)
+        if (*ptr == '\\')
+            *ptr = '/';
+#endif
+    while (path[0] == '.' && path[1] == '/') {
+        path += 2;
+        while (*path == '/')
+            path++;
+    }
+    return path;
+}
+
+static void buffer_align(ByteBuffer *buffer, size_t alignment)
+{
+    size_t padding = (alignment - buffer->size % alignment) % alignment;
+    buffer_append(buffer, nullptr, padding);
+}
+
+// 64-bit FNV-1a followed by the murmur3 finalizer (so that the low bits are usable as
+// bucket and slot indices), with a seed for deriving independent hash functions.
+static uint64_t hash_string(const char *str, uint64_t seed)
+{
+    uint64_t h = 14695981039346656037ull ^ (seed * 0x9E3779B97F4A7C15ull);
+    for (const unsigned char *ptr = (const unsigned char *)str; *ptr; ++ptr) {
+        h ^= *ptr;
+        h *= 1099511628211ull;
+    }
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdull;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ull;
+    h ^= h >> 33;
+    return h;
+}
+
+// content hash (XXH64)
+//
+// We use this to recognize files with identical contents (vendored copies, generated
+// headers, multiple checkouts) so that they are parsed and stored only once. It works
+// on four independent 64-bit lanes, which keeps it at several GB/s.
+// Note: Input words are read in native byte order, so hashes are only comparable
+//       between machines of the same endianness (like the index files themselves).
+
+#define XXH_PRIME64_1 0x9E3779B185EBCA87ull
+#define XXH_PRIME64_2 0xC2B2AE3D27D4EB4Full
+#define XXH_PRIME64_3 0x165667B19E3779F9ull
+#define XXH_PRIME64_4 0x85EBCA77C2B2AE63ull
+#define XXH_PRIME64_5 0x27D4EB2F165667C5ull
+
+static inline uint64_t rotate_left(uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t read_u64(const unsigned char *ptr)
+{
+    uint64_t value;
+    memcpy(&value, ptr, sizeof(value));
+    return value;
+}
+
+static inline uint32_t read_u32(const unsigned char *ptr)
+{
+    uint32_t value;
+    memcpy(&value, ptr, sizeof(value));
+    return value;
+}
+
+static inline uint64_t xxh64_round(uint64_t acc, uint64_t input)
+{
+    acc += input * XXH_PRIME64_2;
+    acc = rotate_left(acc, 31);
+    return acc * XXH_PRIME64_1;
+}
+
+static inline uint64_t xxh64_merge_round(uint64_t acc, uint64_t value)
+{
+    acc ^= xxh64_round(0, value);
+    return acc * XXH_PRIME64_1 + XXH_PRIME64_4;
+}
+
+static uint64_t hash_bytes(const void *data, size_t size, uint64_t seed)
+{
+    const unsigned char *ptr = (const unsigned char *)data;
+    const unsigned char *end = ptr + size;
+    uint64_t h;
+
+    if (size >= 32) {
+        uint64_t v1 = seed + XXH_PRIME64_1 + XXH_PRIME64_2;
+        uint64_t v2 = seed + XXH_PRIME64_2;
+        uint64_t v3 = seed;
+        uint64_t v4 = seed - XXH_PRIME64_1;
+        const unsigned char *limit = end - 32;
+        do {
+            v1 = xxh64_round(v1, read_u64(ptr));
+            v2 = xxh64_round(v2, read_u64(ptr + 8));
+            v3 = xxh64_round(v3, read_u64(ptr + 16));
+            v4 = xxh64_round(v4, read_u64(ptr + 24));
+            ptr += 32;
+        } while (ptr <= limit);
+        h = rotate_left(v1, 1) + rotate_left(v2, 7) + rotate_left(v3, 12) + rotate_left(v4, 18);
+        h = xxh64_merge_round(h, v1);
+        h = xxh64_merge_round(h, v2);
+        h = xxh64_merge_round(h, v3);
+        h = xxh64_merge_round(h, v4);
+    }
+    else {
+        h = seed + XXH_PRIME64_5;
+    }
+
+    h += (uint64_t)size;
+
+    for (; ptr + 8 <= end; ptr += 8) {
+        h ^= xxh64_round(0, read_u64(ptr));
+        h = rotate_left(h, 27) * XXH_PRIME64_1 + XXH_PRIME64_4;
+    }
+    if (ptr + 4 <= end) {
+        h ^= (uint64_t)read_u32(ptr) * XXH_PRIME64_1;
+        h = rotate_left(h, 23) * XXH_PRIME64_2 + XXH_PRIME64_3;
+        ptr += 4;
+    }
+    for (; ptr < end; ++ptr) {
+        h ^= (*ptr) * XXH_PRIME64_5;
+        h = rotate_left(h, 11) * XXH_PRIME64_1;
+    }
+
+    h ^= h >> 33;
+    h *= XXH_PRIME64_2;
+    h ^= h >> 29;
+    h *= XXH_PRIME64_3;
+    h ^= h >> 32;
+    return h;
+}
+
+// The seed of the content hash under which a parse of the contents is shared (see
+// build_index_shard and ParseCache). The parse also depends on the language and the
+// engine, so identical bytes under "p.c" and "p.py" get different hashes.
+static uint64_t parse_key_seed(Language language, Engine engine)
+{
+    return ((uint64_t)language << 8) | (uint64_t)engine;
+}
+
+// open-addressing hash table mapping 64-bit keys to 32-bit values
+// Note: Keys need not be hashes (e.g. (i_file << 32) | index in --aggregate), so they are
+//       mixed with the murmur3 finalizer before their low bits select a slot.
+
+#define HASH_TABLE_EMPTY UINT32_MAX //< value marking an unused slot (cannot be stored)
+
+struct HashTable64 {
+    uint64_t *keys;
+    uint32_t *values;
+    uint32_t capacity; //< number of slots, a power of two (or 0)
+    uint32_t n_entries;
+};
+
+static uint32_t hash_table_slot(HashTable64 *table, uint64_t key)
+{
+    uint64_t mixed = key;
+    mixed ^= mixed >> 33;
+    mixed *= 0xff51afd7ed558ccdull;
+    mixed ^= mixed >> 33;
+    mixed *= 0xc4ceb9fe1a85ec53ull;
+    mixed ^= mixed >> 33;
+    uint32_t mask = table->capacity - 1;
+    uint32_t slot = (uint32_t)mixed & mask;
+    while (table->values[slot] != HASH_TABLE_EMPTY && table->keys[slot] != key)
+        slot = (slot + 1) & mask;
+    return slot;
+}
+
+// Return a pointer to the value stored for `key` or nullptr if there is none.
+static uint32_t *hash_table_find(HashTable64 *table, uint64_t key)
+{
+    if (!table->capacity)
+        return nullptr;
+    uint32_t slot = hash_table_slot(table, key);
+    return (table->values[slot] != HASH_TABLE_EMPTY) ? table->values + slot : nullptr;
+}
+
+// Insert `value` for `key` and return true if the key was not present yet. Otherwise,
+// leave the table unchanged, store the existing value in *existing_value and return false.
+static bool hash_table_insert(HashTable64 *table, uint64_t key, uint32_t value, uint32_t *existing_value)
+{
+    assert(value != HASH_TABLE_EMPTY);
+    if (2 * (table->n_entries + 1) > table->capacity) {
+        HashTable64 old = *table;
+        table->capacity = old.capacity ? 2 * old.capacity : 64;
+        if (!table->capacity)
+            exit_error("hash table has too many entries\n");
+        table->keys = (uint64_t *)malloc(table->capacity * sizeof(uint64_t));
+        table->values = (uint32_t *)malloc(table->capacity * sizeof(uint32_t));
+        if (!table->keys || !table->values)
+            exit_error("Out-of-memory growing hash table to %u entries.\n", table->capacity);
+        memset(table->values, 0xff, table->capacity * sizeof(uint32_t));
+        for (uint32_t i = 0; i < old.capacity; ++i) {
+            if (old.values[i] == HASH_TABLE_EMPTY)
+                continue;
+            uint32_t slot = hash_table_slot(table, old.keys[i]);
+            table->keys[slot] = old.keys[i];
+            table->values[slot] = old.values[i];
+        }
+        free(old.keys);
+        free(old.values);
+    }
+    uint32_t slot = hash_table_slot(table, key);
+    if (table->values[slot] != HASH_TABLE_EMPTY) {
+        if (existing_value)
+            *existing_value = table->values[slot];
+        return false;
+    }
+    table->keys[slot] = key;
+    table->values[slot] = value;
+    table->n_entries++;
+    return true;
+}
+
+static void hash_table_free(HashTable64 *table)
+{
+    free(table->keys);
+    free(table->values);
+    *table = HashTable64();
+}
+
+// string interning
+//
+// An append-only pool of NUL-terminated strings in which each distinct string is stored
+// once. The ID of a string is its offset into the pool, so IDs stay valid while the pool
+// grows (but the pool may move, so keep IDs rather than pointers). Equal strings have
+// equal IDs. ID 0 is the empty string and ID 1 is "}" (see compact_parsed_file).
+
+#define STRING_ID_EMPTY 0
+#define STRING_ID_CLOSING_BRACE 1
+
+struct StringTable {
+    ByteBuffer pool;
+    HashTable64 table; //< hash_bytes of a string -> its ID
+};
+
+static uint32_t intern_string(StringTable *strings, const char *text, size_t len);
+
+static void init_string_table(StringTable *strings)
+{
+    *strings = StringTable();
+    intern_string(strings, "", 0);
+    intern_string(strings, "}", 1);
+}
+
+// Return the ID of the given string (which need not be NUL-terminated), adding it to the
+// pool if it is not there yet.
+static uint32_t intern_string(StringTable *strings, const char *text, size_t len)
+{
+    // Note: If two strings have the same hash, the later one is keyed by its hash with
+    //       the next seed, and so on.
+    for (uint64_t seed = 0; ; ++seed) {
+        uint64_t key = hash_bytes(text, len, seed);
+        uint32_t *id = hash_table_find(&strings->table, key);
+        if (!id)
+            break;
+        const char *existing = strings->pool.data + *id;
+        if (strncmp(existing, text, len) == 0 && existing[len] == 0)
+            return *id;
+    }
+    if (strings->pool.size + len + 1 >= HASH_TABLE_EMPTY)
+        exit_error("too many distinct strings for one string table\n");
+    uint32_t id = (uint32_t)strings->pool.size;
+    char *dest = buffer_append(&strings->pool, nullptr, len + 1); // zero-terminated
+    memcpy(dest, text, len);
+    uint64_t seed = 0;
+    while (!hash_table_insert(&strings->table, hash_bytes(text, len, seed), id, nullptr))
+        seed++;
+    return id;
+}
+
+static void free_string_table(StringTable *strings)
+{
+    free(strings->pool.data);
+    hash_table_free(&strings->table);
+    *strings = StringTable();
+}
+
+// compaction
+//
+// Queries only print context lines, and only as far as render_context looks at them, so a
+// file kept in memory for a long time (see --watch --compact) can drop the rest of its text.
+// The context lines of all such files are interned into one string table, so headers like
+// "namespace detail {" are stored once however many files contain them.
+
+// Return the length of the part of the context line `text` that render_context looks at.
+static size_t rendered_length(char *text, Language language, ByteBuffer *scratch)
+{
+    Context ctx;
+    ctx.index = 0;
+    ctx.text = text;
+    ctx.language = language;
+    scratch->size = 0;
+    return (size_t)(render_context(&ctx, scratch) - text);
+}
+
+// Replace the text of the file by the IDs of its context lines in `strings`, each cut
+// where render_context stops. Everything else that needs the text is done beforehand: the
+// outer indices are resolved (resolve_boring_lines looks at '{' lines) and the line starts
+// are computed. Other lines get the empty string, or "}" for closing braces (see
+// build_nav_index). Parsing cannot resume from the file afterwards (see reparse_text).
+// Note: The file does not own its text afterwards. Set file->text to strings->pool.data
+//       before each use (the pool may have moved) and to nullptr before freeing the file.
+static void compact_parsed_file(ParsedFile *file, StringTable *strings)
+{
+    get_line_starts(file);
+    LineInfo *line_info_array = file->line_info_array;
+    uint32_t n_lines = file->n_lines;
+    bool *is_context = (bool *)calloc(n_lines + 1, sizeof(bool));
+    if (!is_context)
+        exit_error("Out-of-memory allocating context flags.\n");
+    // Note: resolve_boring_lines does not look at outer indices, so we can resolve in place.
+    for (uint32_t i = 0; i < n_lines; ++i) {
+        LineInfo *line_info = line_info_array + i;
+        if (line_info->outer_index < 0)
+            continue;
+        LineInfo *outer = resolve_boring_lines(file, line_info_array + line_info->outer_index);
+        line_info->outer_index = (int32_t)(outer - line_info_array);
+        is_context[line_info->outer_index] = true;
+    }
+
+    ByteBuffer scratch = {};
+    for (uint32_t i = 0; i < n_lines; ++i) {
+        LineInfo *line_info = line_info_array + i;
+        char *line_text = file->text + line_info->start_offset;
+        if (!is_context[i])
+            line_info->start_offset = (line_text[0] == '}') ? STRING_ID_CLOSING_BRACE : STRING_ID_EMPTY;
+        else
+            line_info->start_offset = intern_string(strings, line_text, rendered_length(line_text, file->language, &scratch));
+    }
+    free(scratch.data);
+    free(is_context);
+
+    free(file->text);
+    file->text = nullptr;
+    file->checkpoint = ParserCheckpoint();
+}
+
+// project index
+//
+// An index file maps paths to content records. A content record stores the context line
+// of every line (after skipping boring lines, see resolve_boring_lines) and the text of
+// all lines that are used as contexts. That is all we need to answer queries without
+// reading or parsing the source file.
+//
+// Content records are keyed by the hash of the file contents (see hash_bytes), seeded
+// with the language and engine they were parsed with (see parse_key_seed). Files with
+// identical contents and language are parsed once and share one content record.
+//
+// Index shards are built independently, possibly by several processes on several
+// machines sharing a file system. Each shard takes the files whose path hashes to
+// its shard number. --index-merge combines the shards into one index, dropping
+// duplicate content records, and adds a minimal perfect hash table (hash-and-displace)
+// for looking up paths. It also interns the context line texts of all records (cut where
+// render_context stops) into one string table, so the records of a merged index only
+// hold string IDs instead of a text pool each.
+//
+// Layout (all integers in native byte order, all entries 8-byte aligned):
+//
+//     IndexHeader
+//     uint32_t bucket_displacement[n_buckets]   (merged index only)
+//     uint64_t path_offset[n_files]             (merged index only)
+//     content records, each starting with an IndexRecordHeader (starting at contents_offset)
+//     path entries, each starting with an IndexPathHeader (starting at paths_offset)
+//     identifier table, starting with an IndexIdentHeader (merged index only, at idents_offset)
+//     string table, NUL-terminated strings (merged index only, at strings_offset, see StringTable)
+
+#define INDEX_MAGIC "WHEREIDX"
+#define INDEX_VERSION 6
+#define INDEX_SHARD_SEED 0x5348415244ull //< seed of the path hash that assigns files to shards
+#define INDEX_DIRECT_SLOT 0x80000000u //< displacement flag: the lower bits are the slot itself
+
+struct IndexHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t n_files; //< number of path entries
+    uint32_t n_contents; //< number of content records
+    uint32_t n_buckets; //< number of perfect hash buckets (0 for a shard)
+    uint64_t contents_offset; //< file offset of the first content record
+    uint64_t paths_offset; //< file offset of the first path entry
+    uint64_t idents_offset; //< file offset of the identifier table (0 in shards)
+    uint64_t strings_offset; //< file offset of the string table (0 in shards)
+};
+
+struct IndexPathHeader {
+    uint64_t entry_size; //< size of the whole entry including this header and padding
+    uint64_t content_hash;
+    uint64_t content_offset; //< file offset of the content record (0 in shards)
+    uint32_t language; //< Language the file was parsed as
+    uint32_t engine; //< Engine the file was parsed with (engine_option)
+    // followed by:
+    //     char path[]  //< NUL-terminated and padded
+};
+
+struct IndexRecordHeader {
+    uint64_t record_size; //< size of the whole record including this header and padding
+    uint64_t content_hash;
+    uint32_t n_lines;
+    uint32_t pool_size; //< size of the text pool including padding (0 in a merged index)
+    uint32_t language; //< Language of the file (the same for all files with this record)
+    uint32_t flags; //< INDEX_RECORD_UNRELIABLE
+    // followed by:
+    //     int32_t context_index[n_lines]  //< index of the context line of each line (or -1)
+    //     uint32_t text_offset[n_lines]   //< offset into the pool of the text of context lines (0 otherwise)
+    //     char pool[pool_size]            //< NUL-terminated texts, pool[0] is an empty string
+    // In a merged index, the text offsets are IDs in the string table of the index.
+};
+
+#define INDEX_RECORD_UNRELIABLE 1 //< answers are marked (see ParsedFile::unreliable)
+
+struct IndexRecord {
+    const char *path;
+    uint32_t n_lines;
+    Language language;
+    bool unreliable;
+    const int32_t *context_index;
+    const uint32_t *text_offset;
+    const char *pool; //< the record's own pool, or the string table of a merged index
+};
+
+// Decode a content record. `strings` is the string table of a merged index (nullptr for
+// the record of a shard).
+static void decode_index_record(const IndexRecordHeader *header, const char *strings, IndexRecord *record)
+{
+    const char *ptr = (const char *)(header + 1);
+    record->n_lines = header->n_lines;
+    record->language = (header->language < N_LANGUAGES) ? (Language)header->language : LANG_C;
+    record->unreliable = (header->flags & INDEX_RECORD_UNRELIABLE) != 0;
+    record->context_index = (const int32_t *)ptr;
+    ptr += header->n_lines * sizeof(int32_t);
+    record->text_offset = (const uint32_t *)ptr;
+    ptr += header->n_lines * sizeof(uint32_t);
+    record->pool = strings ? strings : ptr;
+}
+
+// Append the content record for the given parsed file to `buffer`.
+static void build_index_record(ByteBuffer *buffer, uint64_t content_hash, ParsedFile *file, const char *filename)
+{
+    size_t record_start = buffer->size;
+    IndexRecordHeader header = {};
+    header.content_hash = content_hash;
+    header.n_lines = file->n_lines;
+    header.language = file->language;
+    header.flags = file->unreliable ? INDEX_RECORD_UNRELIABLE : 0;
+    buffer_append(buffer, &header, sizeof(header));
+
+    size_t context_index_start = buffer->size;
+    buffer_append(buffer, nullptr, file->n_lines * sizeof(int32_t));
+    size_t text_offset_start = buffer->size;
+    buffer_append(buffer, nullptr, file->n_lines * sizeof(uint32_t)); // zero-initialized
+
+    size_t pool_start = buffer->size;
+    buffer_append(buffer, "", 1);
+    LineInfo *line_info_array = file->line_info_array;
+    for (uint32_t index = 0; index < file->n_lines; ++index) {
+        int32_t context_index = -1;
+        if (line_info_array[index].outer_index >= 0) {
+            LineInfo *outer = resolve_boring_lines(file, line_info_array + line_info_array[index].outer_index);
+            context_index = (int32_t)(outer - line_info_array);
+        }
+        // Note: Context lines always precede the lines they are contexts of, so the
+        //       text offset of the context line is still zero if we did not store it yet.
+        int32_t *context_index_ptr = (int32_t *)(buffer->data + context_index_start);
+        uint32_t *text_offset_ptr = (uint32_t *)(buffer->data + text_offset_start);
+        context_index_ptr[index] = context_index;
+        if (context_index >= 0 && text_offset_ptr[context_index] == 0) {
+            // Note: Of a long line, we keep more than render_context looks at (which starts
+            //       after the prefixes that maybe_skip_substr drops).
+            const char *text = file->text + line_info_array[context_index].start_offset;
+            const char *nul = (const char *)memchr(text, 0, 2 * RENDER_SCAN_LIMIT);
+            size_t len = nul ? (size_t)(nul - text) : 2 * RENDER_SCAN_LIMIT;
+            size_t text_offset = buffer->size - pool_start;
+            if (text_offset > UINT32_MAX)
+                exit_error("text pool of index record for '%s' is too large\n", filename);
+            buffer_append(buffer, text, len);
+            buffer_append(buffer, "", 1);
+            // Note: buffer_append may have moved the buffer.
+            ((uint32_t *)(buffer->data + text_offset_start))[context_index] = (uint32_t)text_offset;
+        }
+    }
+    buffer_align(buffer, 8);
+
+    IndexRecordHeader *header_ptr = (IndexRecordHeader *)(buffer->data + record_start);
+    header_ptr->record_size = buffer->size - record_start;
+    if (buffer->size - pool_start > UINT32_MAX)
+        exit_error("text pool of index record for '%s' is too large\n", filename);
+    header_ptr->pool_size = (uint32_t)(buffer->size - pool_start);
+}
+
+// Append the content record of a merged index for the given shard record to `buffer`,
+// interning the texts of its context lines into `strings`.
+static void build_merged_index_record(ByteBuffer *buffer, const IndexRecordHeader *shard_record, StringTable *strings,
+                                      ByteBuffer *scratch)
+{
+    IndexRecord record;
+    decode_index_record(shard_record, nullptr, &record);
+    size_t record_start = buffer->size;
+    IndexRecordHeader header = {};
+    header.content_hash = shard_record->content_hash;
+    header.n_lines = record.n_lines;
+    header.language = record.language;
+    header.flags = shard_record->flags;
+    buffer_append(buffer, &header, sizeof(header));
+    buffer_append(buffer, record.context_index, record.n_lines * sizeof(int32_t));
+    size_t text_offset_start = buffer->size;
+    buffer_append(buffer, nullptr, record.n_lines * sizeof(uint32_t)); // zero-initialized
+    for (uint32_t index = 0; index < record.n_lines; ++index) {
+        if (!record.text_offset[index])
+            continue; // not a context line
+        char *text = (char *)record.pool + record.text_offset[index];
+        uint32_t id = intern_string(strings, text, rendered_length(text, record.language, scratch));
+        ((uint32_t *)(buffer->data + text_offset_start))[index] = id;
+    }
+    buffer_align(buffer, 8);
+    ((IndexRecordHeader *)(buffer->data + record_start))->record_size = buffer->size - record_start;
+}
+
+// Append a path entry to `buffer`.
+static void build_index_path_entry(ByteBuffer *buffer, const char *path, uint64_t content_hash, Language language,
+                                   Engine engine, uint64_t content_offset)
+{
+    size_t entry_start = buffer->size;
+    IndexPathHeader header = {};
+    header.content_hash = content_hash;
+    header.content_offset = content_offset;
+    header.language = language;
+    header.engine = engine;
+    buffer_append(buffer, &header, sizeof(header));
+    buffer_append(buffer, path, strlen(path) + 1);
+    buffer_align(buffer, 8);
+    ((IndexPathHeader *)(buffer->data + entry_start))->entry_size = buffer->size - entry_start;
+}
+
+static void write_or_die(FILE *file, const void *data, size_t n_bytes, const char *filename)
+{
+    if (n_bytes && fwrite(data, 1, n_bytes, file) != n_bytes)
+        exit_clib_error("could not write to file '%s'", filename);
+}
+
+// Parse all files in `list` whose path hash selects shard number `shard` out of `n_shards`
+// and write their records into the shard file `shard_filename`.
+static void build_index_shard(uint32_t shard, uint32_t n_shards, const char *shard_filename, FileList *list)
+{
+    #pragma warning (suppress : 4996) // gimme fopen
+    FILE *out = fopen(shard_filename, "wb");
+    if (!out)
+        exit_clib_error("could not open shard file '%s' for writing", shard_filename);
+
+    IndexHeader header = {};
+    memcpy(header.magic, INDEX_MAGIC, sizeof(header.magic));
+    header.version = INDEX_VERSION;
+    header.contents_offset = sizeof(IndexHeader);
+    write_or_die(out, &header, sizeof(header), shard_filename);
+    uint64_t offset = sizeof(IndexHeader);
+
+    HashTable64 seen_contents = {};
+    ByteBuffer buffer = {};
+    ByteBuffer paths = {};
+    for (uint32_t i = 0; i < list->n_names; ++i) {
+        char *filename = list->names[i];
+        const char *path = normalize_path(filename);
+        if (hash_string(path, INDEX_SHARD_SEED) % n_shards != shard)
+            continue;
+
+        uint32_t text_size;
+        char *text = read_file(filename, &text_size, false /* fatal */);
+        if (!text)
+            continue;
+
+        if (header.n_files == UINT32_MAX)
+            exit_error("too many files for one index shard\n");
+        header.n_files++;
+
+        Language language = language_of_filename(filename);
+        uint64_t content_hash = hash_bytes(text, text_size, parse_key_seed(language, engine_option));
+        build_index_path_entry(&paths, path, content_hash, language, engine_option, 0);
+        if (!hash_table_insert(&seen_contents, content_hash, header.n_contents, nullptr)) {
+            free(text);
+            continue; // identical contents are already in this shard
+        }
+        header.n_contents++;
+
+        ParsedFile file;
+        parse_text(&file, text, text_size, filename);
+        buffer.size = 0;
+        build_index_record(&buffer, content_hash, &file, filename);
+        write_or_die(out, buffer.data, buffer.size, shard_filename);
+        offset += buffer.size;
+        free_parsed_file(&file);
+    }
+    header.paths_offset = offset;
+    write_or_die(out, paths.data, paths.size, shard_filename);
+    free(paths.data);
+    free(buffer.data);
+    hash_table_free(&seen_contents);
+
+    if (fseek(out, 0, SEEK_SET) != 0)
+        exit_clib_error("could not seek the beginning of shard file '%s'", shard_filename);
+    write_or_die(out, &header, sizeof(header), shard_filename);
+    if (fclose(out) == EOF)
+        exit_clib_error("could not close shard file '%s'", shard_filename);
+}
+
+// Check the header of an index or shard file that was read into memory by read_file.
+static IndexHeader *check_index_header(char *data, uint64_t size, const char *filename)
+{
+    IndexHeader *header = (IndexHeader *)data;
+    if (size < sizeof(IndexHeader) || memcmp(header->magic, INDEX_MAGIC, sizeof(header->magic)) != 0)
+        exit_error("'%s' is not a whereami index file\n", filename);
+    if (header->version != INDEX_VERSION)
+        exit_error("index file '%s' has version %u but this program only supports version %u\n",
+                   filename, header->version, INDEX_VERSION);
+    if (header->contents_offset > size || header->paths_offset > size || header->idents_offset > size
+        || header->strings_offset > size)
+        exit_error("index file '%s' is corrupt\n", filename);
+    return header;
+}
+
+struct IndexKey {
+    const IndexPathHeader *entry;
+    const char *path;
+    uint64_t hash; //< hash_string(path, 0)
+};
+
+struct IndexBucket {
+    uint32_t id;
+    uint32_t first_key; //< index into the keys array (sorted by bucket)
+    uint32_t n_keys;
+};
+
+static int compare_buckets_by_size_descending(const void *a, const void *b)
+{
+    const IndexBucket *bucket_a = (const IndexBucket *)a;
+    const IndexBucket *bucket_b = (const IndexBucket *)b;
+    if (bucket_a->n_keys != bucket_b->n_keys)
+        return (bucket_a->n_keys > bucket_b->n_keys) ? -1 : 1;
+    return (bucket_a->id < bucket_b->id) ? -1 : (bucket_a->id > bucket_b->id);
+}
+
+static uint32_t index_bucket_of(uint64_t hash, uint32_t n_buckets)
+{
+    return (uint32_t)(hash % n_buckets);
+}
+
+static uint32_t index_slot_of(const char *path, uint32_t displacement, uint32_t n_slots)
+{
+    if (displacement & INDEX_DIRECT_SLOT)
+        return displacement & ~INDEX_DIRECT_SLOT;
+    return (uint32_t)(hash_string(path, displacement) % n_slots);
+}
+
+static uint64_t index_slots_offset(uint32_t n_buckets)
+{
+    return (sizeof(IndexHeader) + n_buckets * sizeof(uint32_t) + 7) & ~(uint64_t)7;
+}
+
+// identifier table of a merged index
+//
+// An inverted index from identifiers to the scope headers (context lines) that mention
+// them, for "where is X defined" lookups without reading any source file. Identifiers
+// are tokenized as in render_context and interned into one name pool. The table is
+// open-addressing with linear probing, keyed by the hash of the identifier.
+// Note: Like content hashes, identifier hashes are taken to be unique.
+
+struct IndexIdentHeader {
+    uint32_t n_slots; //< size of the hash table, a power of two
+    uint32_t n_idents;
+    uint64_t n_postings;
+    uint64_t names_size; //< size of the name pool including padding
+    // followed by:
+    //     IndexIdentSlot slots[n_slots]
+    //     IndexPosting postings[n_postings]  //< grouped by identifier, in path slot and line order
+    //     char names[names_size]             //< NUL-terminated identifiers
+};
+
+struct IndexIdentSlot {
+    uint64_t hash; //< hash_bytes of the identifier
+    uint64_t first_posting;
+    uint32_t n_postings; //< 0 for an unused slot
+    uint32_t name_offset; //< offset into the name pool
+};
+
+struct IndexPosting {
+    uint32_t path_slot; //< slot of the path entry in the perfect hash table
+    uint32_t index; //< line index of the scope header
+};
+
+struct IdentOccurrence {
+    uint32_t ident;
+    IndexPosting posting;
+};
+
+static bool is_identifier_char(char ch)
+{
+    return isalnum((unsigned char)ch) || ch == '_';
+}
+
+// Find the first identifier at or after `text`, splitting like render_context (runs of
+// letters, digits and '_', up to a comment, see is_line_comment) but skipping numbers.
+// Returns nullptr if there is none, otherwise its start with its length in *len.
+static const char *next_identifier(const char *text, Language language, uint32_t *len)
+{
+    for (const char *ptr = text; *ptr; ) {
+        // Note: Context lines never start with a comment.
+        if (is_line_comment(language, ptr, ptr > text && isspace((unsigned char)ptr[-1])))
+            return nullptr;
+        if (!is_identifier_char(*ptr)) {
+            ptr++;
+            continue;
+        }
+        const char *start = ptr;
+        while (is_identifier_char(*ptr))
+            ptr++;
+        if (!isdigit((unsigned char)*start)) {
+            *len = (uint32_t)(ptr - start);
+            return start;
+        }
+    }
+    return nullptr;
+}
+
+// Append the identifier table for the content records of the given path slots to `out`.
+static void build_index_idents(ByteBuffer *out, const IndexRecordHeader **slot_contents, uint32_t n_path_slots)
+{
+    HashTable64 ident_ids = {}; // hash -> ident id
+    ByteBuffer names = {};
+    ByteBuffer ident_names = {}; // uint32_t name offset per ident id
+    ByteBuffer ident_hashes = {}; // uint64_t hash per ident id
+    ByteBuffer occurrences = {}; // IdentOccurrence
+    buffer_append(&names, "", 1);
+    for (uint32_t slot = 0; slot < n_path_slots; ++slot) {
+        IndexRecord record;
+        decode_index_record(slot_contents[slot], nullptr, &record);
+        for (uint32_t index = 0; index < record.n_lines; ++index) {
+            if (!record.text_offset[index])
+                continue; // not a context line
+            size_t line_start = occurrences.size;
+            uint32_t len;
+            for (const char *ident = next_identifier(record.pool + record.text_offset[index], record.language, &len);
+                 ident; ident = next_identifier(ident + len, record.language, &len)) {
+                uint64_t hash = hash_bytes(ident, len, 0);
+                uint32_t id = (uint32_t)(ident_hashes.size / sizeof(uint64_t));
+                uint32_t existing;
+                if (!hash_table_insert(&ident_ids, hash, id, &existing)) {
+                    id = existing;
+                    // one posting per line, even if the identifier occurs several times
+                    bool seen = false;
+                    for (size_t i = line_start; i < occurrences.size && !seen; i += sizeof(IdentOccurrence))
+                        seen = ((IdentOccurrence *)(occurrences.data + i))->ident == id;
+                    if (seen)
+                        continue;
+                }
+                else {
+                    if (names.size + len + 1 > UINT32_MAX)
+                        exit_error("too many identifiers for one index\n");
+                    uint32_t name_offset = (uint32_t)names.size;
+                    buffer_append(&names, ident, len);
+                    buffer_append(&names, "", 1);
+                    buffer_append(&ident_names, &name_offset, sizeof(name_offset));
+                    buffer_append(&ident_hashes, &hash, sizeof(hash));
+                }
+                IdentOccurrence occurrence;
+                occurrence.ident = id;
+                occurrence.posting.path_slot = slot;
+                occurrence.posting.index = index;
+                buffer_append(&occurrences, &occurrence, sizeof(occurrence));
+            }
+        }
+    }
+    buffer_align(&names, 8);
+
+    uint32_t n_idents = (uint32_t)(ident_hashes.size / sizeof(uint64_t));
+    uint64_t n_postings = occurrences.size / sizeof(IdentOccurrence);
+    IdentOccurrence *occurrence_array = (IdentOccurrence *)occurrences.data;
+
+    // group the postings by identifier (counting sort, keeping the order within groups)
+    uint64_t *first_posting = (uint64_t *)calloc(n_idents + 1, sizeof(uint64_t));
+    uint32_t *n_ident_postings = (uint32_t *)calloc(n_idents + 1, sizeof(uint32_t));
+    IndexPosting *postings = (IndexPosting *)malloc(n_postings * sizeof(IndexPosting) + 1);
+    if (!first_posting || !n_ident_postings || !postings)
+        exit_error("Out-of-memory allocating identifier table.\n");
+    for (uint64_t i = 0; i < n_postings; ++i)
+        n_ident_postings[occurrence_array[i].ident]++;
+    for (uint32_t id = 1; id < n_idents; ++id)
+        first_posting[id] = first_posting[id - 1] + n_ident_postings[id - 1];
+    memset(n_ident_postings, 0, n_idents * sizeof(uint32_t));
+    for (uint64_t i = 0; i < n_postings; ++i) {
+        uint32_t id = occurrence_array[i].ident;
+        postings[first_posting[id] + n_ident_postings[id]++] = occurrence_array[i].posting;
+    }
+
+    IndexIdentHeader header = {};
+    header.n_slots = 16;
+    while (header.n_slots < 2 * n_idents)
+        header.n_slots *= 2;
+    header.n_idents = n_idents;
+    header.n_postings = n_postings;
+    header.names_size = names.size;
+    buffer_append(out, &header, sizeof(header));
+    size_t slots_start = out->size;
+    buffer_append(out, nullptr, header.n_slots * sizeof(IndexIdentSlot));
+    uint32_t mask = header.n_slots - 1;
+    for (uint32_t id = 0; id < n_idents; ++id) {
+        IndexIdentSlot *slots = (IndexIdentSlot *)(out->data + slots_start);
+        uint64_t hash = ((uint64_t *)ident_hashes.data)[id];
+        uint32_t slot = (uint32_t)hash & mask;
+        while (slots[slot].n_postings)
+            slot = (slot + 1) & mask;
+        slots[slot].hash = hash;
+        slots[slot].first_posting = first_posting[id];
+        slots[slot].n_postings = n_ident_postings[id];
+        slots[slot].name_offset = ((uint32_t *)ident_names.data)[id];
+    }
+    buffer_append(out, postings, n_postings * sizeof(IndexPosting));
+    buffer_align(out, 8);
+    buffer_append(out, names.data, names.size);
+
+    free(postings);
+    free(n_ident_postings);
+    free(first_posting);
+    free(occurrences.data);
+    free(ident_hashes.data);
+    free(ident_names.data);
+    free(names.data);
+    hash_table_free(&ident_ids);
+}
+
+// Merge the given shard files into one index file with a perfect hash table.
+static void merge_index_shards(const char *index_filename, int n_shard_files, char **shard_filenames)
+{
+    char **shard_data = (char **)malloc(n_shard_files * sizeof(char *));
+    if (!shard_data)
+        exit_error("Out-of-memory allocating shard array.\n");
+
+    uint64_t n_keys_total = 0;
+    uint64_t n_contents_total = 0;
+    for (int i = 0; i < n_shard_files; ++i) {
+        uint32_t size;
+        shard_data[i] = read_file(shard_filenames[i], &size, true /* fatal */);
+        IndexHeader *header = check_index_header(shard_data[i], size, shard_filenames[i]);
+        n_keys_total += header->n_files;
+        n_contents_total += header->n_contents;
+    }
+    if (n_keys_total >= INDEX_DIRECT_SLOT || n_contents_total >= HASH_TABLE_EMPTY)
+        exit_error("too many files (%" PRIu64 ") for one index\n", n_keys_total);
+    uint32_t n_keys = (uint32_t)n_keys_total;
+
+    // collect the content records of all shards, dropping duplicates
+    const IndexRecordHeader **contents = (const IndexRecordHeader **)malloc((n_contents_total + 1) * sizeof(IndexRecordHeader *));
+    if (!contents)
+        exit_error("Out-of-memory allocating index content table.\n");
+    HashTable64 content_table = {};
+    uint32_t n_contents = 0;
+    for (int i = 0; i < n_shard_files; ++i) {
+        IndexHeader *header = (IndexHeader *)shard_data[i];
+        const char *ptr = shard_data[i] + header->contents_offset;
+        for (uint32_t i_content = 0; i_content < header->n_contents; ++i_content) {
+            const IndexRecordHeader *record = (const IndexRecordHeader *)ptr;
+            if (hash_table_insert(&content_table, record->content_hash, n_contents, nullptr))
+                contents[n_contents++] = record;
+            ptr += record->record_size;
+        }
+    }
+
+    // collect the path entries of all shards
+    IndexKey *keys = (IndexKey *)malloc((n_keys + 1) * sizeof(IndexKey));
+    if (!keys)
+        exit_error("Out-of-memory allocating index keys.\n");
+    {
+        uint32_t i_key = 0;
+        for (int i = 0; i < n_shard_files; ++i) {
+            IndexHeader *header = (IndexHeader *)shard_data[i];
+            const char *ptr = shard_data[i] + header->paths_offset;
+            for (uint32_t i_path = 0; i_path < header->n_files; ++i_path) {
+                const IndexPathHeader *entry = (const IndexPathHeader *)ptr;
+                IndexKey *key = keys + i_key++;
+                key->entry = entry;
+                key->path = (const char *)(entry + 1);
+                key->hash = hash_string(key->path, 0);
+                if (!hash_table_find(&content_table, entry->content_hash))
+                    exit_error("shard file '%s' is corrupt (no content record for '%s')\n",
+                               shard_filenames[i], key->path);
+                ptr += entry->entry_size;
+            }
+        }
+        assert(i_key == n_keys);
+    }
+
+    // sort keys into buckets (counting sort)
+    uint32_t n_buckets = n_keys ? (n_keys + 3) / 4 : 1;
+    IndexBucket *buckets = (IndexBucket *)calloc(n_buckets, sizeof(IndexBucket));
+    IndexKey *sorted_keys = (IndexKey *)malloc((n_keys + 1) * sizeof(IndexKey));
+    uint32_t *displacement = (uint32_t *)calloc(n_buckets, sizeof(uint32_t));
+    bool *slot_used = (bool *)calloc(n_keys + 1, sizeof(bool));
+    uint32_t *key_of_slot = (uint32_t *)malloc((n_keys + 1) * sizeof(uint32_t));
+    uint32_t *candidate_slots = (uint32_t *)malloc((n_keys + 1) * sizeof(uint32_t));
+    if (!buckets || !sorted_keys || !displacement || !slot_used || !key_of_slot || !candidate_slots)
+        exit_error("Out-of-memory allocating perfect hash tables.\n");
+
+    for (uint32_t i = 0; i < n_keys; ++i)
+        buckets[index_bucket_of(keys[i].hash, n_buckets)].n_keys++;
+    for (uint32_t b = 0, first = 0; b < n_buckets; ++b) {
+        buckets[b].id = b;
+        buckets[b].first_key = first;
+        first += buckets[b].n_keys;
+        buckets[b].n_keys = 0;
+    }
+    for (uint32_t i = 0; i < n_keys; ++i) {
+        IndexBucket *bucket = buckets + index_bucket_of(keys[i].hash, n_buckets);
+        sorted_keys[bucket->first_key + bucket->n_keys++] = keys[i];
+    }
+
+    // Place the buckets, largest first: for each bucket find a displacement that maps
+    // all of its keys to free slots. Single-key buckets are placed directly into the
+    // remaining free slots.
+    IndexBucket *bucket_order = (IndexBucket *)malloc(n_buckets * sizeof(IndexBucket));
+    if (!bucket_order)
+        exit_error("Out-of-memory allocating perfect hash tables.\n");
+    memcpy(bucket_order, buckets, n_buckets * sizeof(IndexBucket));
+    qsort(bucket_order, n_buckets, sizeof(IndexBucket), compare_buckets_by_size_descending);
+
+    uint32_t next_free_slot = 0;
+    for (uint32_t i = 0; i < n_buckets; ++i) {
+        IndexBucket *bucket = bucket_order + i;
+        uint32_t b = bucket->id;
+        IndexKey *bucket_keys = sorted_keys + bucket->first_key;
+        if (bucket->n_keys == 0)
+            break; // all remaining buckets are empty, too
+        for (uint32_t k = 1; k < bucket->n_keys; ++k)
+            for (uint32_t j = 0; j < k; ++j)
+                if (strcmp(bucket_keys[k].path, bucket_keys[j].path) == 0)
+                    exit_error("path '%s' occurs in more than one index shard\n", bucket_keys[k].path);
+
+        if (bucket->n_keys == 1) {
+            while (slot_used[next_free_slot])
+                next_free_slot++;
+            displacement[b] = INDEX_DIRECT_SLOT | next_free_slot;
+            slot_used[next_free_slot] = true;
+            key_of_slot[next_free_slot] = bucket->first_key;
+            continue;
+        }
+
+        for (uint32_t d = 1; ; ++d) {
+            if (d == INDEX_DIRECT_SLOT)
+                exit_error("could not construct perfect hash table for the index\n");
+            uint32_t k;
+            for (k = 0; k < bucket->n_keys; ++k) {
+                uint32_t slot = index_slot_of(bucket_keys[k].path, d, n_keys);
+                if (slot_used[slot])
+                    break;
+                uint32_t j;
+                for (j = 0; j < k; ++j)
+                    if (candidate_slots[j] == slot)
+                        break;
+                if (j < k)
+                    break;
+                candidate_slots[k] = slot;
+            }
+            if (k == bucket->n_keys) {
+                displacement[b] = d;
+                for (k = 0; k < bucket->n_keys; ++k) {
+                    slot_used[candidate_slots[k]] = true;
+                    key_of_slot[candidate_slots[k]] = bucket->first_key + k;
+                }
+                break;
+            }
+        }
+    }
+
+    // compute the layout of the merged index
+    IndexHeader header = {};
+    memcpy(header.magic, INDEX_MAGIC, sizeof(header.magic));
+    header.version = INDEX_VERSION;
+    header.n_files = n_keys;
+    header.n_contents = n_contents;
+    header.n_buckets = n_buckets;
+    uint64_t tables_offset = sizeof(IndexHeader);
+    uint64_t slots_offset = index_slots_offset(n_buckets);
+    header.contents_offset = slots_offset + n_keys * sizeof(uint64_t);
+
+    uint64_t *content_offset = (uint64_t *)malloc((n_contents + 1) * sizeof(uint64_t));
+    uint64_t *path_offset = (uint64_t *)malloc((n_keys + 1) * sizeof(uint64_t));
+    if (!content_offset || !path_offset)
+        exit_error("Out-of-memory allocating index offset tables.\n");
+    ByteBuffer merged_contents = {};
+    StringTable strings;
+    init_string_table(&strings);
+    {
+        ByteBuffer scratch = {};
+        for (uint32_t i = 0; i < n_contents; ++i) {
+            content_offset[i] = header.contents_offset + merged_contents.size;
+            build_merged_index_record(&merged_contents, contents[i], &strings, &scratch);
+        }
+        free(scratch.data);
+    }
+    buffer_align(&strings.pool, 8);
+    header.paths_offset = header.contents_offset + merged_contents.size;
+
+    ByteBuffer paths = {};
+    const IndexRecordHeader **slot_contents = (const IndexRecordHeader **)malloc((n_keys + 1) * sizeof(IndexRecordHeader *));
+    if (!slot_contents)
+        exit_error("Out-of-memory allocating index offset tables.\n");
+    for (uint32_t slot = 0; slot < n_keys; ++slot) {
+        IndexKey *key = sorted_keys + key_of_slot[slot];
+        uint32_t i_content = *hash_table_find(&content_table, key->entry->content_hash);
+        path_offset[slot] = header.paths_offset + paths.size;
+        build_index_path_entry(&paths, key->path, key->entry->content_hash, (Language)key->entry->language,
+                               (Engine)key->entry->engine, content_offset[i_content]);
+        slot_contents[slot] = contents[i_content];
+    }
+    ByteBuffer idents = {};
+    build_index_idents(&idents, slot_contents, n_keys);
+    header.idents_offset = header.paths_offset + paths.size;
+    header.strings_offset = header.idents_offset + idents.size;
+
+    // write the merged index
+    #pragma warning (suppress : 4996) // gimme fopen
+    FILE *out = fopen(index_filename, "wb");
+    if (!out)
+        exit_clib_error("could not open index file '%s' for writing", index_filename);
+    write_or_die(out, &header, sizeof(header), index_filename);
+    write_or_die(out, displacement, n_buckets * sizeof(uint32_t), index_filename);
+    uint64_t padding = 0;
+    write_or_die(out, &padding, slots_offset - (tables_offset + n_buckets * sizeof(uint32_t)), index_filename);
+    write_or_die(out, path_offset, n_keys * sizeof(uint64_t), index_filename);
+    write_or_die(out, merged_contents.data, merged_contents.size, index_filename);
+    write_or_die(out, paths.data, paths.size, index_filename);
+    write_or_die(out, idents.data, idents.size, index_filename);
+    write_or_die(out, strings.pool.data, strings.pool.size, index_filename);
+    if (fclose(out) == EOF)
+        exit_clib_error("could not close index file '%s'", index_filename);
+
+    free(idents.data);
+    free(slot_contents);
+    free(paths.data);
+    free_string_table(&strings);
+    free(merged_contents.data);
+    free(path_offset);
+    free(content_offset);
+    free(bucket_order);
+    free(candidate_slots);
+    free(key_of_slot);
+    free(slot_used);
+    free(displacement);
+    free(sorted_keys);
+    free(buckets);
+    free(keys);
+    hash_table_free(&content_table);
+    free(contents);
+    for (int i = 0; i < n_shard_files; ++i)
+        free(shard_data[i]);
+    free(shard_data);
+}
+
+// Look up the record for `path` in a merged index. Returns false if there is none.
+static bool lookup_index_record(char *index_data, const char *path, IndexRecord *record)
+{
+    IndexHeader *header = (IndexHeader *)index_data;
+    if (header->n_files == 0)
+        return false;
+    const uint32_t *displacement = (const uint32_t *)(index_data + sizeof(IndexHeader));
+    const uint64_t *path_offset = (const uint64_t *)(index_data + index_slots_offset(header->n_buckets));
+
+    uint32_t b = index_bucket_of(hash_string(path, 0), header->n_buckets);
+    uint32_t slot = index_slot_of(path, displacement[b], header->n_files);
+    if (slot >= header->n_files)
+        return false;
+    const IndexPathHeader *entry = (const IndexPathHeader *)(index_data + path_offset[slot]);
+    record->path = (const char *)(entry + 1);
+    if (strcmp(record->path, path) != 0)
+        return false;
+    // the record is only good for the file if we would parse it the same way now
+    if (entry->language != (uint32_t)language_of_filename(path) || entry->engine != (uint32_t)engine_option)
+        return false;
+    decode_index_record((const IndexRecordHeader *)(index_data + entry->content_offset),
+                        index_data + header->strings_offset, record);
+    return true;
+}
+
+// Return the identifier table entry for `identifier` in a merged index (nullptr if the
+// identifier does not occur in any scope header).
+static const IndexIdentSlot *lookup_index_ident(const char *index_data, const char *identifier)
+{
+    const IndexHeader *header = (const IndexHeader *)index_data;
+    if (!header->idents_offset)
+        return nullptr;
+    const IndexIdentHeader *ident_header = (const IndexIdentHeader *)(index_data + header->idents_offset);
+    const IndexIdentSlot *slots = (const IndexIdentSlot *)(ident_header + 1);
+    const char *names = (const char *)((const IndexPosting *)(slots + ident_header->n_slots) + ident_header->n_postings);
+    uint64_t hash = hash_bytes(identifier, strlen(identifier), 0);
+    uint32_t mask = ident_header->n_slots - 1;
+    for (uint32_t slot = (uint32_t)hash & mask; slots[slot].n_postings; slot = (slot + 1) & mask)
+        if (slots[slot].hash == hash && strcmp(names + slots[slot].name_offset, identifier) == 0)
+            return slots + slot;
+    return nullptr;
+}
+
+// Print the given context line and all context lines enclosing it (outermost first).
+static void print_indexed_scope_chain(IndexRecord *record, int32_t index)
+{
+    if (index < 0)
+        return;
+    print_indexed_scope_chain(record, record->context_index[index]);
+    Context ctx;
+    ctx.index = (uint32_t)index;
+    ctx.text = (char *)record->pool + record->text_offset[index];
+    ctx.language = record->language;
+    print_context(&ctx);
+}
+
+// Print "<PATH>:<LINE>\t<scope chain>" for each scope header mentioning `identifier`.
+// Returns the number of matches.
+static uint32_t print_index_ident_matches(const char *index_data, const char *identifier)
+{
+    const IndexIdentSlot *slot = lookup_index_ident(index_data, identifier);
+    if (!slot)
+        return 0;
+    const IndexHeader *header = (const IndexHeader *)index_data;
+    const IndexIdentHeader *ident_header = (const IndexIdentHeader *)(index_data + header->idents_offset);
+    const IndexPosting *postings = (const IndexPosting *)((const IndexIdentSlot *)(ident_header + 1) + ident_header->n_slots);
+    const uint64_t *path_offset = (const uint64_t *)(index_data + index_slots_offset(header->n_buckets));
+    for (uint32_t i = 0; i < slot->n_postings; ++i) {
+        const IndexPosting *posting = postings + slot->first_posting + i;
+        const IndexPathHeader *entry = (const IndexPathHeader *)(index_data + path_offset[posting->path_slot]);
+        IndexRecord record;
+        decode_index_record((const IndexRecordHeader *)(index_data + entry->content_offset),
+                            index_data + header->strings_offset, &record);
+        printf("%s:%u\t", (const char *)(entry + 1), posting->index + 1);
+        print_indexed_scope_chain(&record, (int32_t)posting->index);
+        printf("\n");
+    }
+    return slot->n_postings;
+}
+
+static void print_indexed_line_contexts(IndexRecord *record, uint32_t index)
+{
+    uint32_t n_contexts = 0;
+    for (int32_t c = record->context_index[index]; c >= 0; c = record->context_index[c])
+        n_contexts++;
+
+    Context *context_array = (Context *)malloc((n_contexts + 1) * sizeof(Context));
+    if (!context_array)
+        exit_error("Out-of-memory allocating context array.\n");
+    Context *context_ptr = context_array + n_contexts;
+    for (int32_t c = record->context_index[index]; c >= 0; c = record->context_index[c]) {
+        context_ptr--;
+        context_ptr->index = (uint32_t)c;
+        context_ptr->text = (char *)record->pool + record->text_offset[c];
+        context_ptr->language = record->language;
+    }
+    print_answer(context_array, 0, n_contexts, index, record->unreliable);
+    free(context_array);
+}
+
+// tags (see --tags)
+//
+// A ctags-compatible tags file (extended format, line numbers as addresses) with one tag
+// for each scope header that looks like a definition: the name after namespace, class,
+// struct, union or enum, or else the identifier before the first '(' of a line that is
+// not control flow. The enclosing tagged scopes become the scope field, e.g.
+//
+//     render_context	whereami.cpp	221;"	f	namespace:Foo::Bar
+//
+// Like the index, the tags of a large tree can be built in shards by parallel processes
+// and merged afterwards.
+
+#define TAGS_HEADER \
+    "!_TAG_FILE_FORMAT\t2\t/extended format; --format=1 will not append ;\" to lines/\n" \
+    "!_TAG_FILE_SORTED\t1\t/0=unsorted, 1=sorted, 2=foldcase/\n" \
+    "!_TAG_PROGRAM_NAME\twhereami\t//\n"
+
+struct ScopeTag {
+    const char *name; //< not NUL-terminated
+    uint32_t name_len;
+    const char *qualifier; //< "Foo::Bar" for "void Foo::Bar::baz(" (nullptr if none)
+    uint32_t qualifier_len;
+    char kind; //< ctags kind letter
+};
+
+// Does the identifier [start, end) equal `word`?
+static bool word_equals(const char *start, const char *end, const char *word)
+{
+    size_t len = strlen(word);
+    return (size_t)(end - start) == len && memcmp(start, word, len) == 0;
+}
+
+static const char *tag_kind_name(char kind)
+{
+    switch (kind) {
+        case 'n': return "namespace";
+        case 'c': return "class";
+        case 's': return "struct";
+        case 'u': return "union";
+        case 'g': return "enum";
+        case 'i': return "interface";
+        default:  return "function";
+    }
+}
+
+// Split the qualified name [start, end) at its last "::".
+static void set_tag_name(ScopeTag *tag, const char *start, const char *end)
+{
+    const char *name = end;
+    while (name > start && !(name - start >= 2 && name[-1] == ':' && name[-2] == ':'))
+        name--;
+    tag->name = name;
+    tag->name_len = (uint32_t)(end - name);
+    tag->qualifier = (name > start) ? start : nullptr;
+    tag->qualifier_len = (name > start) ? (uint32_t)(name - 2 - start) : 0;
+}
+
+// "namespace a::b {", "class API Foo final : public Bar", "typedef struct Foo {", ...
+static bool extract_type_tag(const char *text, const char *limit, ScopeTag *tag)
+{
+    static const char *const prefixes[] = { "typedef", "export", "inline", "template" };
+    static const char *const keywords[] = { "namespace", "class", "struct", "union", "enum" };
+    static const char kinds[] = { 'n', 'c', 's', 'u', 'g' };
+
+    const char *ptr = text;
+    int i_keyword = -1;
+    while (ptr < limit && i_keyword < 0) {
+        const char *word = ptr;
+        while (ptr < limit && is_identifier_char(*ptr))
+            ptr++;
+        if (ptr == word)
+            return false;
+        bool is_prefix = false;
+        for (size_t i = 0; i < sizeof(prefixes) / sizeof(prefixes[0]); ++i)
+            is_prefix = is_prefix || word_equals(word, ptr, prefixes[i]);
+        for (int i = 0; i < (int)(sizeof(keywords) / sizeof(keywords[0])); ++i)
+            if (word_equals(word, ptr, keywords[i]))
+                i_keyword = i;
+        if (!is_prefix && i_keyword < 0)
+            return false;
+        if (word_equals(word, ptr, "template") && ptr < limit && *ptr == '<') {
+            int depth = 0;
+            for (; ptr < limit; ++ptr) {
+                if (*ptr == '<')
+                    depth++;
+                else if (*ptr == '>' && --depth == 0) {
+                    ptr++;
+                    break;
+                }
+            }
+        }
+        while (ptr < limit && isspace((unsigned char)*ptr))
+            ptr++;
+    }
+    if (i_keyword < 0)
+        return false;
+
+    // the name is the last (qualified) identifier before the body, base list or
+    // parameters; anything else (e.g. the '*' of "struct Foo *f(") means this is not a
+    // type definition
+    const char *name_start = nullptr;
+    const char *name_end = nullptr;
+    while (ptr < limit) {
+        char ch = *ptr;
+        if (is_identifier_char(ch)) {
+            const char *start = ptr;
+            while (ptr < limit && (is_identifier_char(*ptr) || (ptr[0] == ':' && ptr + 1 < limit && ptr[1] == ':'
+                                                                && ptr + 2 < limit && is_identifier_char(ptr[2]))))
+                ptr += (*ptr == ':') ? 2 : 1;
+            if (!word_equals(start, ptr, "final") && !(kinds[i_keyword] == 'g' && (word_equals(start, ptr, "class")
+                                                                                    || word_equals(start, ptr, "struct")))) {
+                name_start = start;
+                name_end = ptr;
+            }
+            continue;
+        }
+        if (isspace((unsigned char)ch)) {
+            ptr++;
+            continue;
+        }
+        if (ch == '{' || ch == ';' || ch == ':' || ch == '<' || ch == '(')
+            break;
+        return false;
+    }
+    if (!name_start)
+        return false; // anonymous
+    set_tag_name(tag, name_start, name_end);
+    tag->kind = kinds[i_keyword];
+    return true;
+}
+
+// "int Foo::bar(", "def baz(", but not calls like "x = f(" or "return g(" that happen
+// to be followed by more deeply indented continuation lines. `class_name` is the name of
+// the enclosing class (or nullptr), whose constructors have nothing before their name.
+static bool extract_function_tag(const char *text, const char *limit, const char *class_name, ScopeTag *tag)
+{
+    static const char *const not_names[] = { "if", "for", "while", "switch", "return", "sizeof", "catch",
+                                             "defined", "decltype", "alignof", "static_assert" };
+    static const char *const not_types[] = { "return", "new", "delete", "throw", "else", "case", "co_return", "co_await" };
+
+    const char *paren = (const char *)memchr(text, '(', (size_t)(limit - text));
+    if (!paren || memchr(text, '=', (size_t)(paren - text)))
+        return false;
+    const char *name_end = paren;
+    while (name_end > text && isspace((unsigned char)name_end[-1]))
+        name_end--;
+    const char *name_start = name_end;
+    while (name_start > text && is_identifier_char(name_start[-1]))
+        name_start--;
+    if (name_start == name_end || isdigit((unsigned char)*name_start))
+        return false;
+    for (size_t i = 0; i < sizeof(not_names) / sizeof(not_names[0]); ++i)
+        if (word_equals(name_start, name_end, not_names[i]))
+            return false;
+    if (name_start > text && name_start[-1] == '~')
+        name_start--; // destructor
+
+    const char *qualified_start = name_start;
+    while (qualified_start - text >= 3 && qualified_start[-1] == ':' && qualified_start[-2] == ':'
+           && is_identifier_char(qualified_start[-3])) {
+        qualified_start -= 2;
+        while (qualified_start > text && is_identifier_char(qualified_start[-1]))
+            qualified_start--;
+    }
+
+    // a definition has a return type or keyword before the name (constructors have a qualifier)
+    const char *before = qualified_start;
+    while (before > text && isspace((unsigned char)before[-1]))
+        before--;
+    if (before == text) {
+        const char *bare_name = (*name_start == '~') ? name_start + 1 : name_start;
+        if (qualified_start == name_start && !(class_name && word_equals(bare_name, name_end, class_name)))
+            return false;
+    }
+    else {
+        char prev = before[-1];
+        if (!is_identifier_char(prev) && prev != '*' && prev != '&' && prev != '>')
+            return false;
+        const char *word = before;
+        while (word > text && is_identifier_char(word[-1]))
+            word--;
+        for (size_t i = 0; i < sizeof(not_types) / sizeof(not_types[0]); ++i)
+            if (word_equals(word, before, not_types[i]))
+                return false;
+    }
+    set_tag_name(tag, qualified_start, name_end);
+    tag->kind = 'f';
+    return true;
+}
+
+// Skip the balanced "<...>" starting at `ptr`.
+static const char *skip_angle_brackets(const char *ptr, const char *limit)
+{
+    int depth = 0;
+    for (; ptr < limit; ++ptr) {
+        if (*ptr == '<')
+            depth++;
+        else if (*ptr == '>' && --depth == 0)
+            return ptr + 1;
+    }
+    return ptr;
+}
+
+// Rust "impl<T> Trait for Foo<T> where ... {" (tagged as a class named after the type, so
+// that the methods get a scope) and "trait Bar<T>: Baz {".
+static bool extract_rust_impl_tag(const char *text, const char *limit, ScopeTag *tag)
+{
+    const char *ptr = text;
+    while (ptr < limit && is_identifier_char(*ptr))
+        ptr++;
+    bool is_impl = word_equals(text, ptr, "impl");
+    if (!is_impl && !word_equals(text, ptr, "trait"))
+        return false;
+    if (ptr < limit && *ptr == '<')
+        ptr = skip_angle_brackets(ptr, limit);
+    else if (ptr == limit || !isspace((unsigned char)*ptr))
+        return false;
+
+    const char *name_start = nullptr;
+    const char *name_end = nullptr;
+    while (ptr < limit && *ptr != '{') {
+        if (*ptr == '<') {
+            ptr = skip_angle_brackets(ptr, limit);
+            continue;
+        }
+        if (!is_identifier_char(*ptr)) {
+            if (!is_impl && *ptr == ':')
+                break; // supertraits
+            ptr++;
+            continue;
+        }
+        const char *start = ptr;
+        while (ptr < limit && (is_identifier_char(*ptr) || (ptr[0] == ':' && ptr + 1 < limit && ptr[1] == ':')))
+            ptr++;
+        if (word_equals(start, ptr, "where"))
+            break;
+        if (word_equals(start, ptr, "for")) {
+            name_start = nullptr; // the type follows
+            continue;
+        }
+        if (!name_start) {
+            name_start = start;
+            name_end = ptr;
+        }
+    }
+    if (!name_start)
+        return false;
+    set_tag_name(tag, name_start, name_end);
+    tag->kind = is_impl ? 'c' : 'i';
+    return true;
+}
+
+static bool extract_scope_tag(char *line_text, Language language, const char *class_name, ScopeTag *tag)
+{
+    static const char *const function_keywords[] = { "func ", "fn ", "def ", "function " };
+
+    Context ctx;
+    ctx.index = 0;
+    ctx.text = line_text;
+    ctx.language = language;
+    if (!line_text[0] || outline_is_control_flow(&ctx))
+        return false;
+    const char *limit = strstr(line_text, "//");
+    if (!limit)
+        limit = line_text + strlen(line_text);
+
+    // Drop the prefixes that render_context drops ("pub fn ", Go receivers, ...). After a
+    // keyword like "fn", the name comes first.
+    // Note: In C, maybe_skip_substr drops "namespace ", which extract_type_tag needs.
+    char *text = line_text;
+    bool after_function_keyword = false;
+    char *next;
+    while (language != LANG_C && (next = maybe_skip_substr(text, language)) > text && next < limit) {
+        for (size_t i = 0; i < sizeof(function_keywords) / sizeof(function_keywords[0]); ++i)
+            if (strncmp(text, function_keywords[i], strlen(function_keywords[i])) == 0)
+                after_function_keyword = true;
+        text = next;
+    }
+    if (after_function_keyword) {
+        const char *name_end = text;
+        while (name_end < limit && is_identifier_char(*name_end))
+            name_end++;
+        if (name_end == text || isdigit((unsigned char)*text))
+            return false;
+        set_tag_name(tag, text, name_end);
+        tag->kind = 'f';
+        return true;
+    }
+    if (language == LANG_RUST && extract_rust_impl_tag(text, limit, tag))
+        return true;
+    return extract_type_tag(text, limit, tag) || extract_function_tag(text, limit, class_name, tag);
+}
+
+// Append one NUL-terminated tag line for each tagged scope header of `file` to `tags` and
+// its offset to `tag_offsets`.
+static void collect_file_tags(ParsedFile *file, const char *path, ByteBuffer *tags, ByteBuffer *tag_offsets)
+{
+    uint32_t n_lines = file->n_lines;
+    int32_t *parent = (int32_t *)malloc(n_lines * sizeof(int32_t) + 1);
+    bool *is_scope = (bool *)calloc(n_lines + 1, sizeof(bool));
+    int32_t *tagged_scope = (int32_t *)malloc(n_lines * sizeof(int32_t) + 1); //< innermost tagged scope around each line
+    uint32_t *full_name = (uint32_t *)malloc(n_lines * sizeof(uint32_t) + 1); //< offsets into `names` for tagged lines
+    char *kind = (char *)calloc(n_lines + 1, sizeof(char)); //< 0 for untagged lines
+    if (!parent || !is_scope || !tagged_scope || !full_name || !kind)
+        exit_error("Out-of-memory allocating tag arrays.\n");
+    for (uint32_t i = 0; i < n_lines; ++i) {
+        parent[i] = enclosing_scope(file, (int32_t)i);
+        if (parent[i] >= 0)
+            is_scope[parent[i]] = true;
+    }
+
+    ByteBuffer names = {};
+    char number[16];
+    for (uint32_t i = 0; i < n_lines; ++i) {
+        int32_t p = parent[i];
+        tagged_scope[i] = (p < 0 || kind[p]) ? p : tagged_scope[p];
+        if (!is_scope[i])
+            continue;
+        int32_t outer = tagged_scope[i];
+        const char *class_name = nullptr;
+        if (outer >= 0 && (kind[outer] == 'c' || kind[outer] == 's')) {
+            class_name = strrchr(names.data + full_name[outer], ':');
+            class_name = class_name ? class_name + 1 : names.data + full_name[outer];
+        }
+        ScopeTag tag;
+        if (!extract_scope_tag(file->text + file->line_info_array[i].start_offset, file->language, class_name, &tag))
+            continue;
+        kind[i] = tag.kind;
+
+        // scope field: the full name of the enclosing tag, plus our qualifier
+        uint32_t scope_start = (uint32_t)names.size;
+        if (outer >= 0) {
+            // Note: Appending may move `names`, so copy from the new location.
+            size_t len = strlen(names.data + full_name[outer]);
+            char *dest = buffer_append(&names, nullptr, len);
+            memcpy(dest, names.data + full_name[outer], len);
+        }
+        if (tag.qualifier) {
+            if (outer >= 0)
+                buffer_append(&names, "::", 2);
+            buffer_append(&names, tag.qualifier, tag.qualifier_len);
+        }
+        uint32_t scope_len = (uint32_t)names.size - scope_start;
+        if (scope_len)
+            buffer_append(&names, "::", 2);
+        buffer_append(&names, tag.name, tag.name_len);
+        buffer_append(&names, "", 1);
+        full_name[i] = scope_start;
+
+        size_t offset = tags->size;
+        buffer_append(tag_offsets, &offset, sizeof(offset));
+        buffer_append(tags, tag.name, tag.name_len);
+        buffer_append(tags, "\t", 1);
+        buffer_append(tags, path, strlen(path));
+        int len = snprintf(number, sizeof(number), "\t%u;\"\t", i + 1);
+        buffer_append(tags, number, (size_t)len);
+        buffer_append(tags, &tag.kind, 1);
+        if (scope_len) {
+            const char *scope_kind = tag.qualifier ? "class" : tag_kind_name(kind[outer]);
+            buffer_append(tags, "\t", 1);
+            buffer_append(tags, scope_kind, strlen(scope_kind));
+            buffer_append(tags, ":", 1);
+            buffer_append(tags, names.data + scope_start, scope_len);
+        }
+        buffer_append(tags, "", 1);
+    }
+    free(names.data);
+    free(parent);
+    free(is_scope);
+    free(tagged_scope);
+    free(full_name);
+    free(kind);
+}
+
+static int compare_tag_lines(const void *a, const void *b)
+{
+    return strcmp(*(const char *const *)a, *(const char *const *)b);
+}
+
+// Sort the given NUL-terminated tag lines and write them as a tags file.
+static void write_tags_file(const char *tags_filename, char **lines, size_t n_lines)
+{
+    qsort(lines, n_lines, sizeof(char *), compare_tag_lines);
+    #pragma warning (suppress : 4996) // gimme fopen
+    FILE *out = fopen(tags_filename, "wb");
+    if (!out)
+        exit_clib_error("could not open tags file '%s' for writing", tags_filename);
+    write_or_die(out, TAGS_HEADER, strlen(TAGS_HEADER), tags_filename);
+    for (size_t i = 0; i < n_lines; ++i) {
+        size_t len = strlen(lines[i]);
+        lines[i][len] = '\n';
+        write_or_die(out, lines[i], len + 1, tags_filename);
+    }
+    if (fclose(out) == EOF)
+        exit_clib_error("could not close tags file '%s'", tags_filename);
+}
+
+// Write the tags for all files in `list` whose path hash selects shard number `shard` out
+// of `n_shards` (the same assignment as for index shards).
+static void build_tags_file(uint32_t shard, uint32_t n_shards, const char *tags_filename, FileList *list)
+{
+    ByteBuffer tags = {};
+    ByteBuffer tag_offsets = {};
+    for (uint32_t i = 0; i < list->n_names; ++i) {
+        char *filename = list->names[i];
+        const char *path = normalize_path(filename);
+        if (hash_string(path, INDEX_SHARD_SEED) % n_shards != shard)
+            continue;
+        uint32_t text_size;
+        char *text = read_file(filename, &text_size, false /* fatal */);
+        if (!text)
+            continue;
+        ParsedFile file;
+        parse_text(&file, text, text_size, filename);
+        collect_file_tags(&file, path, &tags, &tag_offsets);
+        free_parsed_file(&file);
+    }
+
+    // the offsets become pointers now that the buffer has stopped moving
+    char **lines = (char **)tag_offsets.data;
+    size_t n_lines = tag_offsets.size / sizeof(size_t);
+    for (size_t i = 0; i < n_lines; ++i)
+        lines[i] = tags.data + ((size_t *)tag_offsets.data)[i];
+    write_tags_file(tags_filename, lines, n_lines);
+    free(tags.data);
+    free(tag_offsets.data);
+}
+
+// Combine tags files (e.g. written for shards) into one sorted tags file.
+static void merge_tags_files(const char *tags_filename, int n_shard_files, char **shard_filenames)
+{
+    char **shard_data = (char **)malloc(n_shard_files * sizeof(char *) + 1);
+    if (!shard_data)
+        exit_error("Out-of-memory allocating shard array.\n");
+    ByteBuffer lines = {};
+    for (int i = 0; i < n_shard_files; ++i) {
+        uint32_t size;
+        char *data = shard_data[i] = read_file(shard_filenames[i], &size, true /* fatal */);
+        data[size] = 0;
+        for (char *line = data; *line; ) {
+            char *newline = strchr(line, '\n');
+            if (newline)
+                *newline = 0;
+            if (*line && strncmp(line, "!_TAG_", 6) != 0)
+                buffer_append(&lines, &line, sizeof(line));
+            if (!newline)
+                break;
+            line = newline + 1;
+        }
+    }
+    write_tags_file(tags_filename, (char **)lines.data, lines.size / sizeof(char *));
+    free(lines.data);
+    for (int i = 0; i < n_shard_files; ++i)
+        free(shard_data[i]);
+    free(shard_data);
+}
+
+// scope sizes (see --sizes)
+//
+// Inclusive and exclusive ("self") line and byte counts for every scope, as a metric for
+// finding enormous functions. A scope reaches from its header to its last line as in the
+// navigation index (including a closing '}' line); its self counts are what remains after
+// subtracting the scopes directly inside it. Scopes found from indentation do not always
+// nest (a '{' line after a preprocessor line belongs to the scope of the latter, which can
+// then reach into its next sibling), so each scope is cut at the start of its next sibling
+// and at the end of its parent. That way every line is counted once. Without --top, a line is printed for each
+// scope as soon as its file is done, so the outputs of shards (see --index-shard) can
+// simply be concatenated and sorted; the top N of all files are among the top N of the
+// shards, too.
+
+struct ScopeSizes {
+    uint32_t *lines; //< inclusive number of lines of each scope
+    uint32_t *self_lines;
+    uint32_t *bytes; //< inclusive number of bytes of each scope
+    uint32_t *self_bytes;
+};
+
+static void compute_scope_sizes(ScopeSizes *sizes, NavIndex *nav, ParsedFile *file)
+{
+    uint32_t n_lines = file->n_lines;
+    sizes->lines = (uint32_t *)malloc(n_lines * sizeof(uint32_t) + 1);
+    sizes->self_lines = (uint32_t *)malloc(n_lines * sizeof(uint32_t) + 1);
+    sizes->bytes = (uint32_t *)malloc(n_lines * sizeof(uint32_t) + 1);
+    sizes->self_bytes = (uint32_t *)malloc(n_lines * sizeof(uint32_t) + 1);
+    uint32_t *end = (uint32_t *)malloc(n_lines * sizeof(uint32_t) + 1); //< last line of each scope after cutting
+    if (!sizes->lines || !sizes->self_lines || !sizes->bytes || !sizes->self_bytes || !end)
+        exit_error("Out-of-memory allocating scope sizes.\n");
+    const uint32_t *line_starts = get_line_starts(file);
+    uint32_t text_end = parsed_text_size(file);
+    // children come after their parents, so every parent has its sizes when we get to
+    // the scopes inside it
+    for (uint32_t i = 0; i < n_lines; ++i) {
+        if (!nav->is_scope[i])
+            continue;
+        int32_t parent = enclosing_scope(file, (int32_t)i);
+        end[i] = nav->end[i];
+        if (nav->next_sibling[i] >= 0 && end[i] >= (uint32_t)nav->next_sibling[i])
+            end[i] = (uint32_t)nav->next_sibling[i] - 1;
+        if (parent >= 0 && end[i] > end[parent])
+            end[i] = end[parent];
+        if (end[i] < i) { // nothing left of the scope
+            end[i] = i - 1;
+            sizes->lines[i] = sizes->self_lines[i] = 0;
+            sizes->bytes[i] = sizes->self_bytes[i] = 0;
+            continue;
+        }
+        sizes->lines[i] = sizes->self_lines[i] = end[i] - i + 1;
+        sizes->bytes[i] = sizes->self_bytes[i] = ((end[i] + 1 < n_lines) ? line_starts[end[i] + 1] : text_end) - line_starts[i];
+        if (parent >= 0) {
+            sizes->self_lines[parent] -= sizes->lines[i];
+            sizes->self_bytes[parent] -= sizes->bytes[i];
+        }
+    }
+    free(end);
+}
+
+static void free_scope_sizes(ScopeSizes *sizes)
+{
+    free(sizes->lines);
+    free(sizes->self_lines);
+    free(sizes->bytes);
+    free(sizes->self_bytes);
+    *sizes = ScopeSizes();
+}
+
+// One scope in the --top table. `label` is "<PATH>:<LINE>\t<HEADER>".
+struct ScopeSizeEntry {
+    uint32_t lines;
+    uint32_t self_lines;
+    uint32_t bytes;
+    uint32_t self_bytes;
+    char *label;
+};
+
+// larger scopes first
+static int compare_scope_size_entries(const void *a, const void *b)
+{
+    const ScopeSizeEntry *x = (const ScopeSizeEntry *)a;
+    const ScopeSizeEntry *y = (const ScopeSizeEntry *)b;
+    if (x->lines != y->lines)
+        return (x->lines > y->lines) ? -1 : 1;
+    if (x->bytes != y->bytes)
+        return (x->bytes > y->bytes) ? -1 : 1;
+    return strcmp(x->label, y->label);
+}
+
+// The N largest scopes seen so far, as a min-heap (the smallest of them at the root).
+struct ScopeSizeTable {
+    ScopeSizeEntry *entries;
+    uint32_t n_entries;
+    uint32_t capacity; //< N
+};
+
+static void scope_size_table_sift_down(ScopeSizeTable *table, uint32_t i)
+{
+    ScopeSizeEntry *entries = table->entries;
+    for (;;) {
+        uint32_t smallest = i;
+        for (uint32_t child = 2 * i + 1; child <= 2 * i + 2 && child < table->n_entries; ++child)
+            if (compare_scope_size_entries(entries + child, entries + smallest) > 0)
+                smallest = child;
+        if (smallest == i)
+            return;
+        ScopeSizeEntry tmp = entries[i];
+        entries[i] = entries[smallest];
+        entries[smallest] = tmp;
+        i = smallest;
+    }
+}
+
+// Take the entry into the table if it is among the N largest. The table owns its label
+// afterwards either way.
+static void scope_size_table_add(ScopeSizeTable *table, ScopeSizeEntry *entry)
+{
+    ScopeSizeEntry *entries = table->entries;
+    if (table->n_entries < table->capacity) {
+        uint32_t i = table->n_entries++;
+        entries[i] = *entry;
+        // Note: compare_scope_size_entries sorts larger entries first, so the smaller
+        //       entry moves up.
+        while (i > 0 && compare_scope_size_entries(entries + i, entries + (i - 1) / 2) > 0) {
+            ScopeSizeEntry tmp = entries[i];
+            entries[i] = entries[(i - 1) / 2];
+            entries[(i - 1) / 2] = tmp;
+            i = (i - 1) / 2;
+        }
+        return;
+    }
+    if (compare_scope_size_entries(entry, entries) >= 0) {
+        free(entry->label);
+        return;
+    }
+    free(entries[0].label);
+    entries[0] = *entry;
+    scope_size_table_sift_down(table, 0);
+}
+
+// Print one JSON object (without newline) for the given scope and, recursively, the
+// scopes inside it.
+static void print_scope_size_json(ParsedFile *file, NavIndex *nav, ScopeSizes *sizes, int32_t scope, ByteBuffer *buffer)
+{
+    buffer->size = 0;
+    Context ctx;
+    ctx.index = (uint32_t)scope;
+    ctx.text = file->text + file->line_info_array[scope].start_offset;
+    ctx.language = file->language;
+    render_context(&ctx, buffer);
+    printf("{\"line\":%d,\"name\":", scope + 1);
+    print_json_string(buffer->data, buffer->size);
+    printf(",\"lines\":%u,\"self_lines\":%u,\"bytes\":%u,\"self_bytes\":%u,\"children\":[",
+           sizes->lines[scope], sizes->self_lines[scope], sizes->bytes[scope], sizes->self_bytes[scope]);
+    for (int32_t child = nav->first_child[scope]; child >= 0; child = nav->next_sibling[child]) {
+        if (child != nav->first_child[scope])
+            putc(',', stdout);
+        print_scope_size_json(file, nav, sizes, child, buffer);
+    }
+    printf("]}");
+}
+
+// Print the scope sizes of the files of the given shard: a line
+// "<LINES>\t<SELFLINES>\t<BYTES>\t<SELFBYTES>\t<PATH>:<LINE>\t<HEADER>" for each scope
+// in file order, only the `top` largest scopes (if `top` is not 0) largest first, or with
+// `json` one JSON object per file and line, with the scopes as a tree (for treemaps).
+static void print_scope_sizes(uint32_t shard, uint32_t n_shards, FileList *list, uint32_t top, bool json)
+{
+    ScopeSizeTable table = {};
+    table.capacity = top;
+    table.entries = (ScopeSizeEntry *)malloc(top * sizeof(ScopeSizeEntry) + 1);
+    if (!table.entries)
+        exit_error("Out-of-memory allocating scope size table.\n");
+    ByteBuffer buffer = {};
+    for (uint32_t i_file = 0; i_file < list->n_names; ++i_file) {
+        char *filename = list->names[i_file];
+        const char *path = normalize_path(filename);
+        if (hash_string(path, INDEX_SHARD_SEED) % n_shards != shard)
+            continue;
+        uint32_t text_size;
+        char *text = read_file(filename, &text_size, false /* fatal */);
+        if (!text)
+            continue;
+        ParsedFile file;
+        parse_text(&file, text, text_size, filename);
+        NavIndex nav;
+        build_nav_index(&nav, &file);
+        ScopeSizes sizes;
+        compute_scope_sizes(&sizes, &nav, &file);
+
+        if (json) {
+            printf("{\"path\":");
+            print_json_string(path, strlen(path));
+            printf(",\"lines\":%u,\"bytes\":%u,\"children\":[", file.n_lines, parsed_text_size(&file));
+            for (int32_t child = nav.root_first_child; child >= 0; child = nav.next_sibling[child]) {
+                if (child != nav.root_first_child)
+                    putc(',', stdout);
+                print_scope_size_json(&file, &nav, &sizes, child, &buffer);
+            }
+            printf("]}\n");
+        }
+        else {
+            for (uint32_t i = 0; i < file.n_lines; ++i) {
+                if (!nav.is_scope[i])
+                    continue;
+                ScopeSizeEntry entry;
+                entry.lines = sizes.lines[i];
+                entry.self_lines = sizes.self_lines[i];
+                entry.bytes = sizes.bytes[i];
+                entry.self_bytes = sizes.self_bytes[i];
+                if (top && table.n_entries == table.capacity && entry.lines < table.entries[0].lines)
+                    continue; // cannot make it into the table
+                buffer.size = 0;
+                char location[32];
+                snprintf(location, sizeof(location), ":%u\t", i + 1);
+                buffer_append(&buffer, path, strlen(path));
+                buffer_append(&buffer, location, strlen(location));
+                Context ctx;
+                ctx.index = i;
+                ctx.text = file.text + file.line_info_array[i].start_offset;
+                ctx.language = file.language;
+                render_context(&ctx, &buffer);
+                if (!top) {
+                    printf("%u\t%u\t%u\t%u\t", entry.lines, entry.self_lines, entry.bytes, entry.self_bytes);
+                    fwrite(buffer.data, 1, buffer.size, stdout);
+                    putc('\n', stdout);
+                    continue;
+                }
+                entry.label = (char *)malloc(buffer.size + 1);
+                if (!entry.label)
+                    exit_error("Out-of-memory allocating scope label.\n");
+                memcpy(entry.label, buffer.data, buffer.size);
+                entry.label[buffer.size] = 0;
+                scope_size_table_add(&table, &entry);
+            }
+        }
+        free_scope_sizes(&sizes);
+        free_nav_index(&nav);
+        free_parsed_file(&file);
+    }
+
+    qsort(table.entries, table.n_entries, sizeof(ScopeSizeEntry), compare_scope_size_entries);
+    for (uint32_t i = 0; i < table.n_entries; ++i) {
+        ScopeSizeEntry *entry = table.entries + i;
+        printf("%u\t%u\t%u\t%u\t%s\n", entry->lines, entry->self_lines, entry->bytes, entry->self_bytes, entry->label);
+        free(entry->label);
+    }
+    free(table.entries);
+    free(buffer.data);
+}
+
+// parse cache
+//
+// Parsed files keyed by a 64-bit content key: the content hash (see hash_bytes) or, for
+// git blobs, the hash of the object id (which is a content hash itself), seeded with the
+// language and engine (see parse_key_seed). Identical contents are thus parsed only once
+// per language, no matter under how many paths or revisions we encounter them.
+
+struct ParseCache {
+    HashTable64 table; //< content key -> index into `entries`
+    ParsedFile **entries;
+    uint32_t n_entries;
+    uint32_t capacity;
+};
+
+static ParsedFile *parse_cache_find(ParseCache *cache, uint64_t key)
+{
+    uint32_t *i_entry = hash_table_find(&cache->table, key);
+    return i_entry ? cache->entries[*i_entry] : nullptr;
+}
+
+// Parse `text` (as returned by read_file) and add the result to the cache.
+static ParsedFile *parse_cache_add(ParseCache *cache, uint64_t key, char *text, uint32_t text_size, const char *filename)
+{
+    assert(!parse_cache_find(cache, key));
+    if (cache->n_entries == cache->capacity) {
+        cache->capacity = cache->capacity ? 2 * cache->capacity : 16;
+        cache->entries = (ParsedFile **)realloc(cache->entries, cache->capacity * sizeof(ParsedFile *));
+        if (!cache->entries)
+            exit_error("Out-of-memory growing parse cache.\n");
+    }
+    ParsedFile *file = (ParsedFile *)malloc(sizeof(ParsedFile));
+    if (!file)
+        exit_error("Out-of-memory allocating parse cache entry.\n");
+    parse_text(file, text, text_size, filename);
+    hash_table_insert(&cache->table, key, cache->n_entries, nullptr);
+    cache->entries[cache->n_entries++] = file;
+    return file;
+}
+
+static void parse_cache_free(ParseCache *cache)
+{
+    for (uint32_t i = 0; i < cache->n_entries; ++i) {
+        free_parsed_file(cache->entries[i]);
+        free(cache->entries[i]);
+    }
+    free(cache->entries);
+    hash_table_free(&cache->table);
+    *cache = ParseCache();
+}
+
+// read-only memory mapping of a whole file
+
+struct MappedFile {
+    const unsigned char *data; //< read into memory instead (see read_file) without WIN32 and POSIX
+    uint64_t size;
+#ifdef WIN32
+    HANDLE file;
+    HANDLE mapping;
+#endif
+};
+
+static bool map_file(const char *filename, MappedFile *mapped, bool fatal)
+{
+    *mapped = MappedFile();
+#ifdef WIN32
+    mapped->file = ::CreateFile(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+                                FILE_ATTRIBUTE_NORMAL, NULL);
+    if (mapped->file == INVALID_HANDLE_VALUE) {
+        report_system_error(fatal, "could not open file '%s'", filename);
+        return false;
+    }
+    LARGE_INTEGER file_size_large_integer;
+    if (!::GetFileSizeEx(mapped->file, &file_size_large_integer)) {
+        report_system_error(fatal, "could not get the size of file '%s'", filename);
+        ::CloseHandle(mapped->file);
+        return false;
+    }
+    mapped->size = file_size_large_integer.QuadPart;
+    if (mapped->size == 0)
+        return true;
+    mapped->mapping = ::CreateFileMapping(mapped->file, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (!mapped->mapping) {
+        report_system_error(fatal, "could not map file '%s'", filename);
+        ::CloseHandle(mapped->file);
+        return false;
+    }
+    mapped->data = (const unsigned char *)::MapViewOfFile(mapped->mapping, FILE_MAP_READ, 0, 0, 0);
+    if (!mapped->data) {
+        report_system_error(fatal, "could not map file '%s'", filename);
+        ::CloseHandle(mapped->mapping);
+        ::CloseHandle(mapped->file);
+        return false;
+    }
+#elif HAVE_POSIX
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        report_system_error(fatal, "could not open file '%s'", filename);
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        report_system_error(fatal, "could not get the size of file '%s'", filename);
+        close(fd);
+        return false;
+    }
+    mapped->size = (uint64_t)st.st_size;
+    if (mapped->size) {
+        void *data = mmap(nullptr, mapped->size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED) {
+            report_system_error(fatal, "could not map file '%s'", filename);
+            close(fd);
+            return false;
+        }
+        mapped->data = (const unsigned char *)data;
+    }
+    close(fd);
+#else
+    uint32_t size;
+    mapped->data = (const unsigned char *)read_file(filename, &size, fatal);
+    if (!mapped->data)
+        return false;
+    mapped->size = size;
+#endif
+    return true;
+}
+
+static void unmap_file(MappedFile *mapped)
+{
+#ifdef WIN32
+    if (mapped->data)
+        ::UnmapViewOfFile(mapped->data);
+    if (mapped->mapping)
+        ::CloseHandle(mapped->mapping);
+    ::CloseHandle(mapped->file);
+#elif HAVE_POSIX
+    if (mapped->data)
+        munmap((void *)mapped->data, mapped->size);
+#else
+    free((void *)mapped->data);
+#endif
+    *mapped = MappedFile();
+}
+
+// Call `callback` for the name of each entry of the given directory.
+// Returns false if the directory could not be opened (always without WIN32 and POSIX).
+static bool list_directory(const char *dirname, void (*callback)(const char *name, void *arg), void *arg)
+{
+#ifdef WIN32
+    char pattern[MAX_PATH];
+    if ((size_t)snprintf(pattern, sizeof(pattern), "%s\\*", dirname) >= sizeof(pattern))
+        return false;
+    WIN32_FIND_DATAA find_data;
+    HANDLE find = ::FindFirstFileA(pattern, &find_data);
+    if (find == INVALID_HANDLE_VALUE)
+        return false;
+    do {
+        callback(find_data.cFileName, arg);
+    } while (::FindNextFileA(find, &find_data));
+    ::FindClose(find);
+#elif HAVE_POSIX
+    DIR *dir = opendir(dirname);
+    if (!dir)
+        return false;
+    while (struct dirent *entry = readdir(dir))
+        callback(entry->d_name, arg);
+    closedir(dir);
+#else
+    (void)dirname;
+    (void)callback;
+    (void)arg;
+    return false;
+#endif
+    return true;
+}
+
+// zlib decompression (RFC 1950, RFC 1951)
+//
+// Only what we need for reading git objects: complete streams from memory into a
+// ByteBuffer. The Huffman decoding follows zlib's "puff" reference decoder.
+
+#define INFLATE_MAX_BITS 15
+
+struct InflateState {
+    const unsigned char *in;
+    size_t in_size;
+    size_t in_pos;
+    uint32_t bit_buffer;
+    uint32_t bit_count;
+    ByteBuffer *out;
+    size_t out_start; //< start of this stream's output in `out` (back references may not reach before it)
+    bool error; //< set when reading past the end of the input
+};
+
+struct Huffman {
+    uint16_t count[INFLATE_MAX_BITS + 1]; //< number of codes of each length
+    uint16_t symbol[288]; //< symbols ordered by code
+};
+
+static uint32_t inflate_bits(InflateState *s, uint32_t n_bits)
+{
+    uint32_t value = s->bit_buffer;
+    while (s->bit_count < n_bits) {
+        if (s->in_pos == s->in_size) {
+            s->error = true;
+            return 0;
+        }
+        value |= (uint32_t)s->in[s->in_pos++] << s->bit_count;
+        s->bit_count += 8;
+    }
+    s->bit_buffer = value >> n_bits;
+    s->bit_count -= n_bits;
+    return value & ((1u << n_bits) - 1);
+}
+
+// Build the decoding tables from the code lengths. Returns a negative value for an
+// over-subscribed code, a positive value for an incomplete code and zero otherwise.
+static int huffman_build(Huffman *h, const uint8_t *length, int n_symbols)
+{
+    for (int len = 0; len <= INFLATE_MAX_BITS; ++len)
+        h->count[len] = 0;
+    for (int symbol = 0; symbol < n_symbols; ++symbol)
+        h->count[length[symbol]]++;
+    if (h->count[0] == n_symbols)
+        return 0;
+
+    int left = 1;
+    for (int len = 1; len <= INFLATE_MAX_BITS; ++len) {
+        left <<= 1;
+        left -= h->count[len];
+        if (left < 0)
+            return left;
+    }
+
+    uint16_t offsets[INFLATE_MAX_BITS + 1];
+    offsets[1] = 0;
+    for (int len = 1; len < INFLATE_MAX_BITS; ++len)
+        offsets[len + 1] = offsets[len] + h->count[len];
+    for (int symbol = 0; symbol < n_symbols; ++symbol)
+        if (length[symbol])
+            h->symbol[offsets[length[symbol]]++] = (uint16_t)symbol;
+    return left;
+}
+
+static int huffman_decode(InflateState *s, const Huffman *h)
+{
+    int code = 0; // bits read so far
+    int first = 0; // first code of the current length
+    int index = 0; // index of the first code of the current length in h->symbol
+    for (int len = 1; len <= INFLATE_MAX_BITS; ++len) {
+        code |= (int)inflate_bits(s, 1);
+        int count = h->count[len];
+        if (code - count < first)
+            return h->symbol[index + (code - first)];
+        index += count;
+        first += count;
+        first <<= 1;
+        code <<= 1;
+    }
+    return -1; // ran out of codes
+}
+
+static bool inflate_codes(InflateState *s, const Huffman *length_code, const Huffman *distance_code)
+{
+    static const uint16_t length_base[29] = {
+        3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+        35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+    static const uint8_t length_extra[29] = {
+        0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+        3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+    static const uint16_t distance_base[30] = {
+        1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+        257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577 };
+    static const uint8_t distance_extra[30] = {
+        0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+        7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+
+    for (;;) {
+        int symbol = huffman_decode(s, length_code);
+        if (symbol < 0 || s->error)
+            return false;
+        if (symbol < 256) {
+            char ch = (char)symbol;
+            buffer_append(s->out, &ch, 1);
+        }
+        else if (symbol == 256) {
+            return true;
+        }
+        else {
+            symbol -= 257;
+            if (symbol >= 29)
+                return false;
+            uint32_t length = length_base[symbol] + inflate_bits(s, length_extra[symbol]);
+            symbol = huffman_decode(s, distance_code);
+            if (symbol < 0 || symbol >= 30)
+                return false;
+            uint32_t distance = distance_base[symbol] + inflate_bits(s, distance_extra[symbol]);
+            if (s->error || distance > s->out->size - s->out_start)
+                return false;
+            buffer_append(s->out, nullptr, length);
+            // Note: The source may overlap the destination, so copy byte by byte.
+            char *dest = s->out->data + s->out->size - length;
+            const char *src = dest - distance;
+            for (uint32_t i = 0; i < length; ++i)
+                dest[i] = src[i];
+        }
+    }
+}
+
+static bool inflate_stored(InflateState *s)
+{
+    s->bit_buffer = 0;
+    s->bit_count = 0;
+    if (s->in_size - s->in_pos < 4)
+        return false;
+    const unsigned char *ptr = s->in + s->in_pos;
+    uint32_t length = ptr[0] | (ptr[1] << 8);
+    uint32_t complement = ptr[2] | (ptr[3] << 8);
+    if (length != (~complement & 0xffff))
+        return false;
+    s->in_pos += 4;
+    if (s->in_size - s->in_pos < length)
+        return false;
+    buffer_append(s->out, s->in + s->in_pos, length);
+    s->in_pos += length;
+    return true;
+}
+
+static bool inflate_fixed(InflateState *s)
+{
+    static Huffman length_code, distance_code;
+    static bool initialized = false;
+    if (!initialized) {
+        uint8_t lengths[288];
+        int symbol;
+        for (symbol = 0; symbol < 144; ++symbol)
+            lengths[symbol] = 8;
+        for (; symbol < 256; ++symbol)
+            lengths[symbol] = 9;
+        for (; symbol < 280; ++symbol)
+            lengths[symbol] = 7;
+        for (; symbol < 288; ++symbol)
+            lengths[symbol] = 8;
+        huffman_build(&length_code, lengths, 288);
+        for (symbol = 0; symbol < 30; ++symbol)
+            lengths[symbol] = 5;
+        huffman_build(&distance_code, lengths, 30);
+        initialized = true;
+    }
+    return inflate_codes(s, &length_code, &distance_code);
+}
+
+static bool inflate_dynamic(InflateState *s)
+{
+    static const uint8_t order[19] = { 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+
+    uint32_t n_length_codes = inflate_bits(s, 5) + 257;
+    uint32_t n_distance_codes = inflate_bits(s, 5) + 1;
+    uint32_t n_code_length_codes = inflate_bits(s, 4) + 4;
+    if (s->error || n_length_codes > 286 || n_distance_codes > 30)
+        return false;
+
+    uint8_t lengths[288 + 30];
+    uint32_t index;
+    for (index = 0; index < n_code_length_codes; ++index)
+        lengths[order[index]] = (uint8_t)inflate_bits(s, 3);
+    for (; index < 19; ++index)
+        lengths[order[index]] = 0;
+    Huffman code_length_code;
+    if (huffman_build(&code_length_code, lengths, 19) != 0)
+        return false; // the code length code must be complete
+
+    index = 0;
+    while (index < n_length_codes + n_distance_codes) {
+        int symbol = huffman_decode(s, &code_length_code);
+        if (symbol < 0 || s->error)
+            return false;
+        if (symbol < 16) {
+            lengths[index++] = (uint8_t)symbol;
+            continue;
+        }
+        uint8_t length = 0;
+        uint32_t repeat;
+        if (symbol == 16) {
+            if (index == 0)
+                return false;
+            length = lengths[index - 1];
+            repeat = 3 + inflate_bits(s, 2);
+        }
+        else if (symbol == 17)
+            repeat = 3 + inflate_bits(s, 3);
+        else
+            repeat = 11 + inflate_bits(s, 7);
+        if (index + repeat > n_length_codes + n_distance_codes)
+            return false;
+        while (repeat--)
+            lengths[index++] = length;
+    }
+    if (lengths[256] == 0)
+        return false; // no end-of-block code
+
+    Huffman length_code, distance_code;
+    int result = huffman_build(&length_code, lengths, n_length_codes);
+    if (result < 0 || (result > 0 && n_length_codes - length_code.count[0] != 1))
+        return false;
+    result = huffman_build(&distance_code, lengths + n_length_codes, n_distance_codes);
+    if (result < 0 || (result > 0 && n_distance_codes - distance_code.count[0] != 1))
+        return false;
+    return inflate_codes(s, &length_code, &distance_code);
+}
+
+static uint32_t adler32(const unsigned char *data, size_t size)
+{
+    uint32_t a = 1, b = 0;
+    while (size) {
+        size_t n = (size < 5552) ? size : 5552; // largest n for which b cannot overflow
+        size -= n;
+        while (n--) {
+            a += *data++;
+            b += a;
+        }
+        a %= 65521;
+        b %= 65521;
+    }
+    return (b << 16) | a;
+}
+
+// Decompress the zlib stream at `in` and append the result to `out`.
+static bool inflate_zlib(const unsigned char *in, size_t in_size, ByteBuffer *out)
+{
+    if (in_size < 2 || (in[0] & 0x0f) != 8 || ((in[0] << 8) | in[1]) % 31 != 0 || (in[1] & 0x20))
+        return false; // not deflate, bad header checksum or preset dictionary
+
+    InflateState s = {};
+    s.in = in;
+    s.in_size = in_size;
+    s.in_pos = 2;
+    s.out = out;
+    s.out_start = out->size;
+
+    bool last;
+    do {
+        last = inflate_bits(&s, 1);
+        uint32_t type = inflate_bits(&s, 2);
+        bool ok;
+        switch (type) {
+            case 0: ok = inflate_stored(&s); break;
+            case 1: ok = inflate_fixed(&s); break;
+            case 2: ok = inflate_dynamic(&s); break;
+            default: ok = false; break;
+        }
+        if (!ok || s.error)
+            return false;
+    } while (!last);
+
+    if (s.in_size - s.in_pos < 4)
+        return false;
+    const unsigned char *ptr = s.in + s.in_pos;
+    uint32_t checksum = ((uint32_t)ptr[0] << 24) | ((uint32_t)ptr[1] << 16) | ((uint32_t)ptr[2] << 8) | ptr[3];
+    return checksum == adler32((const unsigned char *)out->data + s.out_start, out->size - s.out_start);
+}
+
+// git object store
+//
+// Just enough of git's repository format to read a file at a given revision without
+// touching the working tree: ref and revision resolution, loose objects and packfiles
+// (version 2 pack indices, OFS_DELTA and REF_DELTA objects). Only SHA-1 repositories
+// are supported.
+
+#define GIT_SHA_SIZE 20
+#define GIT_HEX_SIZE 40
+#define GIT_MAX_PATH 4096
+#define GIT_MAX_DELTA_DEPTH 1000
+
+enum GitObjectType {
+    GIT_OBJ_NONE = 0,
+    GIT_OBJ_COMMIT = 1,
+    GIT_OBJ_TREE = 2,
+    GIT_OBJ_BLOB = 3,
+    GIT_OBJ_TAG = 4,
+    GIT_OBJ_OFS_DELTA = 6,
+    GIT_OBJ_REF_DELTA = 7,
+};
+
+struct GitPack {
+    MappedFile idx;
+    MappedFile pack;
+    uint32_t n_objects;
+    const unsigned char *fanout; //< 256 big-endian cumulative counts
+    const unsigned char *shas; //< n_objects sorted object ids
+    const unsigned char *offsets; //< n_objects big-endian 32-bit offsets
+    const unsigned char *large_offsets; //< big-endian 64-bit offsets (for offsets with the MSB set)
+    uint32_t n_large_offsets;
+};
+
+struct GitRepo {
+    char git_dir[GIT_MAX_PATH]; //< where HEAD lives
+    char common_dir[GIT_MAX_PATH]; //< where objects and refs live (differs from git_dir for worktrees)
+    GitPack *packs;
+    uint32_t n_packs;
+};
+
+static uint32_t read_be32(const unsigned char *ptr)
+{
+    return ((uint32_t)ptr[0] << 24) | ((uint32_t)ptr[1] << 16) | ((uint32_t)ptr[2] << 8) | ptr[3];
+}
+
+static int hex_digit_value(char ch)
+{
+    if (ch >= '0' && ch <= '9')
+        return ch - '0';
+    if (ch >= 'a' && ch <= 'f')
+        return ch - 'a' + 10;
+    if (ch >= 'A' && ch <= 'F')
+        return ch - 'A' + 10;
+    return -1;
+}
+
+static bool parse_hex_sha(const char *hex, unsigned char *sha)
+{
+    for (int i = 0; i < GIT_SHA_SIZE; ++i) {
+        int high = hex_digit_value(hex[2 * i]);
+        int low = (high >= 0) ? hex_digit_value(hex[2 * i + 1]) : -1;
+        if (low < 0)
+            return false;
+        sha[i] = (unsigned char)((high << 4) | low);
+    }
+    return true;
+}
+
+static void format_hex_sha(const unsigned char *sha, char *hex)
+{
+    static const char digits[] = "0123456789abcdef";
+    for (int i = 0; i < GIT_SHA_SIZE; ++i) {
+        hex[2 * i] = digits[sha[i] >> 4];
+        hex[2 * i + 1] = digits[sha[i] & 15];
+    }
+    hex[GIT_HEX_SIZE] = 0;
+}
+
+static bool sha_has_hex_prefix(const unsigned char *sha, const char *hex, size_t n_digits)
+{
+    for (size_t i = 0; i < n_digits; ++i) {
+        int nibble = (i & 1) ? (sha[i / 2] & 15) : (sha[i / 2] >> 4);
+        if (nibble != hex_digit_value(hex[i]))
+            return false;
+    }
+    return true;
+}
+
+static void git_path(char *path, const char *dir, const char *fmt, ...)
+{
+    size_t len = strlen(dir);
+    if (len + 1 >= GIT_MAX_PATH)
+        exit_error("path too long: %s\n", dir);
+    memcpy(path, dir, len);
+    path[len++] = '/';
+    va_list vl;
+    va_start(vl, fmt);
+    int n = vsnprintf(path + len, GIT_MAX_PATH - len, fmt, vl);
+    va_end(vl);
+    if (n < 0 || (size_t)n >= GIT_MAX_PATH - len)
+        exit_error("path too long in %s\n", dir);
+}
+
+// Read a small file (e.g. a ref) into `out` (NUL-terminated). Missing files are not an error.
+static bool git_read_small_file(const char *path, ByteBuffer *out)
+{
+    #pragma warning (suppress : 4996) // gimme fopen
+    FILE *file = fopen(path, "rb");
+    if (!file)
+        return false;
+    out->size = 0;
+    char buffer[4096];
+    size_t n;
+    while ((n = fread(buffer, 1, sizeof(buffer), file)) > 0)
+        buffer_append(out, buffer, n);
+    bool ok = !ferror(file);
+    fclose(file);
+    buffer_append(out, "", 1);
+    out->size--;
+    return ok;
+}
+
+static void git_trim_trailing_whitespace(ByteBuffer *buffer)
+{
+    while (buffer->size && isspace((unsigned char)buffer->data[buffer->size - 1]))
+        buffer->data[--buffer->size] = 0;
+}
+
+static void git_ignore_name(const char *, void *)
+{
+}
+
+// Find the repository containing the current directory (or $GIT_DIR).
+static void git_open_repo(GitRepo *repo)
+{
+    *repo = GitRepo();
+    ByteBuffer contents = {};
+    char path[GIT_MAX_PATH];
+
+    #pragma warning (suppress : 4996) // no need for _dupenv_s
+    const char *env_git_dir = getenv("GIT_DIR");
+    if (env_git_dir && *env_git_dir) {
+        if (strlen(env_git_dir) >= GIT_MAX_PATH)
+            exit_error("GIT_DIR is too long\n");
+        strcpy(repo->git_dir, env_git_dir);
+    }
+    else {
+        char dir[GIT_MAX_PATH];
+#ifdef WIN32
+        if (!::GetCurrentDirectoryA(sizeof(dir), dir))
+            exit_windows_system_error("could not get the current directory");
+        for (char *ptr = dir; *ptr; ++ptr)
+            if (*ptr == '\\')
+                *ptr = '/';
+#elif HAVE_POSIX
+        if (!getcwd(dir, sizeof(dir)))
+            exit_clib_error("could not get the current directory");
+#else
+        strcpy(dir, "."); // XXX @Incomplete without getcwd, only the current directory is searched
+#endif
+        for (;;) {
+            git_path(path, dir, ".git/HEAD");
+            if (git_read_small_file(path, &contents)) {
+                git_path(repo->git_dir, dir, ".git");
+                break;
+            }
+            // a .git file pointing to the actual git directory (worktrees, submodules)
+            git_path(path, dir, ".git");
+            if (git_read_small_file(path, &contents) && strncmp(contents.data, "gitdir: ", 8) == 0) {
+                git_trim_trailing_whitespace(&contents);
+                const char *target = contents.data + 8;
+                bool absolute = target[0] == '/' || (target[0] && target[1] == ':');
+                if (absolute) {
+                    if (strlen(target) >= GIT_MAX_PATH)
+                        exit_error("path too long: %s\n", target);
+                    strcpy(repo->git_dir, target);
+                }
+                else
+                    git_path(repo->git_dir, dir, "%s", target);
+                break;
+            }
+            // a bare repository
+            git_path(path, dir, "HEAD");
+            if (git_read_small_file(path, &contents)) {
+                git_path(path, dir, "objects");
+                if (list_directory(path, git_ignore_name, nullptr)) {
+                    strcpy(repo->git_dir, dir);
+                    break;
+                }
+            }
+            char *slash = strrchr(dir, '/');
+            if (!slash || slash == dir || (slash == dir + 2 && dir[1] == ':'))
+                exit_error("not in a git repository (or any of the parent directories)\n");
+            *slash = 0;
+        }
+    }
+
+    // worktrees keep objects and most refs in a common directory
+    strcpy(repo->common_dir, repo->git_dir);
+    git_path(path, repo->git_dir, "commondir");
+    if (git_read_small_file(path, &contents)) {
+        git_trim_trailing_whitespace(&contents);
+        if (contents.data[0] == '/' || (contents.data[0] && contents.data[1] == ':')) {
+            if (contents.size >= GIT_MAX_PATH)
+                exit_error("path too long: %s\n", contents.data);
+            strcpy(repo->common_dir, contents.data);
+        }
+        else
+            git_path(repo->common_dir, repo->git_dir, "%s", contents.data);
+    }
+    free(contents.data);
+}
+
+struct GitPackListing {
+    GitRepo *repo;
+    char pack_dir[GIT_MAX_PATH];
+};
+
+static void git_add_pack(const char *name, void *arg)
+{
+    GitPackListing *listing = (GitPackListing *)arg;
+    GitRepo *repo = listing->repo;
+    size_t len = strlen(name);
+    if (len < 5 || strcmp(name + len - 4, ".idx") != 0)
+        return;
+
+    char path[GIT_MAX_PATH];
+    GitPack pack = {};
+    git_path(path, listing->pack_dir, "%s", name);
+    if (!map_file(path, &pack.idx, false /* fatal */))
+        return;
+    git_path(path, listing->pack_dir, "%.*s.pack", (int)(len - 4), name);
+    if (!map_file(path, &pack.pack, false /* fatal */)) {
+        unmap_file(&pack.idx);
+        return;
+    }
+
+    const unsigned char *idx = pack.idx.data;
+    uint64_t idx_size = pack.idx.size;
+    if (idx_size < 8 + 256 * 4 || memcmp(idx, "\377tOc", 4) != 0 || read_be32(idx + 4) != 2) {
+        report_error(false, "pack index '%s' is not a version 2 pack index, skipping it\n", name);
+        unmap_file(&pack.idx);
+        unmap_file(&pack.pack);
+        return;
+    }
+    pack.fanout = idx + 8;
+    pack.n_objects = read_be32(pack.fanout + 255 * 4);
+    pack.shas = pack.fanout + 256 * 4;
+    pack.offsets = pack.shas + (uint64_t)pack.n_objects * (GIT_SHA_SIZE + 4); // skip the CRC table
+    pack.large_offsets = pack.offsets + (uint64_t)pack.n_objects * 4;
+    uint64_t min_size = (uint64_t)(pack.large_offsets - idx) + 2 * GIT_SHA_SIZE;
+    if (idx_size < min_size || pack.pack.size < 12 || memcmp(pack.pack.data, "PACK", 4) != 0) {
+        report_error(false, "pack '%s' is corrupt, skipping it\n", name);
+        unmap_file(&pack.idx);
+        unmap_file(&pack.pack);
+        return;
+    }
+    pack.n_large_offsets = (uint32_t)((idx_size - min_size) / 8);
+
+    repo->packs = (GitPack *)realloc(repo->packs, (repo->n_packs + 1) * sizeof(GitPack));
+    if (!repo->packs)
+        exit_error("Out-of-memory allocating pack table.\n");
+    repo->packs[repo->n_packs++] = pack;
+}
+
+static void git_load_packs(GitRepo *repo)
+{
+    GitPackListing listing;
+    listing.repo = repo;
+    git_path(listing.pack_dir, repo->common_dir, "objects/pack");
+    list_directory(listing.pack_dir, git_add_pack, &listing);
+}
+
+static void git_close_repo(GitRepo *repo)
+{
+    for (uint32_t i = 0; i < repo->n_packs; ++i) {
+        unmap_file(&repo->packs[i].idx);
+        unmap_file(&repo->packs[i].pack);
+    }
+    free(repo->packs);
+    *repo = GitRepo();
+}
+
+// Binary search for `sha` in the pack index. Returns the object's position or -1.
+static int64_t git_pack_find(GitPack *pack, const unsigned char *sha)
+{
+    uint32_t lo = sha[0] ? read_be32(pack->fanout + (sha[0] - 1) * 4) : 0;
+    uint32_t hi = read_be32(pack->fanout + sha[0] * 4);
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        int cmp = memcmp(pack->shas + (uint64_t)mid * GIT_SHA_SIZE, sha, GIT_SHA_SIZE);
+        if (cmp == 0)
+            return mid;
+        if (cmp < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return -1;
+}
+
+static uint64_t git_pack_offset(GitPack *pack, uint32_t position)
+{
+    uint32_t offset = read_be32(pack->offsets + (uint64_t)position * 4);
+    if (!(offset & 0x80000000u))
+        return offset;
+    uint32_t i_large = offset & 0x7fffffffu;
+    if (i_large >= pack->n_large_offsets)
+        exit_error("corrupt pack index (bad large offset)\n");
+    const unsigned char *ptr = pack->large_offsets + (uint64_t)i_large * 8;
+    return ((uint64_t)read_be32(ptr) << 32) | read_be32(ptr + 4);
+}
+
+static bool git_read_object(GitRepo *repo, const unsigned char *sha, ByteBuffer *out, int *type);
+
+// Read a varint-encoded size from a delta header.
+static uint64_t git_delta_size(const unsigned char **ptr, const unsigned char *end)
+{
+    uint64_t size = 0;
+    int shift = 0;
+    unsigned char byte;
+    do {
+        if (*ptr == end || shift > 63)
+            exit_error("corrupt git delta (bad size)\n");
+        byte = *(*ptr)++;
+        size |= (uint64_t)(byte & 0x7f) << shift;
+        shift += 7;
+    } while (byte & 0x80);
+    return size;
+}
+
+// Apply `delta` to `base` and store the result in `out`.
+static void git_apply_delta(const ByteBuffer *base, const ByteBuffer *delta, ByteBuffer *out)
+{
+    const unsigned char *ptr = (const unsigned char *)delta->data;
+    const unsigned char *end = ptr + delta->size;
+    uint64_t base_size = git_delta_size(&ptr, end);
+    uint64_t result_size = git_delta_size(&ptr, end);
+    if (base_size != base->size)
+        exit_error("corrupt git delta (base size mismatch)\n");
+    out->size = 0;
+    while (ptr < end) {
+        unsigned char op = *ptr++;
+        if (op & 0x80) {
+            // copy from base
+            uint64_t offset = 0;
+            uint64_t size = 0;
+            for (int i = 0; i < 4; ++i)
+                if (op & (1 << i)) {
+                    if (ptr == end)
+                        exit_error("corrupt git delta (truncated copy)\n");
+                    offset |= (uint64_t)*ptr++ << (8 * i);
+                }
+            for (int i = 0; i < 3; ++i)
+                if (op & (0x10 << i)) {
+                    if (ptr == end)
+                        exit_error("corrupt git delta (truncated copy)\n");
+                    size |= (uint64_t)*ptr++ << (8 * i);
+                }
+            if (size == 0)
+                size = 0x10000;
+            if (offset + size > base->size)
+                exit_error("corrupt git delta (copy out of range)\n");
+            buffer_append(out, base->data + offset, size);
+        }
+        else if (op) {
+            // insert literal bytes
+            if ((uint64_t)(end - ptr) < op)
+                exit_error("corrupt git delta (truncated insert)\n");
+            buffer_append(out, ptr, op);
+            ptr += op;
+        }
+        else
+            exit_error("corrupt git delta (reserved opcode)\n");
+    }
+    if (out->size != result_size)
+        exit_error("corrupt git delta (result size mismatch)\n");
+}
+
+// Read the object at `offset` in the pack, resolving deltas.
+static void git_read_pack_object(GitRepo *repo, GitPack *pack, uint64_t offset, ByteBuffer *out, int *type, int depth)
+{
+    if (depth > GIT_MAX_DELTA_DEPTH)
+        exit_error("git delta chain too long\n");
+    const unsigned char *data = pack->pack.data;
+    uint64_t size = pack->pack.size;
+    if (offset >= size)
+        exit_error("corrupt pack (object offset out of range)\n");
+
+    const unsigned char *ptr = data + offset;
+    const unsigned char *end = data + size;
+    unsigned char byte = *ptr++;
+    int object_type = (byte >> 4) & 7;
+    uint64_t object_size = byte & 15;
+    int shift = 4;
+    while (byte & 0x80) {
+        if (ptr == end || shift > 57)
+            exit_error("corrupt pack (bad object header)\n");
+        byte = *ptr++;
+        object_size |= (uint64_t)(byte & 0x7f) << shift;
+        shift += 7;
+    }
+
+    ByteBuffer base = {};
+    int base_type = GIT_OBJ_NONE;
+    if (object_type == GIT_OBJ_OFS_DELTA) {
+        if (ptr == end)
+            exit_error("corrupt pack (bad delta offset)\n");
+        byte = *ptr++;
+        uint64_t base_distance = byte & 0x7f;
+        while (byte & 0x80) {
+            if (ptr == end || base_distance >= (UINT64_MAX >> 8))
+                exit_error("corrupt pack (bad delta offset)\n");
+            byte = *ptr++;
+            base_distance = ((base_distance + 1) << 7) | (byte & 0x7f);
+        }
+        if (base_distance == 0 || base_distance > offset)
+            exit_error("corrupt pack (delta base out of range)\n");
+        git_read_pack_object(repo, pack, offset - base_distance, &base, &base_type, depth + 1);
+    }
+    else if (object_type == GIT_OBJ_REF_DELTA) {
+        if ((uint64_t)(end - ptr) < GIT_SHA_SIZE)
+            exit_error("corrupt pack (truncated delta base)\n");
+        if (!git_read_object(repo, ptr, &base, &base_type))
+            exit_error("missing delta base object in pack\n");
+        ptr += GIT_SHA_SIZE;
+    }
+    else if (object_type < GIT_OBJ_COMMIT || object_type > GIT_OBJ_TAG)
+        exit_error("corrupt pack (unknown object type %d)\n", object_type);
+
+    ByteBuffer *inflated = out;
+    ByteBuffer delta = {};
+    if (base_type != GIT_OBJ_NONE)
+        inflated = &delta;
+    inflated->size = 0;
+    if (!inflate_zlib(ptr, (size_t)(end - ptr), inflated) || inflated->size != object_size)
+        exit_error("corrupt pack (could not decompress object at offset %" PRIu64 ")\n", offset);
+
+    if (base_type != GIT_OBJ_NONE) {
+        git_apply_delta(&base, &delta, out);
+        object_type = base_type;
+    }
+    free(delta.data);
+    free(base.data);
+    *type = object_type;
+}
+
+// Read the object with the given id. Returns false if there is no such object.
+static bool git_read_object(GitRepo *repo, const unsigned char *sha, ByteBuffer *out, int *type)
+{
+    for (uint32_t i = 0; i < repo->n_packs; ++i) {
+        GitPack *pack = repo->packs + i;
+        int64_t position = git_pack_find(pack, sha);
+        if (position >= 0) {
+            git_read_pack_object(repo, pack, git_pack_offset(pack, (uint32_t)position), out, type, 0);
+            return true;
+        }
+    }
+
+    // loose object: zlib-compressed "<type> <size>\0<data>"
+    char hex[GIT_HEX_SIZE + 1];
+    format_hex_sha(sha, hex);
+    char path[GIT_MAX_PATH];
+    git_path(path, repo->common_dir, "objects/%.2s/%s", hex, hex + 2);
+    MappedFile mapped;
+    #pragma warning (suppress : 4996) // gimme fopen
+    FILE *probe = fopen(path, "rb");
+    if (!probe)
+        return false;
+    fclose(probe);
+    map_file(path, &mapped, true /* fatal */);
+    out->size = 0;
+    bool ok = inflate_zlib(mapped.data, (size_t)mapped.size, out);
+    unmap_file(&mapped);
+    if (!ok)
+        exit_error("could not decompress loose object %s\n", hex);
+
+    char *header_end = (char *)memchr(out->data, 0, out->size);
+    if (!header_end)
+        exit_error("corrupt loose object %s\n", hex);
+    static const char *type_names[] = { nullptr, "commit", "tree", "blob", "tag" };
+    *type = GIT_OBJ_NONE;
+    for (int t = GIT_OBJ_COMMIT; t <= GIT_OBJ_TAG; ++t) {
+        size_t len = strlen(type_names[t]);
+        if (strncmp(out->data, type_names[t], len) == 0 && out->data[len] == ' ')
+            *type = t;
+    }
+    if (*type == GIT_OBJ_NONE)
+        exit_error("loose object %s has an unknown type\n", hex);
+    size_t header_size = header_end + 1 - out->data;
+    memmove(out->data, header_end + 1, out->size - header_size);
+    out->size -= header_size;
+    return true;
+}
+
+struct GitPrefixSearch {
+    const char *hex; //< the abbreviated object id
+    size_t n_digits;
+    unsigned char sha[GIT_SHA_SIZE]; //< first match
+    uint32_t n_matches; //< number of distinct matches
+};
+
+static void git_add_prefix_match(GitPrefixSearch *search, const unsigned char *sha)
+{
+    if (search->n_matches && memcmp(search->sha, sha, GIT_SHA_SIZE) == 0)
+        return;
+    if (!search->n_matches)
+        memcpy(search->sha, sha, GIT_SHA_SIZE);
+    search->n_matches++;
+}
+
+static void git_check_loose_prefix(const char *name, void *arg)
+{
+    GitPrefixSearch *search = (GitPrefixSearch *)arg;
+    if (strlen(name) != GIT_HEX_SIZE - 2 || strncmp(name, search->hex + 2, search->n_digits - 2) != 0)
+        return;
+    char hex[GIT_HEX_SIZE + 1];
+    memcpy(hex, search->hex, 2);
+    memcpy(hex + 2, name, GIT_HEX_SIZE - 2);
+    unsigned char sha[GIT_SHA_SIZE];
+    if (parse_hex_sha(hex, sha))
+        git_add_prefix_match(search, sha);
+}
+
+// Resolve an abbreviated object id (at least 4 hex digits).
+static bool git_resolve_prefix(GitRepo *repo, const char *hex, size_t n_digits, unsigned char *sha)
+{
+    GitPrefixSearch search = {};
+    search.hex = hex;
+    search.n_digits = n_digits;
+
+    int first_byte = (hex_digit_value(hex[0]) << 4) | hex_digit_value(hex[1]);
+    for (uint32_t i = 0; i < repo->n_packs; ++i) {
+        GitPack *pack = repo->packs + i;
+        uint32_t lo = first_byte ? read_be32(pack->fanout + (first_byte - 1) * 4) : 0;
+        uint32_t hi = read_be32(pack->fanout + first_byte * 4);
+        for (uint32_t position = lo; position < hi; ++position) {
+            const unsigned char *candidate = pack->shas + (uint64_t)position * GIT_SHA_SIZE;
+            if (sha_has_hex_prefix(candidate, hex, n_digits))
+                git_add_prefix_match(&search, candidate);
+        }
+    }
+
+    char dir[GIT_MAX_PATH];
+    char lower[3] = { (char)tolower(hex[0]), (char)tolower(hex[1]), 0 };
+    git_path(dir, repo->common_dir, "objects/%s", lower);
+    list_directory(dir, git_check_loose_prefix, &search);
+
+    if (search.n_matches > 1)
+        exit_error("abbreviated object id '%.*s' is ambiguous\n", (int)n_digits, hex);
+    if (search.n_matches == 0)
+        return false;
+    memcpy(sha, search.sha, GIT_SHA_SIZE);
+    return true;
+}
+
+// Resolve a ref name (following symbolic refs) by looking at loose refs and packed-refs.
+static bool git_resolve_ref(GitRepo *repo, const char *name, unsigned char *sha, int depth)
+{
+    if (depth > 10)
+        exit_error("too many levels of symbolic refs at '%s'\n", name);
+
+    ByteBuffer contents = {};
+    char path[GIT_MAX_PATH];
+    // HEAD and other per-worktree refs live in git_dir, the rest in common_dir
+    bool per_worktree = strncmp(name, "refs/", 5) != 0;
+    git_path(path, per_worktree ? repo->git_dir : repo->common_dir, "%s", name);
+    bool found = false;
+    if (git_read_small_file(path, &contents)) {
+        git_trim_trailing_whitespace(&contents);
+        if (strncmp(contents.data, "ref: ", 5) == 0)
+            found = git_resolve_ref(repo, contents.data + 5, sha, depth + 1);
+        else
+            found = contents.size == GIT_HEX_SIZE && parse_hex_sha(contents.data, sha);
+    }
+    else {
+        git_path(path, repo->common_dir, "packed-refs");
+        if (git_read_small_file(path, &contents)) {
+            // lines of the form "<hex> <refname>", comments ('#') and peeled lines ('^')
+            size_t name_len = strlen(name);
+            char *line = contents.data;
+            while (*line && !found) {
+                char *eol = strchr(line, '\n');
+                size_t line_len = eol ? (size_t)(eol - line) : strlen(line);
+                // the name must be followed by the end of the line, so "foo" does not match "foobar"
+                char *after = line + GIT_HEX_SIZE + 1 + name_len;
+                if (line_len >= GIT_HEX_SIZE + 1 + name_len && line[GIT_HEX_SIZE] == ' '
+                    && strncmp(line + GIT_HEX_SIZE + 1, name, name_len) == 0
+                    && (*after == '\0' || *after == '\r' || *after == '\n'))
+                    found = parse_hex_sha(line, sha);
+                line += line_len + (eol ? 1 : 0);
+            }
+        }
+    }
+    free(contents.data);
+    return found;
+}
+
+// Follow annotated tags until we get to an object of another type.
+static int git_peel(GitRepo *repo, unsigned char *sha, ByteBuffer *object)
+{
+    for (int depth = 0; depth < 100; ++depth) {
+        int type;
+        char hex[GIT_HEX_SIZE + 1];
+        if (!git_read_object(repo, sha, object, &type)) {
+            format_hex_sha(sha, hex);
+            exit_error("object %s is missing\n", hex);
+        }
+        if (type != GIT_OBJ_TAG)
+            return type;
+        buffer_append(object, "", 1);
+        if (strncmp(object->data, "object ", 7) != 0 || !parse_hex_sha(object->data + 7, sha)) {
+            format_hex_sha(sha, hex);
+            exit_error("corrupt tag object %s\n", hex);
+        }
+    }
+    exit_error("too many levels of tags\n");
+    return GIT_OBJ_NONE;
+}
+
+// Find the header field `name` (e.g. "tree", "parent") of a commit object. `occurrence`
+// counts from 1. Returns false if there is no such field.
+static bool git_commit_field(ByteBuffer *commit, const char *name, int occurrence, unsigned char *sha)
+{
+    size_t name_len = strlen(name);
+    const char *line = commit->data;
+    const char *end = commit->data + commit->size;
+    while (line < end && *line != '\n') { // the header ends at the first empty line
+        const char *eol = (const char *)memchr(line, '\n', end - line);
+        if (!eol)
+            eol = end;
+        if ((size_t)(eol - line) >= name_len + 1 + GIT_HEX_SIZE && strncmp(line, name, name_len) == 0
+            && line[name_len] == ' ' && --occurrence == 0)
+            return parse_hex_sha(line + name_len + 1, sha);
+        line = eol + 1;
+    }
+    return false;
+}
+
+// Resolve a revision: a full or abbreviated object id or a ref name, optionally followed
+// by any number of "~N" and "^N" suffixes. The result is the id of a commit.
+static void git_resolve_revision(GitRepo *repo, const char *revision, unsigned char *sha)
+{
+    size_t base_len = strcspn(revision, "~^");
+    char base[GIT_MAX_PATH];
+    if (base_len == 0 || base_len >= sizeof(base))
+        exit_error("invalid revision '%s'\n", revision);
+    memcpy(base, revision, base_len);
+    base[base_len] = 0;
+
+    static const char *ref_patterns[] = {
+        "%s", "refs/%s", "refs/tags/%s", "refs/heads/%s", "refs/remotes/%s", "refs/remotes/%s/HEAD" };
+    bool found = false;
+    size_t n_hex = strspn(base, "0123456789abcdefABCDEF");
+    if (n_hex == base_len && base_len == GIT_HEX_SIZE)
+        found = parse_hex_sha(base, sha);
+    for (size_t i = 0; !found && i < sizeof(ref_patterns) / sizeof(ref_patterns[0]); ++i) {
+        char name[GIT_MAX_PATH];
+        snprintf(name, sizeof(name), ref_patterns[i], base);
+        found = git_resolve_ref(repo, name, sha, 0);
+    }
+    if (!found && n_hex == base_len && base_len >= 4 && base_len < GIT_HEX_SIZE)
+        found = git_resolve_prefix(repo, base, base_len, sha);
+    if (!found)
+        exit_error("unknown revision '%s'\n", base);
+
+    ByteBuffer object = {};
+    const char *suffix = revision + base_len;
+    for (;;) {
+        if (git_peel(repo, sha, &object) != GIT_OBJ_COMMIT)
+            exit_error("revision '%s' does not name a commit\n", revision);
+        if (!*suffix)
+            break;
+        char op = *suffix++;
+        char *end;
+        unsigned long n = strtoul(suffix, &end, 10);
+        if (end == suffix)
+            n = 1;
+        suffix = end;
+        if (op == '^') {
+            if (n == 0)
+                continue; // "^0" is the commit itself
+            if (!git_commit_field(&object, "parent", (int)n, sha))
+                exit_error("revision '%s': commit has no parent %lu\n", revision, n);
+        }
+        else if (op == '~') {
+            for (unsigned long i = 0; i < n; ++i) {
+                if (!git_commit_field(&object, "parent", 1, sha))
+                    exit_error("revision '%s': history is too short\n", revision);
+                if (i + 1 < n && git_peel(repo, sha, &object) != GIT_OBJ_COMMIT)
+                    exit_error("revision '%s': parent is not a commit\n", revision);
+            }
+        }
+        else
+            exit_error("invalid revision '%s'\n", revision);
+    }
+    free(object.data);
+}
+
+// Look up `path` (relative to the repository root) in the tree of the given commit.
+// Returns false if there is no such file.
+static bool git_find_blob(GitRepo *repo, const unsigned char *commit_sha, const char *path, unsigned char *blob_sha)
+{
+    ByteBuffer object = {};
+    int type;
+    unsigned char sha[GIT_SHA_SIZE];
+    if (!git_read_object(repo, commit_sha, &object, &type) || type != GIT_OBJ_COMMIT
+        || !git_commit_field(&object, "tree", 1, sha))
+        exit_error("could not read the tree of the commit\n");
+
+    bool found = false;
+    const char *component = path;
+    for (;;) {
+        while (*component == '/')
+            component++;
+        size_t component_len = strcspn(component, "/");
+        if (!git_read_object(repo, sha, &object, &type) || type != GIT_OBJ_TREE)
+            break;
+
+        // tree entries: "<octal mode> <name>\0<20-byte id>"
+        const char *entry = object.data;
+        const char *end = object.data + object.size;
+        const char *match = nullptr;
+        bool is_tree = false;
+        while (entry < end) {
+            const char *space = (const char *)memchr(entry, ' ', end - entry);
+            const char *name_end = space ? (const char *)memchr(space, 0, end - space) : nullptr;
+            if (!name_end || end - name_end < 1 + GIT_SHA_SIZE)
+                exit_error("corrupt tree object\n");
+            const char *name = space + 1;
+            if ((size_t)(name_end - name) == component_len && memcmp(name, component, component_len) == 0) {
+                match = name_end + 1;
+                is_tree = strncmp(entry, "40000 ", 6) == 0;
+                break;
+            }
+            entry = name_end + 1 + GIT_SHA_SIZE;
+        }
+        if (!match)
+            break;
+        memcpy(sha, match, GIT_SHA_SIZE);
+
+        const char *rest = component + component_len;
+        while (*rest == '/')
+            rest++;
+        if (!*rest) {
+            found = !is_tree;
+            break;
+        }
+        if (!is_tree)
+            break;
+        component = rest;
+    }
+    free(object.data);
+    if (found)
+        memcpy(blob_sha, sha, GIT_SHA_SIZE);
+    return found;
+}
+
+// Read the blob with the given id (which we found at `path`) into `out`, with two extra
+// bytes at the end as required by parse_text. Returns the size of the contents.
+static uint32_t git_read_blob(GitRepo *repo, const unsigned char *blob_sha, const char *path, ByteBuffer *out)
+{
+    int type;
+    out->size = 0;
+    if (!git_read_object(repo, blob_sha, out, &type) || type != GIT_OBJ_BLOB)
+        exit_error("could not read the blob of '%s'\n", path);
+    if (out->size > UINT32_MAX)
+        exit_error("blob of '%s' is too large\n", path);
+    uint32_t text_size = (uint32_t)out->size;
+    buffer_append(out, nullptr, 2); // room for parse_text's extra newline and NUL
+    return text_size;
+}
+
+// Parse the blob (through the cache) and print the contexts for the given line.
+static void print_git_blob_line_contexts(GitRepo *repo, ParseCache *cache, const unsigned char *commit_sha,
+                                         const char *path, uint32_t query_line)
+{
+    unsigned char blob_sha[GIT_SHA_SIZE];
+    if (!git_find_blob(repo, commit_sha, path, blob_sha))
+        exit_error("path '%s' does not exist in the given revision\n", path);
+
+    uint64_t key = hash_bytes(blob_sha, GIT_SHA_SIZE, parse_key_seed(language_of_filename(path), engine_option));
+    ParsedFile *file = parse_cache_find(cache, key);
+    if (!file) {
+        ByteBuffer blob = {};
+        uint32_t text_size = git_read_blob(repo, blob_sha, path, &blob);
+        file = parse_cache_add(cache, key, blob.data, text_size, path);
+    }
+
+    if (query_line == 0 || query_line > file->n_lines)
+        exit_error("line %u is out of range for '%s' (which has %u lines)\n", query_line, path, file->n_lines);
+    print_line_contexts(file, query_line - 1);
+}
+
+// Replace `file` (parsed from contents with hash `*content_hash`) by the parse of the new
+// contents `text` (as returned by read_file). If the file only grew (e.g. a log or
+// generated output being appended to), parsing resumes at the old checkpoint instead of
+// starting over. Returns false if the contents did not change; `text` is freed then.
+static bool reparse_text(ParsedFile *file, uint64_t *content_hash, char *text, uint32_t text_size, const char *filename)
+{
+    uint64_t new_hash = hash_bytes(text, text_size, 0);
+    if (new_hash == *content_hash && text_size == file->text_size) {
+        free(text);
+        return false;
+    }
+    ParsedFile new_file;
+    if (file->checkpoint.text_offset && text_size > file->text_size
+        && hash_bytes(text, file->text_size, 0) == *content_hash)
+        parse_text(&new_file, text, text_size, filename, file);
+    else
+        parse_text(&new_file, text, text_size, filename);
+    free_parsed_file(file);
+    *file = new_file;
+    *content_hash = new_hash;
+    return true;
+}
+
+// watch mode (see --watch)
+//
+// A long-running process answering queries read from stdin, one per line:
+//
+//     <FILE> <LINE>
+//
+// Each answer is exactly one line on stdout (empty if the query failed). Files are parsed
+// on their first query and kept. On Linux, we subscribe to inotify events for the watched
+// directory tree and reparse changed files as soon as we hear about them, so the first
+// query after a save finds a warm entry. Elsewhere, we compare the file's size and
+// modification time on each query.
+
+#ifdef __linux__
+#define WATCH_INOTIFY 1
+#else
+#define WATCH_INOTIFY 0
+#endif
+
+struct WatchEntry {
+    char *path; //< canonical path
+    ParsedFile file;
+    uint64_t content_hash; //< hash of the raw contents parsed into `file`
+    uint64_t stamp; //< size and modification time when we last read the file (see file_stamp)
+    bool valid; //< false if the file could not be read the last time we tried
+    bool dirty; //< we got a change notification and need to reparse
+    bool nav_valid; //< `nav` has been built for the current contents of `file`
+    NavIndex nav;
+};
+
+struct WatchState {
+    char root[GIT_MAX_PATH]; //< canonical path of the watched directory
+    HashTable64 table; //< hash_string(path) -> index into `entries`
+    WatchEntry *entries;
+    uint32_t n_entries;
+    uint32_t capacity;
+    bool compact; //< keep only the context lines of parsed files (see compact_parsed_file)
+    StringTable strings; //< the context lines of all files if `compact` is set
+#if WATCH_INOTIFY
+    int inotify_fd;
+    char **watched_dirs; //< directory path for each inotify watch descriptor (or nullptr)
+    uint32_t n_watched_dirs;
+    HashTable64 dir_table; //< hash_string(directory path) -> its watch descriptor
+    uint32_t n_dirty;
+#endif
+};
+
+// Write the canonical (absolute) form of `path` into `out`. Returns false if there is
+// no such file.
+static bool canonical_path(const char *path, char *out, size_t out_size)
+{
+#ifdef WIN32
+    DWORD length = ::GetFullPathNameA(path, (DWORD)out_size, out, NULL);
+    if (length == 0 || length >= out_size)
+        return false;
+    for (char *ptr = out; *ptr; ++ptr)
+        if (*ptr == '\\')
+            *ptr = '/';
+    return ::GetFileAttributesA(out) != INVALID_FILE_ATTRIBUTES;
+#elif HAVE_POSIX
+    char resolved[PATH_MAX];
+    if (!realpath(path, resolved) || strlen(resolved) >= out_size)
+        return false;
+    strcpy(out, resolved);
+    return true;
+#else
+    (void)path;
+    (void)out;
+    (void)out_size;
+    return false; // --watch is rejected in main
+#endif
+}
+
+// A value that changes whenever the file's size or modification time changes (0 if the
+// file cannot be accessed).
+static uint64_t file_stamp(const char *path)
+{
+#ifdef WIN32
+    WIN32_FILE_ATTRIBUTE_DATA data;
+    if (!::GetFileAttributesExA(path, GetFileExInfoStandard, &data))
+        return 0;
+    uint64_t size = ((uint64_t)data.nFileSizeHigh << 32) | data.nFileSizeLow;
+    uint64_t time = ((uint64_t)data.ftLastWriteTime.dwHighDateTime << 32) | data.ftLastWriteTime.dwLowDateTime;
+    return (size * XXH_PRIME64_1) ^ time ^ 1;
+#elif HAVE_POSIX
+    struct stat st;
+    if (stat(path, &st) != 0)
+        return 0;
+    uint64_t time = (uint64_t)st.st_mtim.tv_sec * 1000000000u + (uint64_t)st.st_mtim.tv_nsec;
+    return ((uint64_t)st.st_size * XXH_PRIME64_1) ^ time ^ 1;
+#else
+    (void)path;
+    return 0; // --watch is rejected in main
+#endif
+}
+
+// (Re)read and parse the file of the given entry, compacting it if state->compact is set
+// (see compact_parsed_file). Returns false if that failed.
+static bool watch_load_entry(WatchState *state, WatchEntry *entry)
+{
+    if (state->compact)
+        entry->file.text = nullptr; // the text belongs to state->strings
+    entry->dirty = false;
+    entry->stamp = file_stamp(entry->path);
+    if (entry->nav_valid)
+        free_nav_index(&entry->nav);
+    entry->nav_valid = false;
+    uint32_t text_size;
+    char *text = read_file(entry->path, &text_size, false /* fatal */);
+    if (!text) {
+        if (entry->valid)
+            free_parsed_file(&entry->file);
+        entry->valid = false;
+        return false;
+    }
+    if (entry->valid) {
+        if (!reparse_text(&entry->file, &entry->content_hash, text, text_size, entry->path))
+            return true;
+    }
+    else {
+        entry->content_hash = hash_bytes(text, text_size, 0);
+        parse_text(&entry->file, text, text_size, entry->path);
+        entry->valid = true;
+    }
+    if (state->compact)
+        compact_parsed_file(&entry->file, &state->strings);
+    return true;
+}
+
+static WatchEntry *watch_find_entry(WatchState *state, const char *path)
+{
+    uint32_t *i_entry = hash_table_find(&state->table, hash_string(path, 0));
+    if (!i_entry)
+        return nullptr;
+    WatchEntry *entry = state->entries + *i_entry;
+    // XXX @Incomplete We treat a collision of 64-bit path hashes as a cache miss.
+    return (strcmp(entry->path, path) == 0) ? entry : nullptr;
+}
+
+static WatchEntry *watch_add_entry(WatchState *state, const char *path)
+{
+    if (state->n_entries == state->capacity) {
+        state->capacity = state->capacity ? 2 * state->capacity : 64;
+        state->entries = (WatchEntry *)realloc(state->entries, state->capacity * sizeof(WatchEntry));
+        if (!state->entries)
+            exit_error("Out-of-memory growing the table of watched files.\n");
+    }
+    WatchEntry *entry = state->entries + state->n_entries;
+    *entry = WatchEntry();
+    size_t len = strlen(path);
+    entry->path = (char *)malloc(len + 1);
+    if (!entry->path)
+        exit_error("Out-of-memory copying a path.\n");
+    memcpy(entry->path, path, len + 1);
+    uint64_t key = hash_string(path, 0);
+    if (!hash_table_insert(&state->table, key, state->n_entries, nullptr))
+        *hash_table_find(&state->table, key) = state->n_entries; // hash collision, the new entry wins
+    state->n_entries++;
+    return entry;
+}
+
+#if WATCH_INOTIFY
+#define WATCH_EVENTS (IN_CLOSE_WRITE | IN_MODIFY | IN_MOVED_TO | IN_CREATE | IN_DELETE)
+
+struct WatchListing {
+    WatchState *state;
+    const char *dir;
+};
+
+static void watch_directory_entry(const char *name, void *arg);
+
+// Add inotify watches for `dir` (a canonical path) and its subdirectories.
+static void watch_directory_tree(WatchState *state, const char *dir)
+{
+    int wd = inotify_add_watch(state->inotify_fd, dir, WATCH_EVENTS | IN_ONLYDIR);
+    if (wd < 0) {
+        report_system_error(false, "could not watch directory '%s'", dir);
+        return;
+    }
+    if ((uint32_t)wd >= state->n_watched_dirs) {
+        uint32_t n = 2 * (uint32_t)wd + 16;
+        state->watched_dirs = (char **)realloc(state->watched_dirs, n * sizeof(char *));
+        if (!state->watched_dirs)
+            exit_error("Out-of-memory growing the table of watched directories.\n");
+        memset(state->watched_dirs + state->n_watched_dirs, 0, (n - state->n_watched_dirs) * sizeof(char *));
+        state->n_watched_dirs = n;
+    }
+    if (state->watched_dirs[wd])
+        return; // already watching (e.g. reached twice through renames)
+    state->watched_dirs[wd] = strdup(dir);
+    if (!state->watched_dirs[wd])
+        exit_error("Out-of-memory copying a path.\n");
+    uint64_t key = hash_string(dir, 0);
+    if (!hash_table_insert(&state->dir_table, key, (uint32_t)wd, nullptr))
+        *hash_table_find(&state->dir_table, key) = (uint32_t)wd; // watched again after removal (or a hash collision)
+
+    WatchListing listing;
+    listing.state = state;
+    listing.dir = dir;
+    list_directory(dir, watch_directory_entry, &listing);
+}
+
+static void watch_directory_entry(const char *name, void *arg)
+{
+    // Note: We skip hidden entries like ".git" whose contents change all the time but
+    //       are never queried.
+    if (name[0] == '.')
+        return;
+    WatchListing *listing = (WatchListing *)arg;
+    char path[PATH_MAX];
+    if ((size_t)snprintf(path, sizeof(path), "%s/%s", listing->dir, name) >= sizeof(path))
+        return;
+    struct stat st;
+    if (lstat(path, &st) == 0 && S_ISDIR(st.st_mode))
+        watch_directory_tree(listing->state, path);
+}
+
+// Read all pending inotify events (without blocking) and mark the affected entries dirty.
+static void watch_read_events(WatchState *state)
+{
+    // Note: The buffer must be aligned for struct inotify_event.
+    uint64_t buffer[4096 / sizeof(uint64_t)];
+    for (;;) {
+        ssize_t n_bytes = read(state->inotify_fd, buffer, sizeof(buffer));
+        if (n_bytes < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                exit_clib_error("could not read inotify events");
+            return;
+        }
+        const char *ptr = (const char *)buffer;
+        const char *end = ptr + n_bytes;
+        while (ptr < end) {
+            const struct inotify_event *event = (const struct inotify_event *)ptr;
+            ptr += sizeof(struct inotify_event) + event->len;
+            if (event->mask & IN_Q_OVERFLOW) {
+                // we lost events, so everything might have changed
+                for (uint32_t i = 0; i < state->n_entries; ++i)
+                    state->entries[i].dirty = true;
+                state->n_dirty = state->n_entries;
+                continue;
+            }
+            if (event->wd < 0 || (uint32_t)event->wd >= state->n_watched_dirs
+                || !state->watched_dirs[event->wd])
+                continue;
+            if (event->mask & IN_IGNORED) {
+                // the directory is gone (or unmounted), see watch_covers_path
+                free(state->watched_dirs[event->wd]);
+                state->watched_dirs[event->wd] = nullptr;
+                continue;
+            }
+            if (!event->len)
+                continue;
+            char path[PATH_MAX];
+            if ((size_t)snprintf(path, sizeof(path), "%s/%s", state->watched_dirs[event->wd], event->name) >= sizeof(path))
+                continue;
+            if (event->mask & IN_ISDIR) {
+                if ((event->mask & (IN_CREATE | IN_MOVED_TO)) && event->name[0] != '.')
+                    watch_directory_tree(state, path);
+                continue;
+            }
+            WatchEntry *entry = watch_find_entry(state, path);
+            if (entry && !entry->dirty) {
+                entry->dirty = true;
+                state->n_dirty++;
+            }
+        }
+    }
+}
+
+// Reparse all files we got change notifications for.
+static void watch_reparse_dirty_entries(WatchState *state)
+{
+    if (!state->n_dirty)
+        return;
+    for (uint32_t i = 0; i < state->n_entries; ++i) {
+        WatchEntry *entry = state->entries + i;
+        if (entry->dirty)
+            watch_load_entry(state, entry);
+    }
+    state->n_dirty = 0;
+}
+#endif
+
+// Whether we get change notifications for the file with the given canonical path: its
+// directory has a live inotify watch. (Hidden directories, directories we could not
+// watch and everything outside the watched tree have none, so files there are checked
+// for changes on each query instead.)
+static bool watch_covers_path(WatchState *state, const char *path)
+{
+#if WATCH_INOTIFY
+    const char *slash = strrchr(path, '/');
+    if (!slash)
+        return false;
+    char dir[GIT_MAX_PATH];
+    size_t len = (slash == path) ? 1 : (size_t)(slash - path);
+    memcpy(dir, path, len);
+    dir[len] = 0;
+    uint32_t *wd = hash_table_find(&state->dir_table, hash_string(dir, 0));
+    return wd && *wd < state->n_watched_dirs && state->watched_dirs[*wd] && strcmp(state->watched_dirs[*wd], dir) == 0;
+#else
+    (void)state;
+    (void)path;
+    return false;
+#endif
+}
+
+// Answer one query line of the form "<FILE> <LINE>" or "<:COMMAND> <FILE> <LINE>", where
+// COMMAND is "nav" or "children" (see --nav and --children).
+static void watch_answer_query(WatchState *state, char *query)
+{
+    size_t len = strlen(query);
+    while (len && isspace((unsigned char)query[len - 1]))
+        query[--len] = 0;
+    while (isspace((unsigned char)*query))
+        query++;
+    if (!*query)
+        return; // ignore empty lines
+
+    const char *command = nullptr;
+    if (*query == ':') {
+        command = query + 1;
+        query += strcspn(query, " \t");
+        if (*query)
+            *query++ = 0;
+        while (isspace((unsigned char)*query))
+            query++;
+    }
+
+    // the line number is the last word, the file name is everything before it
+    // (so file names may contain spaces)
+    char *line_arg = strrchr(query, ' ');
+    char *tab = strrchr(query, '\t');
+    if (tab > line_arg)
+        line_arg = tab;
+    if (!line_arg) {
+        report_error(false, "expected a file name and a line number but got: %s\n", query);
+        goto answer;
+    }
+    {
+        if (command && strcmp(command, "nav") != 0 && strcmp(command, "children") != 0) {
+            report_error(false, "unknown command ':%s'\n", command);
+            goto answer;
+        }
+        if (command && format_option != FORMAT_TEXT) {
+            report_error(false, "':%s' answers only in the text format\n", command);
+            goto answer;
+        }
+        *line_arg++ = 0;
+
+        char path[GIT_MAX_PATH];
+        if (!canonical_path(query, path, sizeof(path))) {
+            report_error(false, "could not find file '%s'\n", query);
+            goto answer;
+        }
+        WatchEntry *entry = watch_find_entry(state, path);
+        if (!entry) {
+            entry = watch_add_entry(state, path);
+            watch_load_entry(state, entry);
+        }
+        else if (!watch_covers_path(state, path) && file_stamp(path) != entry->stamp) {
+            watch_load_entry(state, entry);
+        }
+        if (!entry->valid) {
+            report_error(false, "could not read file '%s'\n", query);
+            goto answer;
+        }
+        if (state->compact)
+            entry->file.text = state->strings.pool.data; // see compact_parsed_file
+        if (!command && strstr(line_arg, "..")) {
+            // several lines, the empty line printed below ends the answer
+            uint32_t first_line, last_line;
+            if (resolve_range(&entry->file, line_arg, query, false /* fatal */, &first_line, &last_line))
+                print_line_range(&entry->file, first_line - 1, last_line);
+            goto answer;
+        }
+        uint32_t query_line;
+        if (!resolve_position(&entry->file, line_arg, query, false /* fatal */, &query_line))
+            goto answer;
+        if (!command) {
+            print_line_contexts(&entry->file, query_line - 1);
+            goto answer;
+        }
+        if (!entry->nav_valid) {
+            build_nav_index(&entry->nav, &entry->file);
+            entry->nav_valid = true;
+        }
+        if (strcmp(command, "nav") == 0)
+            print_nav_info(&entry->nav, &entry->file, query_line - 1);
+        else
+            print_nav_children(&entry->nav, &entry->file, query_line - 1);
+    }
+answer:
+    print_answer_end(true);
+    fflush(stdout);
+}
+
+static void run_watch_mode(const char *dir, bool compact)
+{
+    WatchState state = {};
+    state.compact = compact;
+    if (compact)
+        init_string_table(&state.strings);
+    if (!canonical_path(dir, state.root, sizeof(state.root)))
+        exit_error("could not find directory '%s'\n", dir);
+#if WATCH_INOTIFY
+    state.inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (state.inotify_fd < 0)
+        exit_clib_error("could not initialize inotify");
+    watch_directory_tree(&state, state.root);
+
+    // Note: We read stdin with read(2) rather than stdio so that poll(2) tells the truth
+    //       about whether more input is available.
+    ByteBuffer input = {};
+    size_t scan_start = 0;
+    bool at_eof = false;
+    while (!at_eof) {
+        struct pollfd fds[2];
+        fds[0].fd = state.inotify_fd;
+        fds[0].events = POLLIN;
+        fds[1].fd = 0;
+        fds[1].events = POLLIN;
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            exit_clib_error("poll failed");
+        }
+
+        // Handle change notifications first, so a query that arrives right after a save
+        // sees the new contents.
+        if (fds[0].revents & POLLIN) {
+            watch_read_events(&state);
+            watch_reparse_dirty_entries(&state);
+        }
+
+        if (fds[1].revents & (POLLIN | POLLHUP | POLLERR)) {
+            char chunk[4096];
+            ssize_t n_bytes = read(0, chunk, sizeof(chunk));
+            if (n_bytes < 0 && errno != EINTR && errno != EAGAIN)
+                exit_clib_error("could not read from stdin");
+            if (n_bytes == 0) {
+                at_eof = true;
+                buffer_append(&input, "\n", 1); // answer an unterminated last query
+            }
+            if (n_bytes > 0)
+                buffer_append(&input, chunk, (size_t)n_bytes);
+
+            size_t line_start = 0;
+            for (size_t i = scan_start; i < input.size; ++i) {
+                if (input.data[i] != '\n')
+                    continue;
+                input.data[i] = 0;
+                // events may have arrived while we were busy with earlier queries
+                watch_read_events(&state);
+                watch_reparse_dirty_entries(&state);
+                watch_answer_query(&state, input.data + line_start);
+                line_start = i + 1;
+            }
+            memmove(input.data, input.data + line_start, input.size - line_start);
+            input.size -= line_start;
+            scan_start = input.size;
+        }
+    }
+    free(input.data);
+#else
+    // XXX @Incomplete We could use ReadDirectoryChangesW on Windows. For now, no file is
+    //     covered (see watch_covers_path) and we check size and modification time for
+    //     each query instead.
+    char query[GIT_MAX_PATH + 32];
+    while (fgets(query, sizeof(query), stdin))
+        watch_answer_query(&state, query);
+#endif
+}
+
+// annotate mode (see --annotate)
+//
+// A filter that copies stdin to stdout and appends the whereami information to each line
+// that refers to a source location, e.g. output of `grep -n`, compiler diagnostics or
+// sanitizer stack traces. We recognize
+//
+//     <PATH>:<LINE>[:<COLUMN>]:...      at the start of the line (grep, compilers)
+//     ... <PATH>:<LINE>[:<COLUMN>]      at the end of the line (stack traces)
+//
+// where PATH contains no whitespace. Parsed files are kept in a small LRU cache, so
+// output that refers to the same files over and over does not parse them again.
+
+#define ANNOTATE_CACHE_SIZE 64
+#define ANNOTATE_CHUNK_SIZE 65536
+#define ANNOTATE_MAX_LINE (1 << 20) //< longer lines are passed through without annotation
+
+struct AnnotateCacheEntry {
+    char *path; //< nullptr for an unused entry
+    uint64_t path_hash;
+    uint64_t last_used;
+    bool valid; //< false if the file could not be read (we remember that, too)
+    ParsedFile file;
+};
+
+struct AnnotateCache {
+    AnnotateCacheEntry entries[ANNOTATE_CACHE_SIZE];
+    uint64_t clock;
+};
+
+// Return the parsed file for the given path (which need not be NUL-terminated) or
+// nullptr if it cannot be read.
+static ParsedFile *annotate_get_file(AnnotateCache *cache, const char *path, size_t path_len)
+{
+    char filename[GIT_MAX_PATH];
+    if (path_len >= sizeof(filename))
+        return nullptr;
+    memcpy(filename, path, path_len);
+    filename[path_len] = 0;
+    uint64_t path_hash = hash_string(filename, 0);
+
+    AnnotateCacheEntry *victim = cache->entries;
+    for (uint32_t i = 0; i < ANNOTATE_CACHE_SIZE; ++i) {
+        AnnotateCacheEntry *entry = cache->entries + i;
+        if (entry->path && entry->path_hash == path_hash && strcmp(entry->path, filename) == 0) {
+            entry->last_used = ++cache->clock;
+            return entry->valid ? &entry->file : nullptr;
+        }
+        if (!entry->path || (victim->path && entry->last_used < victim->last_used))
+            victim = entry;
+    }
+
+    if (victim->path) {
+        if (victim->valid)
+            free_parsed_file(&victim->file);
+        free(victim->path);
+    }
+    victim->path = (char *)malloc(path_len + 1);
+    if (!victim->path)
+        exit_error("Out-of-memory copying a path.\n");
+    memcpy(victim->path, filename, path_len + 1);
+    victim->path_hash = path_hash;
+    victim->last_used = ++cache->clock;
+
+    // Note: Most things that look like a path in arbitrary text are not files, so do not
+    //       complain about missing ones.
+    uint32_t text_size;
+    char *text = nullptr;
+    FILE *probe;
+    #pragma warning (suppress : 4996) // gimme fopen
+    if ((probe = fopen(filename, "rb")) != nullptr) {
+        fclose(probe);
+        text = read_file(filename, &text_size, false /* fatal */);
+    }
+    victim->valid = text != nullptr;
+    if (victim->valid)
+        parse_text(&victim->file, text, text_size, filename);
+    return victim->valid ? &victim->file : nullptr;
+}
+
+// If `ptr` points to "<digits>[:<digits>]", return the first number and set *end to the
+// first character after the match, otherwise return 0.
+static uint32_t parse_location_numbers(const char *ptr, const char *limit, const char **end)
+{
+    uint32_t number = 0;
+    const char *start = ptr;
+    while (ptr < limit && isdigit((unsigned char)*ptr) && number < UINT32_MAX / 10)
+        number = 10 * number + (uint32_t)(*ptr++ - '0');
+    if (ptr == start)
+        return 0;
+    if (ptr + 1 < limit && ptr[0] == ':' && isdigit((unsigned char)ptr[1])) {
+        ptr++;
+        while (ptr < limit && isdigit((unsigned char)*ptr))
+            ptr++;
+    }
+    *end = ptr;
+    return number;
+}
+
+// Find the end of a path starting at `ptr`: the ':' before the line number.
+// (A drive letter like "C:" is not taken for that ':'.)
+static const char *find_location_path_end(const char *ptr, const char *limit)
+{
+    const char *colon_search = ptr;
+    if (limit - ptr > 2 && isalpha((unsigned char)ptr[0]) && ptr[1] == ':' && (ptr[2] == '\\' || ptr[2] == '/'))
+        colon_search += 2;
+    for (const char *p = colon_search; p < limit; ++p) {
+        if (*p == ':')
+            return p;
+        if (isspace((unsigned char)*p))
+            return nullptr;
+    }
+    return nullptr;
+}
+
+// Copy one line (without its '\n') to stdout and append the whereami information if it
+// refers to a source location.
+static void annotate_line(AnnotateCache *cache, const char *line_text, size_t len)
+{
+    const char *limit = line_text + len;
+    if (len && limit[-1] == '\r')
+        limit--;
+    fwrite(line_text, 1, limit - line_text, stdout);
+
+    const char *path = nullptr;
+    const char *path_end = nullptr;
+    uint32_t query_line = 0;
+    const char *location_end = nullptr;
+
+    // "<PATH>:<LINE>[:<COLUMN>]:" at the start of the line
+    path_end = find_location_path_end(line_text, limit);
+    if (path_end && path_end > line_text) {
+        query_line = parse_location_numbers(path_end + 1, limit, &location_end);
+        if (query_line && location_end < limit && *location_end == ':')
+            path = line_text;
+    }
+
+    // "<PATH>:<LINE>[:<COLUMN>]" as the last word of the line
+    if (!path) {
+        const char *word = limit;
+        while (word > line_text && !isspace((unsigned char)word[-1]))
+            word--;
+        if (word > line_text && word < limit) {
+            path_end = find_location_path_end(word, limit);
+            if (path_end && path_end > word) {
+                query_line = parse_location_numbers(path_end + 1, limit, &location_end);
+                if (query_line && location_end == limit)
+                    path = word;
+            }
+        }
+    }
+
+    if (path) {
+        ParsedFile *file = annotate_get_file(cache, path, (size_t)(path_end - path));
+        if (file && query_line <= file->n_lines && file->line_info_array[query_line - 1].outer_index >= 0) {
+            putc('\t', stdout);
+            print_line_contexts(file, query_line - 1);
+        }
+    }
+    fwrite(limit, 1, line_text + len - limit, stdout); // keep a '\r' where it was
+}
+
+// Read up to `size` bytes from stdin, returning as soon as some input is available.
+// Returns 0 at end of input.
+static size_t read_stdin_chunk(char *buffer, size_t size)
+{
+#if defined(WIN32) || HAVE_POSIX
+    for (;;) {
+#ifdef WIN32
+        int n_bytes = _read(0, buffer, (unsigned)size);
+#else
+        ssize_t n_bytes = read(0, buffer, size);
+#endif
+        if (n_bytes >= 0)
+            return (size_t)n_bytes;
+        if (errno != EINTR)
+            exit_clib_error("could not read from stdin");
+    }
+#else
+    // standard C cannot tell what is available, so we read up to the end of a line
+    size_t n_bytes = 0;
+    int ch;
+    while (n_bytes < size && (ch = getchar()) != EOF) {
+        buffer[n_bytes++] = (char)ch;
+        if (ch == '\n')
+            break;
+    }
+    if (ferror(stdin))
+        exit_clib_error("could not read from stdin");
+    return n_bytes;
+#endif
+}
+
+static void run_annotate_mode()
+{
+    AnnotateCache *cache = (AnnotateCache *)calloc(1, sizeof(AnnotateCache));
+    if (!cache)
+        exit_error("Out-of-memory allocating file cache.\n");
+    ByteBuffer input = {};
+    bool passing_through_long_line = false;
+    char chunk[ANNOTATE_CHUNK_SIZE];
+    for (;;) {
+        // Flush before we may block, so the output keeps up with the input.
+        fflush(stdout);
+        size_t n_bytes = read_stdin_chunk(chunk, sizeof(chunk));
+        if (n_bytes == 0)
+            break;
+        buffer_append(&input, chunk, n_bytes);
+
+        size_t line_start = 0;
+        for (;;) {
+            char *newline = (char *)memchr(input.data + line_start, '\n', input.size - line_start);
+            if (!newline)
+                break;
+            size_t len = (size_t)(newline - (input.data + line_start));
+            if (passing_through_long_line) {
+                fwrite(input.data + line_start, 1, len + 1, stdout);
+                passing_through_long_line = false;
+            }
+            else {
+                annotate_line(cache, input.data + line_start, len);
+                putc('\n', stdout);
+            }
+            line_start += len + 1;
+        }
+        if (input.size - line_start > ANNOTATE_MAX_LINE) {
+            fwrite(input.data + line_start, 1, input.size - line_start, stdout);
+            line_start = input.size;
+            passing_through_long_line = true;
+        }
+        memmove(input.data, input.data + line_start, input.size - line_start);
+        input.size -= line_start;
+    }
+    if (input.size) {
+        // last line without a newline
+        if (passing_through_long_line)
+            fwrite(input.data, 1, input.size, stdout);
+        else
+            annotate_line(cache, input.data, input.size);
+    }
+    fflush(stdout);
+
+    for (uint32_t i = 0; i < ANNOTATE_CACHE_SIZE; ++i) {
+        AnnotateCacheEntry *entry = cache->entries + i;
+        if (entry->path && entry->valid)
+            free_parsed_file(&entry->file);
+        free(entry->path);
+    }
+    free(cache);
+    free(input.data);
+}
+
+// search mode (see --search)
+//
+// Print the lines of the given files that contain a pattern like `grep -n` does, with
+// the whereami information appended as by --annotate, but in one pass over each file
+// instead of two tools. One pattern is found with a SIMD substring search, several with
+// an Aho-Corasick automaton. The search runs over the raw bytes, counting newlines as it
+// goes, so only files with matches are parsed at all.
+
+struct AhoCorasick {
+    uint32_t *next; //< next[state * 256 + byte]: the complete transition function
+    bool *accepting; //< some pattern ends in the state (possibly as a suffix)
+    uint32_t n_states;
+};
+
+static void build_aho_corasick(AhoCorasick *automaton, char **patterns, uint32_t n_patterns)
+{
+    size_t capacity = 1;
+    for (uint32_t i = 0; i < n_patterns; ++i)
+        capacity += strlen(patterns[i]);
+    if (capacity > UINT32_MAX / 256)
+        exit_error("search patterns are too long\n");
+    uint32_t *next = (uint32_t *)calloc(capacity * 256, sizeof(uint32_t));
+    bool *accepting = (bool *)calloc(capacity, sizeof(bool));
+    uint32_t *fail = (uint32_t *)malloc(capacity * sizeof(uint32_t));
+    uint32_t *queue = (uint32_t *)malloc(capacity * sizeof(uint32_t));
+    if (!next || !accepting || !fail || !queue)
+        exit_error("Out-of-memory allocating search automaton.\n");
+
+    // the trie of the patterns (0 marks a missing edge as no edge leads back to the root)
+    uint32_t n_states = 1;
+    for (uint32_t i = 0; i < n_patterns; ++i) {
+        uint32_t state = 0;
+        for (const char *ptr = patterns[i]; *ptr; ++ptr) {
+            uint32_t *edge = next + (size_t)state * 256 + (uint8_t)*ptr;
+            if (!*edge)
+                *edge = n_states++;
+            state = *edge;
+        }
+        accepting[state] = true;
+    }
+
+    // Breadth-first, so the fail state (the longest proper suffix that is in the trie)
+    // of each state is complete when we get to it: missing edges follow the fail state.
+    uint32_t head = 0, tail = 0;
+    for (uint32_t byte = 0; byte < 256; ++byte) {
+        if (next[byte]) {
+            fail[next[byte]] = 0;
+            queue[tail++] = next[byte];
+        }
+    }
+    while (head < tail) {
+        uint32_t state = queue[head++];
+        accepting[state] = accepting[state] || accepting[fail[state]];
+        uint32_t *edges = next + (size_t)state * 256;
+        const uint32_t *fail_edges = next + (size_t)fail[state] * 256;
+        for (uint32_t byte = 0; byte < 256; ++byte) {
+            if (edges[byte]) {
+                fail[edges[byte]] = fail_edges[byte];
+                queue[tail++] = edges[byte];
+            }
+            else
+                edges[byte] = fail_edges[byte];
+        }
+    }
+    free(queue);
+    free(fail);
+    automaton->next = next;
+    automaton->accepting = accepting;
+    automaton->n_states = n_states;
+}
+
+// Return a pointer to the last byte of the first match in [ptr, end) or nullptr.
+static const char *aho_corasick_find(AhoCorasick *automaton, const char *ptr, const char *end)
+{
+    uint32_t state = 0;
+    for (; ptr < end; ++ptr) {
+        state = automaton->next[(size_t)state * 256 + (uint8_t)*ptr];
+        if (automaton->accepting[state])
+            return ptr;
+    }
+    return nullptr;
+}
+
+// Return a pointer to the first occurrence of the pattern in [ptr, end) or nullptr.
+static const char *find_substring(const char *ptr, const char *end, const char *pattern, size_t len)
+{
+#if HAVE_SSE2
+    // Compare 16 positions at a time against the first and the last byte of the pattern
+    // and only look closer where both match.
+    const __m128i first = _mm_set1_epi8(pattern[0]);
+    const __m128i last = _mm_set1_epi8(pattern[len - 1]);
+    for (; (size_t)(end - ptr) >= len - 1 + 16; ptr += 16) {
+        __m128i block_first = _mm_loadu_si128((const __m128i *)ptr);
+        __m128i block_last = _mm_loadu_si128((const __m128i *)(ptr + len - 1));
+        uint32_t mask = (uint32_t)_mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(block_first, first),
+                                                                  _mm_cmpeq_epi8(block_last, last)));
+        for (; mask; mask &= mask - 1) {
+            const char *candidate = ptr + count_trailing_zeros(mask);
+            if (memcmp(candidate, pattern, len) == 0)
+                return candidate;
+        }
+    }
+#endif
+    while ((size_t)(end - ptr) >= len) {
+        ptr = (const char *)memchr(ptr, pattern[0], (size_t)(end - ptr) - len + 1);
+        if (!ptr)
+            return nullptr;
+        if (memcmp(ptr, pattern, len) == 0)
+            return ptr;
+        ptr++;
+    }
+    return nullptr;
+}
+
+struct SearchPatterns {
+    char **patterns;
+    uint32_t n_patterns;
+    size_t len; //< length of the single pattern
+    AhoCorasick automaton; //< if there are several patterns
+};
+
+struct SearchMatch {
+    uint32_t index; //< line index
+    uint32_t line_offset; //< offset of the beginning of the line
+};
+
+// Find the lines of `text` that contain a pattern and append a SearchMatch for each to
+// `matches` (only the first if `first_only`).
+static void search_text(SearchPatterns *search, const char *text, uint32_t text_size, bool first_only, ByteBuffer *matches)
+{
+    const char *end = text + text_size;
+    const char *ptr = text; // where to continue searching
+    const char *counted = text; // newlines up to here are in `index`
+    uint32_t index = 0;
+    while (ptr < end) {
+        const char *match = (search->n_patterns == 1) ? find_substring(ptr, end, search->patterns[0], search->len)
+                                                      : aho_corasick_find(&search->automaton, ptr, end);
+        if (!match)
+            break;
+        index += count_newlines(counted, (size_t)(match - counted));
+        counted = match;
+        const char *line_start = match;
+        while (line_start > text && line_start[-1] != '\n')
+            line_start--;
+        SearchMatch found;
+        found.index = index;
+        found.line_offset = (uint32_t)(line_start - text);
+        buffer_append(matches, &found, sizeof(found));
+        if (first_only)
+            break;
+        // one match per line is enough
+        const char *newline = (const char *)memchr(match, '\n', (size_t)(end - match));
+        if (!newline)
+            break;
+        ptr = counted = newline + 1;
+        index++;
+    }
+}
+
+// Search each file and print "<PATH>:<LINE>:<text>" for each matching line, followed
+// by a TAB and the whereami information if there is any. Returns the number of matches.
+static uint64_t run_search(SearchPatterns *search, FileList *list, bool first_only)
+{
+    if (search->n_patterns == 1)
+        search->len = strlen(search->patterns[0]);
+    else
+        build_aho_corasick(&search->automaton, search->patterns, search->n_patterns);
+
+    uint64_t n_matches = 0;
+    ByteBuffer matches = {};
+    for (uint32_t i = 0; i < list->n_names; ++i) {
+        const char *filename = list->names[i];
+        uint32_t text_size;
+        char *text = read_file(filename, &text_size, false /* fatal */);
+        if (!text)
+            continue;
+        matches.size = 0;
+        search_text(search, text, text_size, first_only, &matches);
+        if (!matches.size) {
+            free(text);
+            continue;
+        }
+        ParsedFile file;
+        parse_text(&file, text, text_size, filename);
+        SearchMatch *match_array = (SearchMatch *)matches.data;
+        uint32_t n_file_matches = (uint32_t)(matches.size / sizeof(SearchMatch));
+        for (uint32_t i_match = 0; i_match < n_file_matches; ++i_match) {
+            SearchMatch *match = match_array + i_match;
+            // Note: After parsing, lines end with NUL, except after a NUL byte in the file.
+            const char *line_text = file.text + match->line_offset;
+            size_t len = strcspn(line_text, "\n");
+            if (len && line_text[len - 1] == '\r')
+                len--;
+            printf("%s:%u:", filename, match->index + 1);
+            fwrite(line_text, 1, len, stdout);
+            if (match->index < file.n_lines && file.line_info_array[match->index].outer_index >= 0) {
+                putc('\t', stdout);
+                print_line_contexts(&file, match->index);
+            }
+            putc('\n', stdout);
+        }
+        n_matches += n_file_matches;
+        free_parsed_file(&file);
+    }
+    free(matches.data);
+    if (search->n_patterns > 1) {
+        free(search->automaton.next);
+        free(search->automaton.accepting);
+    }
+    return n_matches;
+}
+
+// pager (see --pager)
+//
+// A terminal viewer for files too big for editors, which shows the whereami information
+// of the top line of the window pinned above the text. The file is mapped, not read, and
+// only parsed around the window: a line that starts in column 0 and may close contexts
+// brings the parser back to the top level, so we can start parsing at such an "anchor"
+// line with a fresh state. The parsed region reaches from an anchor to a little below the
+// top line. Scrolling down extends it (resuming the parse at its checkpoint, see
+// parse_text), and when the window leaves it we find a new anchor. Jumping to the end of
+// a multi-GB file therefore parses only a few screens.
+// Line numbers are counted from the nearest known one; if that is too far away, we show
+// positions as "@<OFFSET>" (as accepted by queries) until the user asks for a count.
+// Note: A line starting in column 0 inside a multi-line comment or string can be taken
+//       for an anchor. The information shown is then that of a parse starting there.
+
+#define PAGER_MAX_ANCHOR_DISTANCE (16u << 20) //< look back at most this far for an anchor line
+#define PAGER_MAX_REGION_SIZE (64u << 20) //< find a new anchor instead of extending the region beyond this
+#define PAGER_MAX_COUNT_DISTANCE (64u << 20) //< count lines over at most this many bytes without being asked
+#define PAGER_MAX_LOOKAHEAD (1u << 20) //< parse at most this far below the top line in advance
+#define PAGER_TABSIZE 8
+
+enum PagerKey {
+    PAGER_KEY_NONE,
+    PAGER_KEY_QUIT,
+    PAGER_KEY_LINE_DOWN,
+    PAGER_KEY_LINE_UP,
+    PAGER_KEY_PAGE_DOWN,
+    PAGER_KEY_PAGE_UP,
+    PAGER_KEY_HOME,
+    PAGER_KEY_END,
+    PAGER_KEY_COUNT_LINES,
+};
+
+struct Pager {
+    const char *filename;
+    const char *data; //< the mapped file
+    uint64_t size;
+    uint64_t top; //< offset of the first line in the window
+    uint32_t rows; //< size of the terminal
+    uint32_t columns;
+    bool region_valid;
+    uint64_t region_start; //< offset of the anchor line of the parsed region
+    uint64_t region_end; //< end of the parsed region (at a line boundary)
+    ParsedFile region;
+    uint64_t known_offset; //< start of a line whose line number we know
+    uint64_t known_line;
+    bool count_lines; //< count lines however far away the known line is
+    ByteBuffer screen;
+};
+
+// Return the start of the line containing the given offset.
+static uint64_t pager_line_start(Pager *pager, uint64_t offset)
+{
+    while (offset > 0 && pager->data[offset - 1] != '\n')
+        offset--;
+    return offset;
+}
+
+// Return the start of the line after the one starting at `offset` (the size of the file
+// if there is none).
+static uint64_t pager_next_line(Pager *pager, uint64_t offset)
+{
+    const char *newline = (const char *)memchr(pager->data + offset, '\n', pager->size - offset);
+    return newline ? (uint64_t)(newline + 1 - pager->data) : pager->size;
+}
+
+static uint64_t pager_prev_line(Pager *pager, uint64_t offset)
+{
+    return (offset > 0) ? pager_line_start(pager, offset - 1) : 0;
+}
+
+// Number of text rows in the window (the first row shows the context, the last one the status).
+static uint32_t pager_text_rows(Pager *pager)
+{
+    return (pager->rows > 3) ? pager->rows - 2 : 1;
+}
+
+// The largest top offset, which shows the last line of the file at the bottom of the window.
+static uint64_t pager_max_top(Pager *pager)
+{
+    if (pager->size == 0)
+        return 0;
+    uint64_t offset = pager_line_start(pager, (pager->data[pager->size - 1] == '\n') ? pager->size - 1 : pager->size);
+    for (uint32_t i = 1; i < pager_text_rows(pager) && offset > 0; ++i)
+        offset = pager_prev_line(pager, offset);
+    return offset;
+}
+
+// Whether parsing can start at the line beginning at `ptr` (in text ending at `end`) with
+// a fresh parser state: it starts in column 0 and closes all contexts (so it is no
+// preprocessor line, comment, label or case label). Also used for PLAN_WINDOW.
+static bool is_anchor_line(const char *ptr, const char *end)
+{
+    if (ptr < end && *ptr == '}')
+        return true;
+    if (ptr == end || !(isalpha((unsigned char)*ptr) || *ptr == '_'))
+        return false;
+    if (end - ptr > 4 && memcmp(ptr, "case", 4) == 0 && isspace((unsigned char)ptr[4]))
+        return false;
+    while (ptr < end && is_identifier_char(*ptr))
+        ptr++;
+    while (ptr < end && (*ptr == ' ' || *ptr == '\t'))
+        ptr++;
+    return !(ptr < end && *ptr == ':' && (ptr + 1 == end || ptr[1] != ':'));
+}
+
+static uint64_t pager_find_anchor(Pager *pager, uint64_t offset)
+{
+    uint64_t limit = (offset > PAGER_MAX_ANCHOR_DISTANCE) ? offset - PAGER_MAX_ANCHOR_DISTANCE : 0;
+    while (offset > limit && !is_anchor_line(pager->data + offset, pager->data + pager->size))
+        offset = pager_prev_line(pager, offset);
+    return offset;
+}
+
+// Make sure the parsed region contains the top line.
+static void pager_parse_region(Pager *pager)
+{
+    uint64_t need_end = pager_next_line(pager, pager->top);
+    if (pager->region_valid && pager->region_start <= pager->top && need_end <= pager->region_end)
+        return;
+    // parse a screen ahead, so scrolling down does not extend the region for every line
+    for (uint32_t i = 0; i < pager->rows && need_end < pager->size && need_end - pager->top < PAGER_MAX_LOOKAHEAD; ++i)
+        need_end = pager_next_line(pager, need_end);
+
+    bool extend = pager->region_valid && pager->region_start <= pager->top &&
+                  need_end - pager->region_start <= PAGER_MAX_REGION_SIZE;
+    uint64_t start = extend ? pager->region_start : pager_find_anchor(pager, pager->top);
+    if (need_end - start > UINT32_MAX - 2)
+        exit_error("a line of more than %u bytes is not supported\n", UINT32_MAX - 2);
+    uint32_t size = (uint32_t)(need_end - start);
+    char *text = (char *)malloc((size_t)size + 2); // see read_file
+    if (!text)
+        exit_error("Out-of-memory allocating buffer for file text (size = %u)\n", size);
+    memcpy(text, pager->data + start, size);
+    text[size] = 0;
+    ParsedFile region;
+    // Note: Without a checkpoint (e.g. if the region ends in a comment), the region is
+    //       parsed again from its anchor.
+    bool resume = extend && pager->region.checkpoint.text_offset > 0;
+    parse_text(&region, text, size, pager->filename, resume ? &pager->region : nullptr);
+    if (pager->region_valid)
+        free_parsed_file(&pager->region);
+    pager->region = region;
+    pager->region_valid = true;
+    pager->region_start = start;
+    pager->region_end = need_end;
+}
+
+// Return the line number of the line starting at `offset`, or 0 if it is unknown.
+static uint64_t pager_line_number(Pager *pager, uint64_t offset)
+{
+    uint64_t from = pager->known_offset;
+    uint64_t distance = (offset > from) ? offset - from : from - offset;
+    if (offset < distance) { // the beginning of the file is closer
+        from = 0;
+        pager->known_offset = 0;
+        pager->known_line = 1;
+        distance = offset;
+    }
+    if (distance > PAGER_MAX_COUNT_DISTANCE && !pager->count_lines)
+        return 0;
+    uint64_t low = (offset < from) ? offset : from;
+    uint64_t n_newlines = 0;
+    for (uint64_t done = 0; done < distance; ) {
+        size_t chunk = (distance - done < (1u << 30)) ? (size_t)(distance - done) : (1u << 30);
+        n_newlines += count_newlines(pager->data + low + done, chunk);
+        done += chunk;
+    }
+    pager->known_line = (offset < from) ? pager->known_line - n_newlines : pager->known_line + n_newlines;
+    pager->known_offset = offset;
+    return pager->known_line;
+}
+
+// Append the line from `ptr` to `end` (or up to a newline) to the screen, with TABs
+// expanded and control characters replaced, cut at the width of the terminal.
+static void pager_append_text(Pager *pager, const char *ptr, const char *end)
+{
+    uint32_t column = 0;
+    for (; ptr < end && *ptr != '\n' && column < pager->columns; ++ptr) {
+        unsigned char ch = (unsigned char)*ptr;
+        if (ch == '\t') {
+            uint32_t next = PAGER_TABSIZE * (column / PAGER_TABSIZE + 1);
+            for (; column < next && column < pager->columns; ++column)
+                buffer_append(&pager->screen, " ", 1);
+            continue;
+        }
+        if (ch == '\r' && (ptr + 1 == end || ptr[1] == '\n'))
+            continue;
+        if (ch < 0x20 || ch == 0x7f)
+            ch = '?';
+        buffer_append(&pager->screen, &ch, 1);
+        if ((ch & 0xc0) != 0x80) // UTF-8 continuation bytes take no column
+            column++;
+    }
+}
+
+// Format the position of the line starting at `offset` as "<LINE>" or, if the line number
+// is unknown, as "@<OFFSET>".
+static void pager_format_position(Pager *pager, uint64_t offset, char *buffer, size_t size)
+{
+    uint64_t line_number = pager_line_number(pager, offset);
+    if (line_number)
+        snprintf(buffer, size, "%" PRIu64, line_number);
+    else
+        snprintf(buffer, size, "@%" PRIu64, offset);
+}
+
+static void pager_draw(Pager *pager)
+{
+    ByteBuffer *screen = &pager->screen;
+    screen->size = 0;
+    buffer_append(screen, "\033[H\033[7m", 7); // home, reverse video
+
+    // the contexts of the top line, outermost first
+    ParsedFile *region = &pager->region;
+    uint32_t top_offset = (uint32_t)(pager->top - pager->region_start);
+    ByteBuffer info = {};
+    if (top_offset < parsed_text_size(region)) { // not after a NUL byte
+        uint32_t top_index = line_index_of_offset(region, top_offset);
+        ByteBuffer scopes = {};
+        for (int32_t scope = enclosing_scope(region, (int32_t)top_index); scope >= 0; scope = enclosing_scope(region, scope))
+            buffer_append(&scopes, &scope, sizeof(scope));
+        for (uint32_t i = (uint32_t)(scopes.size / sizeof(int32_t)); i > 0; --i) {
+            Context ctx;
+            ctx.index = ((int32_t *)scopes.data)[i - 1];
+            ctx.text = region->text + region->line_info_array[ctx.index].start_offset;
+            ctx.language = region->language;
+            char position[32];
+            pager_format_position(pager, pager->region_start + get_line_starts(region)[ctx.index],
+                                  position, sizeof(position));
+            buffer_append(&info, "..", 2);
+            buffer_append(&info, position, strlen(position));
+            buffer_append(&info, ": ", 2);
+            render_context(&ctx, &info);
+        }
+        free(scopes.data);
+    }
+    pager_append_text(pager, info.data, info.data + info.size);
+    free(info.data);
+    buffer_append(screen, "\033[K\033[m\r\n", 8);
+
+    uint64_t offset = pager->top;
+    uint32_t text_rows = pager_text_rows(pager);
+    for (uint32_t row = 0; row < text_rows; ++row) {
+        if (offset < pager->size) {
+            pager_append_text(pager, pager->data + offset, pager->data + pager->size);
+            offset = pager_next_line(pager, offset);
+        }
+        else
+            buffer_append(screen, "~", 1);
+        buffer_append(screen, "\033[K\r\n", 5);
+    }
+
+    char status[256];
+    char position[32];
+    pager_format_position(pager, pager->top, position, sizeof(position));
+    snprintf(status, sizeof(status), "%s  line %s  %u%%  (q quit, j/k line, space/b page, g/G start/end%s)",
+             pager->filename, position, pager->size ? (uint32_t)(100 * offset / pager->size) : 100,
+             (position[0] == '@') ? ", = count lines" : "");
+    buffer_append(screen, "\033[7m", 4);
+    pager_append_text(pager, status, status + strlen(status));
+    buffer_append(screen, "\033[K\033[m", 6);
+    fwrite(screen->data, 1, screen->size, stdout);
+    fflush(stdout);
+}
+
+#ifdef WIN32
+static DWORD pager_saved_console_mode;
+#elif HAVE_POSIX
+static struct termios pager_saved_termios;
+#endif
+static bool pager_terminal_is_set_up;
+
+static void pager_restore_terminal()
+{
+    if (!pager_terminal_is_set_up)
+        return;
+    pager_terminal_is_set_up = false;
+    fputs("\033[?25h\033[?1049l", stdout); // show the cursor, leave the alternate screen
+    fflush(stdout);
+#ifdef WIN32
+    ::SetConsoleMode(::GetStdHandle(STD_OUTPUT_HANDLE), pager_saved_console_mode);
+#elif HAVE_POSIX
+    tcsetattr(0, TCSAFLUSH, &pager_saved_termios);
+#endif
+}
+
+static void pager_setup_terminal()
+{
+#ifdef WIN32
+    HANDLE output = ::GetStdHandle(STD_OUTPUT_HANDLE);
+    if (!_isatty(0) || !::GetConsoleMode(output, &pager_saved_console_mode))
+        exit_error("--pager needs a terminal\n");
+    if (!::SetConsoleMode(output, pager_saved_console_mode | 0x0004 /* ENABLE_VIRTUAL_TERMINAL_PROCESSING */))
+        exit_windows_system_error("could not enable escape sequences for the console");
+#elif HAVE_POSIX
+    if (!isatty(0) || !isatty(1))
+        exit_error("--pager needs a terminal\n");
+    if (tcgetattr(0, &pager_saved_termios) != 0)
+        exit_clib_error("could not get the terminal attributes");
+    struct termios raw = pager_saved_termios;
+    raw.c_lflag &= ~(ICANON | ECHO | ISIG);
+    raw.c_cc[VMIN] = 1;
+    raw.c_cc[VTIME] = 0;
+    if (tcsetattr(0, TCSAFLUSH, &raw) != 0)
+        exit_clib_error("could not set the terminal attributes");
+#else
+    exit_error("--pager is not supported on this platform\n"); // also rejected in main
+#endif
+    pager_terminal_is_set_up = true;
+    atexit(pager_restore_terminal);
+    fputs("\033[?1049h\033[?25l", stdout); // enter the alternate screen, hide the cursor
+}
+
+static void pager_get_terminal_size(Pager *pager)
+{
+    pager->rows = 24;
+    pager->columns = 80;
+#ifdef WIN32
+    CONSOLE_SCREEN_BUFFER_INFO info;
+    if (::GetConsoleScreenBufferInfo(::GetStdHandle(STD_OUTPUT_HANDLE), &info)) {
+        pager->rows = (uint32_t)(info.srWindow.Bottom - info.srWindow.Top + 1);
+        pager->columns = (uint32_t)(info.srWindow.Right - info.srWindow.Left + 1);
+    }
+#elif HAVE_POSIX
+    struct winsize size;
+    if (ioctl(1, TIOCGWINSZ, &size) == 0 && size.ws_row && size.ws_col) {
+        pager->rows = size.ws_row;
+        pager->columns = size.ws_col;
+    }
+#endif
+}
+
+static PagerKey pager_read_key()
+{
+#ifdef WIN32
+    int ch = _getch();
+    if (ch == 0 || ch == 0xe0) {
+        switch (_getch()) {
+            case 72: return PAGER_KEY_LINE_UP;
+            case 80: return PAGER_KEY_LINE_DOWN;
+            case 73: return PAGER_KEY_PAGE_UP;
+            case 81: return PAGER_KEY_PAGE_DOWN;
+            case 71: return PAGER_KEY_HOME;
+            case 79: return PAGER_KEY_END;
+        }
+        return PAGER_KEY_NONE;
+    }
+    char keys[2] = { (char)ch, 0 };
+    int n_bytes = 1;
+#elif HAVE_POSIX
+    char keys[8];
+    ssize_t n_bytes;
+    do {
+        n_bytes = read(0, keys, sizeof(keys) - 1);
+    } while (n_bytes < 0 && errno == EINTR);
+    if (n_bytes <= 0)
+        return PAGER_KEY_QUIT;
+    keys[n_bytes] = 0;
+    if (keys[0] == '\033') {
+        // ANSI sequences of the cursor keys
+        if (strcmp(keys, "\033[A") == 0 || strcmp(keys, "\033OA") == 0) return PAGER_KEY_LINE_UP;
+        if (strcmp(keys, "\033[B") == 0 || strcmp(keys, "\033OB") == 0) return PAGER_KEY_LINE_DOWN;
+        if (strcmp(keys, "\033[5~") == 0) return PAGER_KEY_PAGE_UP;
+        if (strcmp(keys, "\033[6~") == 0) return PAGER_KEY_PAGE_DOWN;
+        if (strcmp(keys, "\033[H") == 0 || strcmp(keys, "\033[1~") == 0 || strcmp(keys, "\033OH") == 0) return PAGER_KEY_HOME;
+        if (strcmp(keys, "\033[F") == 0 || strcmp(keys, "\033[4~") == 0 || strcmp(keys, "\033OF") == 0) return PAGER_KEY_END;
+        return PAGER_KEY_NONE;
+    }
+#else
+    int ch = getchar();
+    if (ch == EOF)
+        return PAGER_KEY_QUIT;
+    char keys[2] = { (char)ch, 0 };
+    int n_bytes = 1;
+#endif
+    if (n_bytes != 1)
+        return PAGER_KEY_NONE;
+    switch (keys[0]) {
+        case 'q': case 'Q': case 3 /* Ctrl-C */: return PAGER_KEY_QUIT;
+        case 'j': case '\r': case '\n': return PAGER_KEY_LINE_DOWN;
+        case 'k': return PAGER_KEY_LINE_UP;
+        case ' ': case 'f': return PAGER_KEY_PAGE_DOWN;
+        case 'b': return PAGER_KEY_PAGE_UP;
+        case 'g': case '<': return PAGER_KEY_HOME;
+        case 'G': case '>': return PAGER_KEY_END;
+        case '=': return PAGER_KEY_COUNT_LINES;
+    }
+    return PAGER_KEY_NONE;
+}
+
+static void run_pager(const char *filename)
+{
+    MappedFile mapped;
+    map_file(filename, &mapped, true /* fatal */);
+    Pager pager = {};
+    pager.filename = filename;
+    pager.data = (const char *)mapped.data;
+    pager.size = mapped.size;
+    pager.known_line = 1;
+    if (!pager.size)
+        pager.data = ""; // nothing mapped
+
+    pager_setup_terminal();
+    for (;;) {
+        pager_get_terminal_size(&pager);
+        pager_parse_region(&pager);
+        pager_draw(&pager);
+
+        PagerKey key = pager_read_key();
+        if (key == PAGER_KEY_QUIT)
+            break;
+        uint32_t n_lines = 0;
+        switch (key) {
+            case PAGER_KEY_LINE_DOWN: n_lines = 1; break;
+            case PAGER_KEY_PAGE_DOWN: n_lines = pager_text_rows(&pager); break;
+            case PAGER_KEY_LINE_UP:
+                pager.top = pager_prev_line(&pager, pager.top);
+                break;
+            case PAGER_KEY_PAGE_UP:
+                for (uint32_t i = 0; i < pager_text_rows(&pager); ++i)
+                    pager.top = pager_prev_line(&pager, pager.top);
+                break;
+            case PAGER_KEY_HOME: pager.top = 0; break;
+            case PAGER_KEY_END: pager.top = pager_max_top(&pager); break;
+            case PAGER_KEY_COUNT_LINES: pager.count_lines = true; break;
+            default: break;
+        }
+        if (n_lines) {
+            uint64_t max_top = pager_max_top(&pager);
+            for (uint32_t i = 0; i < n_lines && pager.top < max_top; ++i)
+                pager.top = pager_next_line(&pager, pager.top);
+        }
+    }
+    pager_restore_terminal();
+
+    if (pager.region_valid)
+        free_parsed_file(&pager.region);
+    free(pager.screen.data);
+    unmap_file(&mapped);
+}
+
+// aggregate mode (see --aggregate)
+//
+// Read weighted source locations from stdin, one per line,
+//
+//     <PATH>:<LINE>[:<COLUMN>] [<WEIGHT>]
+//
+// (e.g. profiler samples resolved by addr2line, or line coverage counts) and sum the
+// weights per scope: inclusively (everything inside the scope) and exclusively (lines
+// whose innermost scope it is). Scopes are the context lines that whereami would report,
+// including the ones close to the line. A missing weight counts as 1.
+//
+// We first sum the weights per distinct line, so each file is parsed and each chain of
+// scopes is walked only once, no matter how many records refer to it.
+
+struct AggregateFile {
+    char *path;
+    ParsedFile file;
+    bool valid; //< false if the file could not be read
+};
+
+struct AggregateLine {
+    uint32_t i_file;
+    uint32_t index; //< line number - 1
+    uint32_t n_records;
+    double weight;
+};
+
+struct AggregateScope {
+    uint32_t i_file;
+    uint32_t index; //< line number - 1 of the scope header, UINT32_MAX for the file itself
+    uint32_t i_parent; //< index of the enclosing scope (UINT32_MAX for a file)
+    double inclusive;
+    double exclusive;
+};
+
+struct Aggregation {
+    HashTable64 file_table; //< hash_string(path) -> index into `files`
+    AggregateFile *files;
+    uint32_t n_files;
+    HashTable64 line_table; //< (i_file, index) -> index into `lines`
+    AggregateLine *lines;
+    uint32_t n_lines;
+    HashTable64 scope_table; //< (i_file, index + 1) -> index into `scopes` (0 for the file)
+    AggregateScope *scopes;
+    uint32_t n_scopes;
+    uint64_t n_records;
+    uint64_t n_skipped; //< records we could not make sense of
+};
+
+// Grow `array` (holding `n` elements of the given size) if it is full. The capacity is
+// implied by `n`: 16 elements up to n == 16, otherwise the next power of two.
+static void *grow_array_if_full(void *array, uint32_t n, size_t element_size)
+{
+    if (n != 0 && (n < 16 || (n & (n - 1))))
+        return array;
+    if (n == 0x80000000u)
+        exit_error("too many elements\n");
+    size_t capacity = n ? 2 * (size_t)n : 16;
+    void *result = realloc(array, capacity * element_size);
+    if (!result)
+        exit_error("Out-of-memory growing array to %zu elements.\n", capacity);
+    return result;
+}
+
+static uint32_t aggregate_intern_file(Aggregation *agg, const char *path, size_t path_len)
+{
+    char filename[GIT_MAX_PATH];
+    if (path_len >= sizeof(filename))
+        return UINT32_MAX;
+    memcpy(filename, path, path_len);
+    filename[path_len] = 0;
+    uint64_t key = hash_string(filename, 0);
+    uint32_t *i_file = hash_table_find(&agg->file_table, key);
+    if (i_file) {
+        // XXX @Incomplete A collision of 64-bit path hashes merges the two files.
+        return *i_file;
+    }
+    agg->files = (AggregateFile *)grow_array_if_full(agg->files, agg->n_files, sizeof(AggregateFile));
+    AggregateFile *file = agg->files + agg->n_files;
+    *file = AggregateFile();
+    file->path = (char *)malloc(path_len + 1);
+    if (!file->path)
+        exit_error("Out-of-memory copying a path.\n");
+    memcpy(file->path, filename, path_len + 1);
+    hash_table_insert(&agg->file_table, key, agg->n_files, nullptr);
+    return agg->n_files++;
+}
+
+static void aggregate_record(Aggregation *agg, char *record)
+{
+    while (isspace((unsigned char)*record))
+        record++;
+    if (!*record || *record == '#')
+        return; // empty line or comment
+    agg->n_records++;
+
+    size_t len = strcspn(record, " \t\r\n");
+    const char *path_end = find_location_path_end(record, record + len);
+    const char *location_end = nullptr;
+    uint32_t query_line = path_end ? parse_location_numbers(path_end + 1, record + len, &location_end) : 0;
+    if (!query_line || location_end != record + len) {
+        agg->n_skipped++;
+        return;
+    }
+    double weight = 1;
+    const char *weight_arg = record + len;
+    while (isspace((unsigned char)*weight_arg))
+        weight_arg++;
+    if (*weight_arg) {
+        char *end;
+        weight = strtod(weight_arg, &end);
+        if (end == weight_arg) {
+            agg->n_skipped++;
+            return;
+        }
+    }
+
+    uint32_t i_file = aggregate_intern_file(agg, record, (size_t)(path_end - record));
+    if (i_file == UINT32_MAX) {
+        agg->n_skipped++;
+        return;
+    }
+    uint64_t key = ((uint64_t)i_file << 32) | (query_line - 1);
+    uint32_t *i_line = hash_table_find(&agg->line_table, key);
+    if (i_line) {
+        agg->lines[*i_line].weight += weight;
+        agg->lines[*i_line].n_records++;
+        return;
+    }
+    agg->lines = (AggregateLine *)grow_array_if_full(agg->lines, agg->n_lines, sizeof(AggregateLine));
+    AggregateLine *line = agg->lines + agg->n_lines;
+    line->i_file = i_file;
+    line->index = query_line - 1;
+    line->n_records = 1;
+    line->weight = weight;
+    hash_table_insert(&agg->line_table, key, agg->n_lines++, nullptr);
+}
+
+// Find or create the scope for the given header line (UINT32_MAX for the file itself).
+static uint32_t aggregate_scope(Aggregation *agg, uint32_t i_file, uint32_t index)
+{
+    uint64_t key = ((uint64_t)i_file << 32) | (uint32_t)(index + 1);
+    uint32_t *i_scope = hash_table_find(&agg->scope_table, key);
+    if (i_scope)
+        return *i_scope;
+
+    uint32_t i_parent = UINT32_MAX;
+    if (index != UINT32_MAX) {
+        // the enclosing scope is the next context line outwards (or the file)
+        i_parent = aggregate_scope(agg, i_file, (uint32_t)enclosing_scope(&agg->files[i_file].file, (int32_t)index));
+    }
+
+    agg->scopes = (AggregateScope *)grow_array_if_full(agg->scopes, agg->n_scopes, sizeof(AggregateScope));
+    AggregateScope *scope = agg->scopes + agg->n_scopes;
+    scope->i_file = i_file;
+    scope->index = index;
+    scope->i_parent = i_parent;
+    scope->inclusive = 0;
+    scope->exclusive = 0;
+    hash_table_insert(&agg->scope_table, key, agg->n_scopes, nullptr);
+    return agg->n_scopes++;
+}
+
+// Parse the files and distribute the weight of each line over its scopes.
+static void aggregate_scopes(Aggregation *agg)
+{
+    for (uint32_t i_file = 0; i_file < agg->n_files; ++i_file) {
+        AggregateFile *file = agg->files + i_file;
+        uint32_t text_size;
+        char *text = read_file(file->path, &text_size, false /* fatal */);
+        file->valid = text != nullptr;
+        if (file->valid)
+            parse_text(&file->file, text, text_size, file->path);
+    }
+
+    for (uint32_t i_line = 0; i_line < agg->n_lines; ++i_line) {
+        AggregateLine *line = agg->lines + i_line;
+        AggregateFile *file = agg->files + line->i_file;
+        if (!file->valid || line->index >= file->file.n_lines) {
+            agg->n_skipped += line->n_records;
+            continue;
+        }
+        // Note: The line itself is not a scope; its weight goes to the innermost context.
+        uint32_t index = (uint32_t)enclosing_scope(&file->file, (int32_t)line->index);
+        uint32_t i_scope = aggregate_scope(agg, line->i_file, index);
+        agg->scopes[i_scope].exclusive += line->weight;
+        for (; i_scope != UINT32_MAX; i_scope = agg->scopes[i_scope].i_parent)
+            agg->scopes[i_scope].inclusive += line->weight;
+    }
+}
+
+// Append "<LINE>: <abbreviated header>" (or the path for a file) to `out`.
+static void render_scope(Aggregation *agg, AggregateScope *scope, ByteBuffer *out)
+{
+    AggregateFile *file = agg->files + scope->i_file;
+    if (scope->index == UINT32_MAX) {
+        buffer_append(out, file->path, strlen(file->path));
+        return;
+    }
+    char number[16];
+    int len = snprintf(number, sizeof(number), "%u: ", scope->index + 1);
+    buffer_append(out, number, (size_t)len);
+    Context ctx;
+    ctx.index = scope->index;
+    ctx.text = file->file.text + file->file.line_info_array[scope->index].start_offset;
+    ctx.language = file->file.language;
+    render_context(&ctx, out);
+}
+
+static void print_weight(double weight)
+{
+    if (weight == (double)(int64_t)weight && weight < 1e15 && weight > -1e15)
+        printf("%14" PRId64, (int64_t)weight);
+    else
+        printf("%14.9g", weight);
+}
+
+static Aggregation *sort_aggregation; // for compare_scopes_by_inclusive_weight
+
+static int compare_scopes_by_inclusive_weight(const void *a, const void *b)
+{
+    const AggregateScope *scope_a = sort_aggregation->scopes + *(const uint32_t *)a;
+    const AggregateScope *scope_b = sort_aggregation->scopes + *(const uint32_t *)b;
+    if (scope_a->inclusive != scope_b->inclusive)
+        return (scope_a->inclusive > scope_b->inclusive) ? -1 : 1;
+    if (scope_a->i_file != scope_b->i_file)
+        return (scope_a->i_file < scope_b->i_file) ? -1 : 1;
+    // the file before its scopes (UINT32_MAX + 1 == 0), then by line
+    return ((uint32_t)(scope_a->index + 1) < (uint32_t)(scope_b->index + 1)) ? -1 : 1;
+}
+
+// Table of all scopes, sorted by inclusive weight.
+static void print_aggregation_table(Aggregation *agg)
+{
+    uint32_t *order = (uint32_t *)malloc(agg->n_scopes * sizeof(uint32_t) + 1);
+    if (!order)
+        exit_error("Out-of-memory allocating sort order.\n");
+    for (uint32_t i = 0; i < agg->n_scopes; ++i)
+        order[i] = i;
+    sort_aggregation = agg;
+    qsort(order, agg->n_scopes, sizeof(uint32_t), compare_scopes_by_inclusive_weight);
+
+    ByteBuffer text = {};
+    printf("%14s %14s  %s\n", "inclusive", "exclusive", "scope");
+    for (uint32_t i = 0; i < agg->n_scopes; ++i) {
+        AggregateScope *scope = agg->scopes + order[i];
+        print_weight(scope->inclusive);
+        putc(' ', stdout);
+        print_weight(scope->exclusive);
+        text.size = 0;
+        if (scope->index != UINT32_MAX) {
+            // qualify scopes with their file name
+            AggregateFile *file = agg->files + scope->i_file;
+            buffer_append(&text, file->path, strlen(file->path));
+            buffer_append(&text, ":", 1);
+        }
+        render_scope(agg, scope, &text);
+        printf("  %.*s\n", (int)text.size, text.data);
+    }
+    free(text.data);
+    free(order);
+}
+
+// One line per scope with exclusive weight: the ';'-separated chain of scopes from the
+// file inwards, followed by the weight (the "folded stacks" input of flame graph tools).
+static void print_aggregation_folded(Aggregation *agg)
+{
+    ByteBuffer text = {};
+    uint32_t *chain = nullptr;
+    uint32_t n_chain_max = 0;
+    for (uint32_t i = 0; i < agg->n_scopes; ++i) {
+        AggregateScope *scope = agg->scopes + i;
+        if (scope->exclusive == 0)
+            continue;
+        uint32_t n_chain = 0;
+        for (uint32_t i_scope = i; i_scope != UINT32_MAX; i_scope = agg->scopes[i_scope].i_parent) {
+            if (n_chain == n_chain_max) {
+                n_chain_max = n_chain_max ? 2 * n_chain_max : 64;
+                chain = (uint32_t *)realloc(chain, n_chain_max * sizeof(uint32_t));
+                if (!chain)
+                    exit_error("Out-of-memory growing scope chain.\n");
+            }
+            chain[n_chain++] = i_scope;
+        }
+        text.size = 0;
+        while (n_chain--) {
+            size_t start = text.size;
+            render_scope(agg, agg->scopes + chain[n_chain], &text);
+            // ';' separates the frames, so it must not appear inside one
+            for (size_t k = start; k < text.size; ++k)
+                if (text.data[k] == ';')
+                    text.data[k] = ',';
+            if (n_chain)
+                buffer_append(&text, ";", 1);
+        }
+        printf("%.*s ", (int)text.size, text.data);
+        if (scope->exclusive == (double)(int64_t)scope->exclusive)
+            printf("%" PRId64 "\n", (int64_t)scope->exclusive);
+        else
+            printf("%.9g\n", scope->exclusive);
+    }
+    free(chain);
+    free(text.data);
+}
+
+static void run_aggregate_mode(bool folded)
+{
+    Aggregation agg = {};
+    ByteBuffer input = {};
+    char chunk[ANNOTATE_CHUNK_SIZE];
+    for (;;) {
+        size_t n_bytes = read_stdin_chunk(chunk, sizeof(chunk));
+        if (n_bytes == 0)
+            break;
+        buffer_append(&input, chunk, n_bytes);
+        size_t line_start = 0;
+        for (;;) {
+            char *newline = (char *)memchr(input.data + line_start, '\n', input.size - line_start);
+            if (!newline)
+                break;
+            *newline = 0;
+            aggregate_record(&agg, input.data + line_start);
+            line_start = (size_t)(newline + 1 - input.data);
+        }
+        memmove(input.data, input.data + line_start, input.size - line_start);
+        input.size -= line_start;
+    }
+    if (input.size) {
+        buffer_append(&input, "", 1);
+        aggregate_record(&agg, input.data);
+    }
+    free(input.data);
+
+    aggregate_scopes(&agg);
+    if (agg.n_skipped)
+        report_error(false, "skipped %" PRIu64 " of %" PRIu64 " records (malformed, unreadable file or line out of range)\n",
+                     agg.n_skipped, agg.n_records);
+    if (folded)
+        print_aggregation_folded(&agg);
+    else
+        print_aggregation_table(&agg);
+
+    for (uint32_t i = 0; i < agg.n_files; ++i) {
+        if (agg.files[i].valid)
+            free_parsed_file(&agg.files[i].file);
+        free(agg.files[i].path);
+    }
+    free(agg.files);
+    free(agg.lines);
+    free(agg.scopes);
+    hash_table_free(&agg.file_table);
+    hash_table_free(&agg.line_table);
+    hash_table_free(&agg.scope_table);
+}
+
+// diff mode (see --diff)
+//
+// A filter for unified diffs (e.g. as a git pager) that replaces the text after the
+// "@@ -a,b +c,d @@" of each hunk header by the whereami information for the innermost
+// scope enclosing all lines the hunk changes in the new version of the file. (git's
+// funcname heuristic only looks at the first line of the hunk.)
+// The new version of each file is read from the working tree or, with --rev, from the
+// git object store, and parsed once when we reach its first hunk.
+
+struct DiffState {
+    GitRepo *repo; //< read new versions of files from here if not nullptr
+    unsigned char commit_sha[GIT_SHA_SIZE];
+    char path[GIT_MAX_PATH]; //< new path of the current file ("" if there is none)
+    bool file_loaded; //< we tried to read and parse `path`
+    bool file_valid;
+    ParsedFile file;
+    ScopeIndex scope_index;
+    ByteBuffer hunk; //< the current hunk (header and lines, each NUL-terminated)
+    bool in_hunk;
+    uint32_t new_line; //< line number in the new file of the next hunk line
+    uint32_t old_remaining; //< number of lines of the old file still to come in the hunk
+    uint32_t new_remaining; //< number of lines of the new file still to come in the hunk
+    int32_t scope; //< common scope of the changed lines so far
+    bool any_change;
+};
+
+// Skip ANSI color sequences (as in `git diff --color`).
+static const char *skip_color_codes(const char *ptr)
+{
+    while (ptr[0] == '\033' && ptr[1] == '[') {
+        ptr += 2;
+        while (*ptr && (isdigit((unsigned char)*ptr) || *ptr == ';'))
+            ptr++;
+        if (*ptr)
+            ptr++;
+    }
+    return ptr;
+}
+
+static void diff_load_file(DiffState *state)
+{
+    state->file_loaded = true;
+    state->file_valid = false;
+    if (!state->path[0])
+        return;
+    uint32_t text_size = 0;
+    char *text = nullptr;
+    if (state->repo) {
+        unsigned char blob_sha[GIT_SHA_SIZE];
+        if (git_find_blob(state->repo, state->commit_sha, state->path, blob_sha)) {
+            ByteBuffer blob = {};
+            text_size = git_read_blob(state->repo, blob_sha, state->path, &blob);
+            text = blob.data;
+        }
+    }
+    else
+        text = read_file(state->path, &text_size, false /* fatal */);
+    if (text) {
+        parse_text(&state->file, text, text_size, state->path);
+        build_scope_index(&state->scope_index, &state->file);
+        state->file_valid = true;
+    }
+}
+
+// Take the changed line with the given number (in the new file) into account.
+static void diff_add_changed_line(DiffState *state, uint32_t line_number)
+{
+    if (!state->file_valid || state->file.n_lines == 0)
+        return;
+    if (line_number < 1)
+        line_number = 1;
+    if (line_number > state->file.n_lines)
+        line_number = state->file.n_lines;
+    int32_t scope = scope_ancestor(&state->scope_index, (int32_t)line_number - 1, 1);
+    state->scope = state->any_change ? scope_lowest_common(&state->scope_index, state->scope, scope) : scope;
+    state->any_change = true;
+}
+
+// Print the buffered hunk, with the rewritten header.
+static void diff_flush_hunk(DiffState *state)
+{
+    if (!state->in_hunk)
+        return;
+    state->in_hunk = false;
+    const char *header = state->hunk.data;
+    if (state->any_change && state->scope >= 0) {
+        // keep everything up to the closing "@@" (and a color reset after it)
+        const char *close = strstr(skip_color_codes(header) + 2, "@@");
+        if (close) {
+            const char *end = close + 2;
+            if (strncmp(end, "\033[m", 3) == 0)
+                end += 3;
+            fwrite(header, 1, (size_t)(end - header), stdout);
+            putc(' ', stdout);
+            print_scope_chain(&state->file, state->scope);
+            putc('\n', stdout);
+            header = nullptr;
+        }
+    }
+    for (const char *ptr = state->hunk.data; ptr < state->hunk.data + state->hunk.size; ) {
+        size_t len = strlen(ptr);
+        if (ptr != state->hunk.data || header) {
+            fwrite(ptr, 1, len, stdout);
+            putc('\n', stdout);
+        }
+        ptr += len + 1;
+    }
+    state->hunk.size = 0;
+}
+
+static void diff_process_line(DiffState *state, char *line)
+{
+    const char *text = skip_color_codes(line);
+
+    if (state->in_hunk && (state->old_remaining || state->new_remaining)) {
+        char kind = *text;
+        if (kind == ' ' || kind == 0) { // some tools strip the space of empty context lines
+            if (state->old_remaining)
+                state->old_remaining--;
+            if (state->new_remaining)
+                state->new_remaining--;
+            state->new_line++;
+        }
+        else if (kind == '+') {
+            if (!state->file_loaded)
+                diff_load_file(state);
+            diff_add_changed_line(state, state->new_line);
+            if (state->new_remaining)
+                state->new_remaining--;
+            state->new_line++;
+        }
+        else if (kind == '-') {
+            // a deletion touches the line that now follows it
+            if (!state->file_loaded)
+                diff_load_file(state);
+            diff_add_changed_line(state, state->new_line);
+            if (state->old_remaining)
+                state->old_remaining--;
+        }
+        else if (kind == '\\') {
+            // "\ No newline at end of file" after the last line of the old (or new) file
+            // may come before the end of the hunk; it changes no counters
+        }
+        else {
+            // not a hunk line after all, the diff is malformed
+            diff_flush_hunk(state);
+            goto not_in_hunk;
+        }
+        buffer_append(&state->hunk, line, strlen(line) + 1);
+        if (!state->old_remaining && !state->new_remaining)
+            diff_flush_hunk(state);
+        return;
+    }
+
+not_in_hunk:
+    if (strncmp(text, "@@ -", 4) == 0) {
+        uint32_t old_count = 1, new_start, new_count = 1;
+        char *end;
+        strtoul(text + 4, &end, 10); // skip the start line in the old file
+        if (*end == ',')
+            old_count = (uint32_t)strtoul(end + 1, &end, 10);
+        if (strncmp(end, " +", 2) == 0) {
+            new_start = (uint32_t)strtoul(end + 2, &end, 10);
+            if (*end == ',')
+                new_count = (uint32_t)strtoul(end + 1, &end, 10);
+            state->in_hunk = true;
+            state->new_line = new_start;
+            state->old_remaining = old_count;
+            state->new_remaining = new_count;
+            state->any_change = false;
+            state->scope = -1;
+            state->hunk.size = 0;
+            buffer_append(&state->hunk, line, strlen(line) + 1);
+            return;
+        }
+    }
+    else if (strncmp(text, "+++ ", 4) == 0) {
+        // the new file name, possibly followed by a TAB and a timestamp
+        const char *name = text + 4;
+        size_t len = strcspn(name, "\t\033");
+        while (len && (name[len - 1] == ' ' || name[len - 1] == '\r'))
+            len--;
+        if (len == 9 && strncmp(name, "/dev/null", 9) == 0)
+            len = 0;
+        // git's default "b/" prefix
+        if (len > 2 && strncmp(name, "b/", 2) == 0) {
+            name += 2;
+            len -= 2;
+        }
+        if (state->file_valid) {
+            free_parsed_file(&state->file);
+            free_scope_index(&state->scope_index);
+        }
+        state->file_valid = false;
+        state->file_loaded = false;
+        if (len >= sizeof(state->path))
+            len = 0;
+        memcpy(state->path, name, len);
+        state->path[len] = 0;
+    }
+    fputs(line, stdout);
+    putc('\n', stdout);
+}
+
+static void run_diff_mode(GitRepo *repo, const char *revision)
+{
+    DiffState state = {};
+    if (repo) {
+        state.repo = repo;
+        git_resolve_revision(repo, revision, state.commit_sha);
+    }
+    ByteBuffer input = {};
+    char chunk[ANNOTATE_CHUNK_SIZE];
+    for (;;) {
+        // Flush before we may block, so the output keeps up with the input.
+        fflush(stdout);
+        size_t n_bytes = read_stdin_chunk(chunk, sizeof(chunk));
+        if (n_bytes == 0)
+            break;
+        buffer_append(&input, chunk, n_bytes);
+        size_t line_start = 0;
+        for (;;) {
+            char *newline = (char *)memchr(input.data + line_start, '\n', input.size - line_start);
+            if (!newline)
+                break;
+            *newline = 0;
+            diff_process_line(&state, input.data + line_start);
+            line_start = (size_t)(newline + 1 - input.data);
+        }
+        memmove(input.data, input.data + line_start, input.size - line_start);
+        input.size -= line_start;
+    }
+    if (input.size) {
+        buffer_append(&input, "", 1);
+        diff_process_line(&state, input.data);
+    }
+    diff_flush_hunk(&state);
+    fflush(stdout);
+
+    if (state.file_valid) {
+        free_parsed_file(&state.file);
+        free_scope_index(&state.scope_index);
+    }
+    free(state.hunk.data);
+    free(input.data);
+}
+
+// query planner
+//
+// The answer for a line only depends on the lines up to it, since contexts always come
+// before the lines they enclose. So a plain query does not need the whole file: we can
+// read it in chunks and stop a line after the last position the query names. That pays
+// off for positions early in large files; for small files and positions near the end,
+// reading the whole file at once is cheaper. Deep into huge files, where even the prefix
+// would take long to parse, we only parse a window above the queried line, starting at a
+// line that closes all scopes (like the pager does); the line number is found by counting
+// newlines, which is much faster than parsing. Such a line is only trusted if it cannot
+// be inside a comment or string that the parser skips. Without one within the window,
+// files of moderate size are parsed from their start after all, and bigger ones get an
+// answer marked as unreliable. Files whose scopes come from braces are parsed from their
+// start, too, since the brace depth at the start of a window is not known. With
+// --index, a file that is in the index is answered from its record without touching the
+// source at all. --stats prints the chosen plan and where the time went on stderr.
+
+enum QueryPlan {
+    PLAN_INDEX, //< answer from the record in the index
+    PLAN_PREFIX, //< read and parse the file up to the queried lines (see read_file_prefix)
+    PLAN_WINDOW, //< parse a window of the file ending at the queried line (see read_file_window)
+    PLAN_FULL, //< read and parse the whole file
+};
+
+static const char *plan_names[] = {"index", "prefix", "window", "full"};
+
+#define PLAN_CHUNK_SIZE (256u << 10) //< read size of PLAN_PREFIX
+#define PLAN_BYTES_PER_LINE 40 //< guess for estimating the size of a prefix from line numbers
+#define PLAN_MAX_PREFIX_SIZE (16u << 20) //< single positions that need a longer prefix are answered with PLAN_WINDOW
+#define PLAN_WINDOW_SIZE (1u << 20) //< how far above the queried line a window may start
+#define PLAN_MAX_FALLBACK_SIZE (64u << 20) //< files up to this size are parsed from their start if a window cannot be
+
+static bool stats_option = false; //< --stats was given
+
+struct QueryStats {
+    QueryPlan plan;
+    uint64_t file_size; //< 0 if unknown
+    uint64_t estimated_size; //< bytes the plan expected to read
+    uint64_t bytes_read;
+    uint32_t n_lines_parsed;
+    double read_time;
+    double parse_time;
+    double answer_time;
+};
+
+static void print_query_stats(QueryStats *stats)
+{
+    fprintf(stderr, "stats: plan=%s file_bytes=%" PRIu64 " estimated_bytes=%" PRIu64 " read_bytes=%" PRIu64
+            " parsed_lines=%u read_ms=%.3f parse_ms=%.3f answer_ms=%.3f\n",
+            plan_names[stats->plan], stats->file_size, stats->estimated_size, stats->bytes_read,
+            stats->n_lines_parsed, 1e3 * stats->read_time, 1e3 * stats->parse_time, 1e3 * stats->answer_time);
+}
+
+// The part of a file that a query needs: up to the line after `last_line` and after the
+// line containing `last_offset`.
+struct QueryExtent {
+    uint32_t last_line; //< 0 if only offsets are named
+    uint64_t last_offset;
+    bool has_offset;
+    bool is_range;
+};
+
+// Find the extent of a position argument (see resolve_position and resolve_range).
+// Returns false if the query needs the whole file (line 0 or an argument we leave for
+// resolve_position to complain about).
+static bool query_extent(const char *arg, QueryExtent *extent)
+{
+    uint32_t *last_line = &extent->last_line;
+    uint64_t *last_offset = &extent->last_offset;
+    bool *has_offset = &extent->has_offset;
+    *last_line = 0;
+    *last_offset = 0;
+    *has_offset = false;
+    extent->is_range = false;
+    for (const char *position = arg; ; ) {
+        char *end = nullptr;
+        if (*position == '@') {
+            uint64_t offset = strtoull(position + 1, &end, 10);
+            if (end == position + 1)
+                return false;
+            if (!*has_offset || offset > *last_offset)
+                *last_offset = offset;
+            *has_offset = true;
+        }
+        else {
+            unsigned long line_number = strtoul(position, &end, 10);
+            if (end == position || line_number == 0 || line_number >= UINT32_MAX)
+                return false;
+            if (line_number > *last_line)
+                *last_line = (uint32_t)line_number;
+            if (*end == ':')
+                strtoul(end + 1, &end, 10);
+        }
+        if (*end == 0)
+            return true;
+        if (end[0] != '.' || end[1] != '.' || position != arg)
+            return false;
+        extent->is_range = true;
+        position = end + 2;
+    }
+}
+
+static uint64_t file_size_or_zero(const char *path)
+{
+#ifdef WIN32
+    WIN32_FILE_ATTRIBUTE_DATA data;
+    if (!::GetFileAttributesExA(path, GetFileExInfoStandard, &data))
+        return 0;
+    return ((uint64_t)data.nFileSizeHigh << 32) | data.nFileSizeLow;
+#elif HAVE_POSIX
+    struct stat st;
+    if (stat(path, &st) != 0)
+        return 0;
+    return (uint64_t)st.st_size;
+#else
+    #pragma warning (suppress : 4996) // gimme fopen
+    FILE *file = fopen(path, "rb");
+    if (!file)
+        return 0;
+    long size = fseek(file, 0, SEEK_END) == 0 ? ftell(file) : -1;
+    fclose(file);
+    return size > 0 ? (uint64_t)size : 0; // XXX @Incomplete ftell is limited to 2 GB on some platforms
+#endif
+}
+
+// Choose how to answer the query `position` (see resolve_position and resolve_range)
+// about the given file from its size and the part of it the query needs (set in `extent`
+// for PLAN_PREFIX).
+static QueryPlan choose_query_plan(const char *filename, const char *position, QueryExtent *extent, QueryStats *stats)
+{
+    stats->file_size = file_size_or_zero(filename);
+    stats->estimated_size = stats->file_size;
+    if (!query_extent(position, extent))
+        return PLAN_FULL;
+    uint64_t estimate = (uint64_t)(extent->last_line + 1) * PLAN_BYTES_PER_LINE;
+    if (extent->has_offset && extent->last_offset + 2 * PLAN_BYTES_PER_LINE > estimate)
+        estimate = extent->last_offset + 2 * PLAN_BYTES_PER_LINE;
+    // Note: The prefix must contain the lines that the engine is chosen by, too (also
+    //       when PLAN_WINDOW falls back to PLAN_PREFIX).
+    if (engine_option == ENGINE_AUTO && has_c_syntax(language_of_filename(filename)) && extent->last_line < ENGINE_SAMPLE_LINES)
+        extent->last_line = ENGINE_SAMPLE_LINES;
+    if (estimate > PLAN_MAX_PREFIX_SIZE && !extent->is_range && stats->file_size > PLAN_MAX_PREFIX_SIZE) {
+        stats->estimated_size = PLAN_WINDOW_SIZE;
+        return PLAN_WINDOW;
+    }
+    if (estimate < (uint64_t)(extent->last_line + 1) * PLAN_BYTES_PER_LINE)
+        estimate = (uint64_t)(extent->last_line + 1) * PLAN_BYTES_PER_LINE;
+    // we read whole chunks
+    estimate = (estimate + PLAN_CHUNK_SIZE - 1) / PLAN_CHUNK_SIZE * PLAN_CHUNK_SIZE;
+    if (estimate >= stats->file_size)
+        return PLAN_FULL;
+    stats->estimated_size = estimate;
+    return PLAN_PREFIX;
+}
+
+// Read the file up to the end of the line after the extent, or all of it if it ends
+// before. Returns a buffer as from read_file, or nullptr if the file cannot be opened
+// (read_file reports why).
+static char *read_file_prefix(const char *filename, QueryExtent *extent, uint32_t *size_out, uint64_t *bytes_read)
+{
+    uint32_t last_line = extent->last_line;
+    uint64_t last_offset = extent->last_offset;
+    bool has_offset = extent->has_offset;
+    #pragma warning (suppress : 4996) // gimme fopen
+    FILE *file = fopen(filename, "rb");
+    if (!file)
+        return nullptr;
+    ByteBuffer buffer = {};
+    uint32_t n_lines_wanted = last_line + 1; // one more, so the last queried line is never the last one parsed
+    uint32_t n_lines_seen = 0;
+    size_t line_start = 0;
+    size_t cut = 0;
+    for (;;) {
+        while (line_start < buffer.size) {
+            const char *newline = (const char *)memchr(buffer.data + line_start, '\n', buffer.size - line_start);
+            if (!newline)
+                break;
+            size_t next_start = (size_t)(newline + 1 - buffer.data);
+            n_lines_seen++;
+            if (has_offset && line_start <= last_offset && last_offset < next_start && n_lines_wanted < n_lines_seen + 1)
+                n_lines_wanted = n_lines_seen + 1;
+            line_start = next_start;
+            // Note: The prefix includes the sample that text_looks_minified judges by.
+            if (n_lines_seen >= n_lines_wanted && (!has_offset || last_offset < line_start)
+                && line_start >= MINIFIED_SAMPLE_SIZE) {
+                cut = line_start;
+                goto done;
+            }
+        }
+        char *chunk = buffer_append(&buffer, nullptr, PLAN_CHUNK_SIZE);
+        size_t n_bytes = fread(chunk, 1, PLAN_CHUNK_SIZE, file);
+        buffer.size -= PLAN_CHUNK_SIZE - n_bytes;
+        if (buffer.size > UINT32_MAX - 2)
+            exit_error("File size > %u bytes is not supported.\n", UINT32_MAX - 2);
+        if (n_bytes == 0) {
+            if (ferror(file))
+                exit_clib_error("could not read file '%s'", filename);
+            cut = buffer.size;
+            break;
+        }
+    }
+done:
+    fclose(file);
+    *bytes_read = buffer.size;
+    buffer.size = cut;
+    buffer_append(&buffer, nullptr, 2); // see read_file
+    *size_out = (uint32_t)cut;
+    return buffer.data;
+}
+
+// Find the start of the line nearest above `offset` (a line start, not below `limit`) at
+// which parse_text can start with a fresh state and still treat the following lines as
+// it does when parsing the whole file: the line closes all scopes (see is_anchor_line)
+// and is not inside a C comment that the parser skips. Returns false if there is no such
+// line or we cannot tell without looking above `limit`.
+// Note: The parser only opens a C comment at the start of a line and closes it at the
+//       first "*/" after that, so the nearest line above a candidate that contains
+//       "*/" or opens a comment decides whether the candidate is inside one.
+static bool find_window_anchor(const char *data, uint64_t size, uint64_t offset, uint64_t limit, Language language,
+                               uint64_t *anchor)
+{
+    // XXX @Incomplete Whether a Python triple-quoted string is open at a line is only
+    //     known by scanning from the start of the file, so windows of Python files have
+    //     no trusted anchor.
+    if (language == LANG_PYTHON)
+        return false;
+    bool c_comments = has_c_syntax(language);
+    const char *newline = (const char *)memchr(data + offset, '\n', (size_t)(size - offset));
+    uint64_t line_end = newline ? (uint64_t)(newline + 1 - data) : size;
+    bool have_candidate = false;
+    uint64_t candidate = 0;
+    for (uint64_t start = offset; ; ) {
+        if (start < offset && c_comments) {
+            // the line [start, line_end) is above the candidate
+            const char *ptr = data + start;
+            const char *end = data + line_end;
+            while (ptr < end && (*ptr == ' ' || *ptr == '\t'))
+                ptr++;
+            bool opens = end - ptr >= 2 && ptr[0] == '/' && ptr[1] == '*';
+            bool closes = false;
+            for (const char *star = opens ? ptr + 2 : ptr; star + 1 < end; ++star) {
+                star = (const char *)memchr(star, '*', (size_t)(end - 1 - star));
+                if (!star)
+                    break;
+                if (star[1] == '/') {
+                    closes = true;
+                    break;
+                }
+            }
+            if (closes && have_candidate)
+                break;
+            if (opens && !closes)
+                have_candidate = false; // inside this comment
+        }
+        if (!have_candidate && is_anchor_line(data + start, data + line_end)) {
+            have_candidate = true;
+            candidate = start;
+            if (!c_comments)
+                break;
+        }
+        if (start == 0)
+            break; // no comment is open at the start of the file
+        uint64_t prev = start - 1;
+        while (prev > 0 && data[prev - 1] != '\n')
+            prev--;
+        if (prev < limit)
+            return false;
+        line_end = start;
+        start = prev;
+    }
+    if (!have_candidate)
+        return false;
+    *anchor = candidate;
+    return true;
+}
+
+// Read the part of the file for PLAN_WINDOW: from the nearest line at most
+// PLAN_WINDOW_SIZE bytes above the queried position at which parsing can start (see
+// find_window_anchor), or the first line of the window if there is none, to the end of
+// the line after the queried one. Returns a buffer as from read_file and sets the position
+// of the window in the file, or returns nullptr if the position is not in the file or
+// the file contains a NUL byte before it (the file is parsed from its start then, which
+// reports such errors as usual).
+static char *read_file_window(const char *filename, QueryExtent *extent, uint32_t *size_out,
+                              uint32_t *line_base, uint64_t *offset_base, bool *anchored, bool *minified,
+                              uint64_t *bytes_read)
+{
+    MappedFile mapped;
+    if (!map_file(filename, &mapped, false /* fatal */))
+        return nullptr;
+    const char *data = (const char *)mapped.data;
+    uint64_t size = mapped.size;
+    char *text = nullptr;
+    *minified = text_looks_minified(data, size); // judged by the start of the file, not the window
+
+    // find the start of the queried line and the number of lines before it
+    // Note: We look for NUL bytes on the way, since parsing stops at the first one.
+    uint64_t line_start = 0;
+    uint64_t n_lines_before = 0;
+    uint64_t target = extent->has_offset ? UINT64_MAX : extent->last_line - 1;
+    uint64_t stop = extent->has_offset ? extent->last_offset : size;
+    if (stop > size)
+        goto fail;
+    while (n_lines_before < target && line_start < stop) {
+        size_t block = (size_t)((stop - line_start < PLAN_CHUNK_SIZE) ? stop - line_start : PLAN_CHUNK_SIZE);
+        if (memchr(data + line_start, 0, block))
+            goto fail;
+        uint32_t n_newlines = count_newlines(data + line_start, block);
+        if (n_lines_before + n_newlines < target || extent->has_offset) {
+            n_lines_before += n_newlines;
+            line_start += block;
+            continue;
+        }
+        while (n_lines_before < target) {
+            line_start = (uint64_t)((const char *)memchr(data + line_start, '\n', block) + 1 - data);
+            n_lines_before++;
+        }
+    }
+    if (!extent->has_offset && (n_lines_before < target || line_start == size))
+        goto fail; // the file ends before the line
+    while (line_start > 0 && data[line_start - 1] != '\n')
+        line_start--; // back to the start of the line containing the offset
+    {
+        // to the end of the line after the queried one
+        uint64_t end = line_start;
+        for (uint32_t i = 0; i < 2 && end < size; ++i) {
+            const char *newline = (const char *)memchr(data + end, '\n', (size_t)(size - end));
+            end = newline ? (uint64_t)(newline + 1 - data) : size;
+        }
+        // up to the anchor line
+        uint64_t limit = (line_start > PLAN_WINDOW_SIZE) ? line_start - PLAN_WINDOW_SIZE : 0;
+        uint64_t start;
+        *anchored = find_window_anchor(data, size, line_start, limit, language_of_filename(filename), &start);
+        if (!*anchored) {
+            // the first line of the window
+            start = limit;
+            if (start > 0)
+                start = (uint64_t)((const char *)memchr(data + limit - 1, '\n', (size_t)(line_start - limit + 1)) + 1 - data);
+        }
+        uint32_t n_lines_back = count_newlines(data + start, (size_t)(line_start - start));
+        if (end - start > UINT32_MAX - 2)
+            goto fail;
+        *size_out = (uint32_t)(end - start);
+        text = (char *)malloc((size_t)*size_out + 2); // see read_file
+        if (!text)
+            exit_error("Out-of-memory allocating buffer for file text (size = %u)\n", *size_out);
+        memcpy(text, data + start, *size_out);
+        text[*size_out] = 0;
+        if (memchr(text, 0, *size_out)) {
+            free(text);
+            text = nullptr;
+            goto fail;
+        }
+        *line_base = (uint32_t)(n_lines_before - n_lines_back);
+        *offset_base = start;
+        *bytes_read = *size_out;
+    }
+fail:
+    unmap_file(&mapped);
+    return text;
+}
+
+// The engine that parse_text uses for the whole file (ENGINE_AUTO decides by the first
+// ENGINE_SAMPLE_LINES lines), so that a window of it can be parsed the same way.
+static Engine engine_of_file(const char *filename)
+{
+    if (engine_option != ENGINE_AUTO)
+        return engine_option;
+    if (!has_c_syntax(language_of_filename(filename)))
+        return ENGINE_INDENTATION;
+    QueryExtent sample = {ENGINE_SAMPLE_LINES, 0, false, false};
+    uint32_t text_size;
+    uint64_t bytes_read;
+    char *text = read_file_prefix(filename, &sample, &text_size, &bytes_read);
+    if (!text)
+        return ENGINE_INDENTATION;
+    ParsedFile file;
+    parse_text(&file, text, text_size, filename);
+    Engine engine = file.brace_engine ? ENGINE_BRACES : ENGINE_INDENTATION;
+    free_parsed_file(&file);
+    return engine;
+}
+
+// Answer the query `position` (see resolve_position and resolve_range) about the given
+// file by parsing it. Returns the exit status.
+static int run_file_query(const char *filename, char *position, QueryStats *stats)
+{
+    char *end = nullptr;
+    uint32_t query_line = strtoul(position, &end, 10);
+    bool is_range = strstr(position, "..") != nullptr;
+    bool is_position = position[0] == '@' || (end && *end == ':');
+    if (end && *end != 0 && !is_position && !is_range)
+        exit_error("expected a line number as the second command-line argument but got: %s\n",
+                   position);
+
+    double start_time = get_time_seconds();
+    QueryExtent extent;
+    stats->plan = choose_query_plan(filename, position, &extent, stats);
+    uint32_t text_size;
+    char *text = nullptr;
+    uint32_t line_base = 0;
+    uint64_t offset_base = 0;
+    bool anchored = true;
+    bool minified = false;
+    if (stats->plan == PLAN_WINDOW) {
+        // Note: Brace depth is not known at the start of a window, so files whose
+        //       scopes are found by braces are parsed from their start.
+        if (engine_of_file(filename) == ENGINE_INDENTATION)
+            text = read_file_window(filename, &extent, &text_size, &line_base, &offset_base, &anchored, &minified,
+                                    &stats->bytes_read);
+        // Note: Without an anchor, the window may give another answer than the whole
+        //       file, so we only settle for an unreliable one if parsing would take long.
+        if (text && !anchored && stats->file_size <= PLAN_MAX_FALLBACK_SIZE) {
+            free(text);
+            text = nullptr;
+        }
+        if (!text)
+            stats->plan = PLAN_PREFIX;
+    }
+    if (stats->plan == PLAN_PREFIX)
+        text = read_file_prefix(filename, &extent, &text_size, &stats->bytes_read);
+    if (!text) {
+        stats->plan = PLAN_FULL;
+        text = read_file(filename, &text_size, true /* fatal */);
+        stats->bytes_read = text_size;
+    }
+    double read_done_time = get_time_seconds();
+    ParsedFile file;
+    Engine saved_engine = engine_option;
+    if (stats->plan == PLAN_WINDOW)
+        engine_option = ENGINE_INDENTATION; // the window alone is no sample to judge the file by
+    parse_text(&file, text, text_size, filename);
+    engine_option = saved_engine;
+    if (stats->plan == PLAN_WINDOW) {
+        file.line_base = line_base;
+        file.offset_base = offset_base;
+        file.unreliable = minified || !anchored;
+        if (query_line && !is_position)
+            query_line -= line_base;
+    }
+    double parse_done_time = get_time_seconds();
+    stats->read_time = read_done_time - start_time;
+    stats->parse_time = parse_done_time - read_done_time;
+    stats->n_lines_parsed = file.n_lines;
+
+    if (is_range) {
+        uint32_t first_line, last_line;
+        resolve_range(&file, position, filename, true /* fatal */, &first_line, &last_line);
+        print_line_range(&file, first_line - 1, last_line);
+        print_answer_end(false);
+    }
+    else {
+        if (is_position)
+            resolve_position(&file, position, filename, true /* fatal */, &query_line);
+
+        if (query_line > file.n_lines)
+            exit_error("line %u is out of range for file '%s' (which has %u lines)\n",
+                       query_line, filename, file.n_lines);
+
+        uint32_t begin_index;
+        uint32_t end_index;
+        if (query_line) {
+            begin_index = query_line - 1;
+            end_index = query_line;
+        }
+        else {
+            begin_index = 0;
+            end_index = file.n_lines;
+        }
+
+        for (uint32_t index = begin_index; index < end_index; ++index) {
+            LineInfo *line_info = file.line_info_array + index;
+            if (!query_line && format_option == FORMAT_TEXT)
+                printf("%5u: %5u<- %2u: ", 1 + index, 1 + line_info->outer_index, line_info->indentation);
+            print_line_contexts(&file, index);
+            if (!query_line && format_option != FORMAT_BINARY)
+                printf("\n");
+        }
+        print_answer_end(query_line && format_option == FORMAT_JSON);
+    }
+    stats->answer_time = get_time_seconds() - parse_done_time;
+
+    free_parsed_file(&file);
+    return 0;
+}
+
+static uint32_t parse_line_number(const char *arg)
+{
+    char *end = nullptr;
+    uint32_t number = strtoul(arg, &end, 10);
+    if (end && *end != 0)
+        exit_error("expected a line number but got: %s\n", arg);
+    return number;
+}
+
+// One line per way of invoking the program (each preceded by the program name).
+static const char *usage_forms[] = {
+    "<SOURCEFILENAME> <LINE>|<LINE>:<COLUMN>|@<OFFSET>",
+    "<SOURCEFILENAME> <FIRSTLINE>..<LASTLINE>",
+    "--index <INDEXFILE> <SOURCEFILENAME> <LINE>",
+    "--lookup <INDEXFILE> <IDENTIFIER>",
+    "--index-shard <K>/<N> <SHARDFILE> [<SOURCEFILENAME>... | -]",
+    "--index-merge <INDEXFILE> <SHARDFILE>...",
+    "--rev <REVISION> <PATH> <LINE> [<PATH> <LINE>...]",
+    "--watch [--compact] <DIRECTORY>",
+    "--annotate",
+    "--search [--first] (<PATTERN> | -e <PATTERN>...) [<SOURCEFILENAME>... | -]",
+    "--aggregate [--folded]",
+    "--diff [--rev <REVISION>]",
+    "--common <SOURCEFILENAME> <LINE> <LINE>...",
+    "--inside <SOURCEFILENAME> <LINE> <SCOPELINE>",
+    "--nav <SOURCEFILENAME> <LINE>",
+    "--children <SOURCEFILENAME> <LINE>",
+    "--outline [--control-flow] <SOURCEFILENAME>",
+    "--folds [--json] <SOURCEFILENAME>",
+    "--tags [--shard <K>/<N>] <TAGSFILE> [<SOURCEFILENAME>... | -]",
+    "--tags-merge <TAGSFILE> <SHARDFILE>...",
+    "--sizes [--shard <K>/<N>] [--top <N> | --json] [<SOURCEFILENAME>... | -]",
+    "--bench-scroll <SOURCEFILENAME> [<WINDOW> [<STEP>]]",
+    "--pager <SOURCEFILENAME>",
+};
+
+#define USAGE_DETAILS \
+               "\n" \
+               "LINE...line number for which to print whereami information, 0 means print all\n" \
+               "    (positions may also be given as LINE:COLUMN or as @OFFSET, a 0-based byte\n" \
+               "    offset, here and in --watch queries)\n" \
+               "FIRSTLINE..LASTLINE...print \"<LINE>\\t<INFO>\" for the first line of the range and\n" \
+               "    for each line whose information differs from that of the line before it.\n" \
+               "    In --watch queries, the answer is ended by an empty line.\n" \
+               "--index...answer the query from an index file instead of parsing the source file\n" \
+               "--lookup...print \"<PATH>:<LINE>\" and the scopes for each scope header in the\n" \
+               "    index that mentions IDENTIFIER (the exit status is 1 if there is none)\n" \
+               "--index-shard...parse the source files whose path hash selects shard K out of N\n" \
+               "    (0 <= K < N) and write their records to SHARDFILE. Without source file\n" \
+               "    arguments (or with \"-\"), file names are read from stdin, one per line.\n" \
+               "--index-merge...combine shard files into one index file\n" \
+               "--rev...read the files from the git repository containing the current directory\n" \
+               "    as of REVISION (a commit id, possibly abbreviated, or a branch or tag name,\n" \
+               "    optionally followed by ~N or ^N). PATHs are relative to the repository root.\n" \
+               "    With several queries, one line is printed for each.\n" \
+               "--watch...keep running and answer queries \"<SOURCEFILENAME> <LINE>\" read from\n" \
+               "    stdin, one line of output per query. Parsed files are kept in memory and\n" \
+               "    files below DIRECTORY are reparsed as soon as they change (Linux only).\n" \
+               "    Queries \":nav <SOURCEFILENAME> <LINE>\" and \":children ...\" are answered\n" \
+               "    like --nav and --children. With --compact, only the text of lines that can\n" \
+               "    appear in answers is kept in memory (files that grow are then parsed again\n" \
+               "    from the start).\n" \
+               "--annotate...copy stdin to stdout, appending a TAB and the whereami information\n" \
+               "    to lines that start with \"<PATH>:<LINE>:\" (grep -n, compiler messages) or\n" \
+               "    end with \"<PATH>:<LINE>[:<COLUMN>]\" (stack traces)\n" \
+               "--search...print \"<PATH>:<LINE>:<text>\" for each line of the given files (or\n" \
+               "    those named on stdin) that contains PATTERN (or any of the patterns given with\n" \
+               "    -e), followed by a TAB and the whereami information like --annotate. With\n" \
+               "    --first, only the first matching line of each file. Patterns are plain\n" \
+               "    strings. The exit status is 1 if nothing matched.\n" \
+               "--aggregate...read records \"<PATH>:<LINE>[:<COLUMN>] [<WEIGHT>]\" from stdin and\n" \
+               "    print the inclusive and exclusive sum of weights per scope, sorted by inclusive\n" \
+               "    weight, or with --folded, one line per scope in the folded-stack format of\n" \
+               "    flame graph tools\n" \
+               "--diff...copy a unified diff from stdin to stdout, replacing the text after the\n" \
+               "    \"@@ ... @@\" of each hunk header by the whereami information for the innermost\n" \
+               "    scope containing all changed lines. The new versions of the files are read\n" \
+               "    from the working tree or, with --rev, from the given revision.\n" \
+               "--common...print the innermost scope enclosing all given lines (and the scopes\n" \
+               "    enclosing it), e.g. for a selection in an editor\n" \
+               "--inside...print \"yes\" if LINE is inside the scope opened by SCOPELINE and \"no\"\n" \
+               "    otherwise (the exit status is 0 or 1, respectively)\n" \
+               "--nav...print the scope of LINE (LINE itself if it opens a scope, otherwise its\n" \
+               "    innermost context) as \"scope=S end=E parent=P first_child=C next_sibling=N\n" \
+               "    children=K\", where E is the last line of the scope and K the number of scopes\n" \
+               "    directly inside it. Line numbers are 1-based, 0 means the file or none.\n" \
+               "--children...print the first lines of the scopes directly inside the scope of LINE\n" \
+               "    (see --nav), separated by spaces\n" \
+               "--outline...print every line that opens a scope, abbreviated like the whereami\n" \
+               "    information and indented by nesting depth. Control flow statements (if, for,\n" \
+               "    while, ...) are only included with --control-flow.\n" \
+               "--folds...print folding ranges for the scopes and multi-line C comments, one per\n" \
+               "    line as \"<FIRSTLINE> <LASTLINE> region|comment\", or with --json as an array\n" \
+               "    of Language Server Protocol FoldingRange objects (zero-based lines, with kind\n" \
+               "    \"comment\" for comments and no kind for scopes)\n" \
+               "--tags...write a sorted ctags-compatible tags file for the scope headers that look\n" \
+               "    like definitions in the given files (or those named on stdin), with scope\n" \
+               "    fields. With --shard, only the files of shard K out of N (see --index-shard).\n" \
+               "--tags-merge...combine tags files written for shards into one\n" \
+               "--sizes...print \"<LINES>\\t<SELFLINES>\\t<BYTES>\\t<SELFBYTES>\\t<PATH>:<LINE>\\t<SCOPE>\"\n" \
+               "    for every scope of the given files (or those named on stdin), with the counts\n" \
+               "    inclusive and exclusive of the scopes inside it. With --top, only the N\n" \
+               "    largest scopes, largest first. With --json, one object per file and line\n" \
+               "    with the scopes as a tree. With --shard, only the files of shard K out of N.\n" \
+               "--bench-scroll...measure the latency of range queries for a window of WINDOW\n" \
+               "    lines (default 60) scrolled through the file STEP lines at a time (default 3)\n" \
+               "--pager...view the file in the terminal with the whereami information of the top\n" \
+               "    line pinned above it. Only the part of the file around the window is parsed.\n" \
+               "\n" \
+               "Any of the above may be preceded by --lang <LANGUAGE> to parse all files as C/C++\n" \
+               "(c), go, rust, javascript, python, shell or yaml, or as the language of a file name\n" \
+               "extension like cpp or py. By default, the language is chosen by the extension of\n" \
+               "each file, and files with unknown extensions are parsed as C/C++.\n" \
+               "They may also be preceded by --engine <ENGINE> to find the contexts in C-like\n" \
+               "languages from indentation (indent), from braces (braces) or from braces only\n" \
+               "where the indentation does not show the structure of the file (auto, the default).\n" \
+               "With --stats, the first three forms print on stderr how the query was answered:\n" \
+               "from the index, by parsing the file up to the queried lines (prefix), by parsing\n" \
+               "up to 1 MB of a big file above the queried line (window) or by parsing all of it\n" \
+               "(full), with the time spent reading, parsing and answering.\n" \
+               "Files missing from the index are answered from their source.\n" \
+               "Answers that may be meaningless (minified files, windows without a line that\n" \
+               "closes all scopes) end in (unreliable).\n" \
+               "With --format json, the first three forms, --rev and --watch print each answer as\n" \
+               "a JSON object {\"line\":N,\"contexts\":[...],\"elided\":B,\"unreliable\":B} on one\n" \
+               "line, with the line number, kind (namespace, type, function, control-flow or\n" \
+               "other), raw header and abbreviated text of each context. --format binary writes\n" \
+               "the same as length-prefixed records, each answer ended by an empty record.\n"
+
+static void print_usage(FILE *file, const char *progname)
+{
+    for (size_t i = 0; i < sizeof(usage_forms) / sizeof(usage_forms[0]); ++i)
+        fprintf(file, "%s %s %s\n", i ? "      " : "Usage:", progname, usage_forms[i]);
+    fputs(USAGE_DETAILS, file);
+}
+
+static void exit_usage_error(const char *progname, const char *message)
+{
+    fprintf(stderr, "error: %s (see usage)\n", message);
+    print_usage(stderr, progname);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv)
+{
+    const char *progname = argv[0] ? argv[0] : "whereami";
+
+    for (int i = 1; i < argc; ++i) {
+        char *arg = argv[i];
+        if (!arg)
+            exit_error("null argument passed on the command line\n");
+        if (strcmp(arg, "--help") == 0 || strcmp(arg, "/?") == 0 || strcmp(arg, "/help") == 0) {
+            print_usage(stdout, progname);
+            return 0;
+        }
+    }
+
+    // --lang, --engine, --format and --stats may precede any of the forms below
+    for (;;) {
+        if (argc >= 2 && strcmp(argv[1], "--stats") == 0) {
+            stats_option = true;
+            argc--;
+            argv++;
+            continue;
+        }
+        if (argc >= 2 && strcmp(argv[1], "--lang") == 0) {
+            if (argc < 3)
+                exit_usage_error(progname, "expected a language after --lang");
+            Language language = language_of_name(argv[2]);
+            if (language == N_LANGUAGES)
+                exit_error("unknown language '%s' (expected c, go, rust, javascript, python, shell, yaml or a file name extension)\n",
+                           argv[2]);
+            language_option = language;
+        }
+        else if (argc >= 2 && strcmp(argv[1], "--engine") == 0) {
+            if (argc < 3)
+                exit_usage_error(progname, "expected auto, indent or braces after --engine");
+            const int n_engines = (int)(sizeof(engine_names) / sizeof(engine_names[0]));
+            int engine = 0;
+            while (engine < n_engines && strcmp(argv[2], engine_names[engine]) != 0)
+                engine++;
+            if (engine == n_engines)
+                exit_error("unknown engine '%s' (expected auto, indent or braces)\n", argv[2]);
+            engine_option = (Engine)engine;
+        }
+        else if (argc >= 2 && strcmp(argv[1], "--format") == 0) {
+            if (argc < 3)
+                exit_usage_error(progname, "expected text, json or binary after --format");
+            const int n_formats = (int)(sizeof(format_names) / sizeof(format_names[0]));
+            int format = 0;
+            while (format < n_formats && strcmp(argv[2], format_names[format]) != 0)
+                format++;
+            if (format == n_formats)
+                exit_error("unknown format '%s' (expected text, json or binary)\n", argv[2]);
+            format_option = (OutputFormat)format;
+        }
+        else
+            break;
+        argc -= 2;
+        argv += 2;
+    }
+    if (format_option != FORMAT_TEXT && argc >= 2 && strncmp(argv[1], "--", 2) == 0 && strcmp(argv[1], "--index") != 0
+        && strcmp(argv[1], "--rev") != 0 && strcmp(argv[1], "--watch") != 0)
+        exit_usage_error(progname, "--format applies to line queries, --index, --rev and --watch only");
+#ifdef WIN32
+    if (format_option == FORMAT_BINARY)
+        _setmode(_fileno(stdout), _O_BINARY);
+#endif
+
+    if (argc >= 2 && strcmp(argv[1], "--index-shard") == 0) {
+        if (argc < 4)
+            exit_usage_error(progname, "expected shard number and shard file name after --index-shard");
+        uint32_t shard, n_shards;
+        char slash;
+        if (sscanf(argv[2], "%u%c%u", &shard, &slash, &n_shards) != 3 || slash != '/'
+            || n_shards == 0 || shard >= n_shards)
+            exit_error("expected a shard specification K/N with 0 <= K < N but got: %s\n", argv[2]);
+        FileList list = {};
+        collect_file_list(&list, argc - 4, argv + 4);
+        build_index_shard(shard, n_shards, argv[3], &list);
+        return 0;
+    }
+
+    if (argc >= 2 && strcmp(argv[1], "--tags") == 0) {
+        uint32_t shard = 0, n_shards = 1;
+        int i_arg = 2;
+        if (argc >= 4 && strcmp(argv[2], "--shard") == 0) {
+            char slash;
+            if (sscanf(argv[3], "%u%c%u", &shard, &slash, &n_shards) != 3 || slash != '/'
+                || n_shards == 0 || shard >= n_shards)
+                exit_error("expected a shard specification K/N with 0 <= K < N but got: %s\n", argv[3]);
+            i_arg = 4;
+        }
+        if (argc <= i_arg)
+            exit_usage_error(progname, "expected tags file name after --tags");
+        FileList list = {};
+        collect_file_list(&list, argc - i_arg - 1, argv + i_arg + 1);
+        build_tags_file(shard, n_shards, argv[i_arg], &list);
+        return 0;
+    }
+
+    if (argc >= 2 && strcmp(argv[1], "--sizes") == 0) {
+        uint32_t shard = 0, n_shards = 1;
+        uint32_t top = 0;
+        bool json = false;
+        int i_arg = 2;
+        for (; i_arg < argc; ++i_arg) {
+            if (strcmp(argv[i_arg], "--json") == 0)
+                json = true;
+            else if (strcmp(argv[i_arg], "--top") == 0 && i_arg + 1 < argc)
+                top = parse_line_number(argv[++i_arg]);
+            else if (strcmp(argv[i_arg], "--shard") == 0 && i_arg + 1 < argc) {
+                char slash;
+                if (sscanf(argv[++i_arg], "%u%c%u", &shard, &slash, &n_shards) != 3 || slash != '/'
+                    || n_shards == 0 || shard >= n_shards)
+                    exit_error("expected a shard specification K/N with 0 <= K < N but got: %s\n", argv[i_arg]);
+            }
+            else
+                break;
+        }
+        if (json && top)
+            exit_usage_error(progname, "--top and --json cannot be combined");
+        FileList list = {};
+        collect_file_list(&list, argc - i_arg, argv + i_arg);
+        print_scope_sizes(shard, n_shards, &list, top, json);
+        return 0;
+    }
+
+    if (argc >= 2 && strcmp(argv[1], "--tags-merge") == 0) {
+        if (argc < 3)
+            exit_usage_error(progname, "expected tags file name after --tags-merge");
+        merge_tags_files(argv[2], argc - 3, argv + 3);
+        return 0;
+    }
+
+    if (argc >= 2 && strcmp(argv[1], "--search") == 0) {
+        int i_arg = 2;
+        bool first_only = i_arg < argc && strcmp(argv[i_arg], "--first") == 0;
+        if (first_only)
+            i_arg++;
+        SearchPatterns search = {};
+        search.patterns = argv + i_arg;
+        if (i_arg < argc && strcmp(argv[i_arg], "-e") == 0) {
+            // collect the patterns in place
+            while (i_arg + 1 < argc && strcmp(argv[i_arg], "-e") == 0) {
+                search.patterns[search.n_patterns++] = argv[i_arg + 1];
+                i_arg += 2;
+            }
+        }
+        else if (i_arg < argc) {
+            search.n_patterns = 1;
+            i_arg++;
+        }
+        if (search.n_patterns == 0)
+            exit_usage_error(progname, "expected a pattern after --search");
+        for (uint32_t i = 0; i < search.n_patterns; ++i)
+            if (!search.patterns[i][0])
+                exit_error("search patterns must not be empty\n");
+        FileList list = {};
+        collect_file_list(&list, argc - i_arg, argv + i_arg);
+        return run_search(&search, &list, first_only) ? 0 : 1;
+    }
+
+    if (argc >= 2 && strcmp(argv[1], "--index-merge") == 0) {
+        if (argc < 3)
+            exit_usage_error(progname, "expected index file name after --index-merge");
+        merge_index_shards(argv[2], argc - 3, argv + 3);
+        return 0;
+    }
+
+    if (argc >= 2 && (strcmp(argv[1], "--common") == 0 || strcmp(argv[1], "--inside") == 0)) {
+        bool inside = strcmp(argv[1], "--inside") == 0;
+        if (inside ? argc != 5 : argc < 5)
+            exit_usage_error(progname, inside ? "expected a file name and two line numbers after --inside"
+                                              : "expected a file name and at least two line numbers after --common");
+        uint32_t text_size;
+        char *text = read_file(argv[2], &text_size, true /* fatal */);
+        ParsedFile file;
+        parse_text(&file, text, text_size, argv[2]);
+        ScopeIndex scope_index;
+        build_scope_index(&scope_index, &file);
+        int32_t indices[2];
+        int32_t scope = -1;
+        for (int i = 3; i < argc; ++i) {
+            uint32_t query_line = parse_line_number(argv[i]);
+            if (query_line == 0 || query_line > file.n_lines)
+                exit_error("line %u is out of range for file '%s' (which has %u lines)\n",
+                           query_line, argv[2], file.n_lines);
+            int32_t index = (int32_t)query_line - 1;
+            if (i < 5)
+                indices[i - 3] = index;
+            if (i == 4)
+                scope = scope_common(&scope_index, indices[0], indices[1]);
+            else if (i > 4)
+                scope = scope_lowest_common(&scope_index, scope, scope_ancestor(&scope_index, index, 1));
+        }
+        int result = 0;
+        if (inside) {
+            result = scope_contains(&scope_index, indices[1], indices[0]) ? 0 : 1;
+            printf(result ? "no\n" : "yes\n");
+        }
+        else
+            print_scope_chain(&file, scope);
+        free_scope_index(&scope_index);
+        free_parsed_file(&file);
+        return result;
+    }
+
+    if (argc >= 2 && (strcmp(argv[1], "--outline") == 0 || strcmp(argv[1], "--folds") == 0)) {
+        bool folds = strcmp(argv[1], "--folds") == 0;
+        bool flag = argc >= 3 && strcmp(argv[2], folds ? "--json" : "--control-flow") == 0;
+        if (argc != (flag ? 4 : 3))
+            exit_usage_error(progname, folds ? "expected a file name after --folds" : "expected a file name after --outline");
+        const char *filename = argv[argc - 1];
+        uint32_t text_size;
+        char *text = read_file(filename, &text_size, true /* fatal */);
+        ParsedFile file;
+        parse_text(&file, text, text_size, filename);
+        if (folds)
+            print_folds(&file, flag);
+        else
+            print_outline(&file, flag);
+        free_parsed_file(&file);
+        return 0;
+    }
+
+    if (argc >= 2 && (strcmp(argv[1], "--nav") == 0 || strcmp(argv[1], "--children") == 0)) {
+        bool children = strcmp(argv[1], "--children") == 0;
+        if (argc != 4)
+            exit_usage_error(progname, children ? "expected a file name and a line number after --children"
+                                                : "expected a file name and a line number after --nav");
+        uint32_t text_size;
+        char *text = read_file(argv[2], &text_size, true /* fatal */);
+        ParsedFile file;
+        parse_text(&file, text, text_size, argv[2]);
+        uint32_t query_line = parse_line_number(argv[3]);
+        if (query_line == 0 || query_line > file.n_lines)
+            exit_error("line %u is out of range for file '%s' (which has %u lines)\n",
+                       query_line, argv[2], file.n_lines);
+        NavIndex nav;
+        build_nav_index(&nav, &file);
+        if (children)
+            print_nav_children(&nav, &file, query_line - 1);
+        else
+            print_nav_info(&nav, &file, query_line - 1);
+        printf("\n");
+        free_nav_index(&nav);
+        free_parsed_file(&file);
+        return 0;
+    }
+
+    if (argc >= 2 && strcmp(argv[1], "--bench-scroll") == 0) {
+        if (argc < 3 || argc > 5)
+            exit_usage_error(progname, "expected a file name and optionally the window size and step after --bench-scroll");
+        uint32_t window = (argc > 3) ? parse_line_number(argv[3]) : 60;
+        uint32_t step = (argc > 4) ? parse_line_number(argv[4]) : 3;
+        if (window == 0 || step == 0)
+            exit_usage_error(progname, "the window size and step must not be 0");
+        bench_scroll(argv[2], window, step);
+        return 0;
+    }
+
+    if (argc >= 2 && strcmp(argv[1], "--pager") == 0) {
+        if (argc != 3)
+            exit_usage_error(progname, "expected a file name after --pager");
+#if !defined(WIN32) && !HAVE_POSIX
+        exit_error("--pager is not supported on this platform\n");
+#endif
+        run_pager(argv[2]);
+        return 0;
+    }
+
+    if (argc >= 2 && strcmp(argv[1], "--diff") == 0) {
+        if (argc == 2) {
+            run_diff_mode(nullptr, nullptr);
+            return 0;
+        }
+        if (argc != 4 || strcmp(argv[2], "--rev") != 0)
+            exit_usage_error(progname, "unexpected arguments after --diff");
+        GitRepo repo;
+        git_open_repo(&repo);
+        git_load_packs(&repo);
+        run_diff_mode(&repo, argv[3]);
+        git_close_repo(&repo);
+        return 0;
+    }
+
+    if (argc >= 2 && strcmp(argv[1], "--aggregate") == 0) {
+        bool folded = argc == 3 && strcmp(argv[2], "--folded") == 0;
+        if (argc != 2 && !folded)
+            exit_usage_error(progname, "unexpected arguments after --aggregate");
+        run_aggregate_mode(folded);
+        return 0;
+    }
+
+    if (argc >= 2 && strcmp(argv[1], "--annotate") == 0) {
+        if (argc != 2)
+            exit_usage_error(progname, "unexpected arguments after --annotate");
+        run_annotate_mode();
+        return 0;
+    }
+
+    if (argc >= 2 && strcmp(argv[1], "--watch") == 0) {
+        bool compact = argc >= 3 && strcmp(argv[2], "--compact") == 0;
+        if (argc != (compact ? 4 : 3))
+            exit_usage_error(progname, "expected a directory after --watch");
+#if !defined(WIN32) && !HAVE_POSIX
+        exit_error("--watch is not supported on this platform\n");
+#endif
+        run_watch_mode(argv[argc - 1], compact);
+        return 0;
+    }
+
+    if (argc >= 2 && strcmp(argv[1], "--rev") == 0) {
+        if (argc < 5 || (argc - 3) % 2 != 0)
+            exit_usage_error(progname, "expected a revision followed by pairs of path and line number after --rev");
+        GitRepo repo;
+        git_open_repo(&repo);
+        git_load_packs(&repo);
+        unsigned char commit_sha[GIT_SHA_SIZE];
+        git_resolve_revision(&repo, argv[2], commit_sha);
+        ParseCache cache = {};
+        bool several = argc > 5;
+        for (int i = 3; i < argc; i += 2) {
+            uint32_t query_line = parse_line_number(argv[i + 1]);
+            print_git_blob_line_contexts(&repo, &cache, commit_sha, normalize_path(argv[i]), query_line);
+            print_answer_end(several || format_option == FORMAT_JSON);
+        }
+        parse_cache_free(&cache);
+        git_close_repo(&repo);
+        return 0;
+    }
+
+    if (argc >= 2 && strcmp(argv[1], "--index") == 0) {
+        if (argc != 5)
+            exit_usage_error(progname, "expected index file, source file and line number after --index");
+        double start_time = get_time_seconds();
+        uint32_t index_size;
+        char *index_data = read_file(argv[2], &index_size, true /* fatal */);
+        IndexHeader *header = check_index_header(index_data, index_size, argv[2]);
+        if (header->n_buckets == 0)
+            exit_error("'%s' is an index shard, use --index-merge to make an index from it\n", argv[2]);
+        const char *path = normalize_path(argv[3]);
+        uint32_t query_line = parse_line_number(argv[4]);
+        IndexRecord record;
+        QueryStats stats = {};
+        int status = 0;
+        if (lookup_index_record(index_data, path, &record)) {
+            stats.plan = PLAN_INDEX;
+            stats.file_size = stats.estimated_size = stats.bytes_read = index_size;
+            double lookup_done_time = get_time_seconds();
+            stats.read_time = lookup_done_time - start_time;
+            if (query_line == 0 || query_line > record.n_lines)
+                exit_error("line %u is out of range for indexed file '%s' (1 to %u)\n",
+                           query_line, path, record.n_lines);
+            print_indexed_line_contexts(&record, query_line - 1);
+            print_answer_end(format_option == FORMAT_JSON);
+            stats.answer_time = get_time_seconds() - lookup_done_time;
+        }
+        else {
+            // answer files missing from the index from their source
+            status = run_file_query(argv[3], argv[4], &stats);
+        }
+        free(index_data);
+        if (stats_option)
+            print_query_stats(&stats);
+        return status;
+    }
+
+    if (argc >= 2 && strcmp(argv[1], "--lookup") == 0) {
+        if (argc != 4)
+            exit_usage_error(progname, "expected index file and identifier after --lookup");
+        MappedFile mapped;
+        map_file(argv[2], &mapped, true /* fatal */);
+        IndexHeader *header = check_index_header((char *)mapped.data, mapped.size, argv[2]);
+        if (header->n_buckets == 0)
+            exit_error("'%s' is an index shard, use --index-merge to make an index from it\n", argv[2]);
+        uint32_t n_matches = print_index_ident_matches((const char *)mapped.data, argv[3]);
+        unmap_file(&mapped);
+        return n_matches ? 0 : 1;
+    }
+
+    if (argc != 3)
+        exit_usage_error(progname, "expected two arguments on the command line");
+
+    QueryStats stats = {};
+    int status = run_file_query(argv[1], argv[2], &stats);
+    if (stats_option)
+        print_query_stats(&stats);
+    return status;
 }